@@ -0,0 +1,90 @@
+/**
+ * @file allocation_check.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Checks that PipelineContext::process() makes no heap allocation once warmed up
+ * @date 2024-02-26
+ *
+ */
+#include <opencv2/opencv.hpp>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "pipeline_context.hpp"
+
+// Dark ellipses on a light background, each circling its own point so the
+// last frame leads smoothly back into the first
+static std::vector<cv::Mat> syntheticFrames(cv::Size size, int objects, int count)
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    struct Blob { double cx, cy, rx, ry, angle, orbit, phase; };
+    std::vector<Blob> blobs;
+    for (int i = 0; i < objects; i++)
+    {
+        double r = 0.04 * size.height;
+        blobs.push_back({unit(rng) * size.width, unit(rng) * size.height, r * (0.5 + unit(rng)), r * (0.3 + 0.7 * unit(rng)),
+                         unit(rng) * CV_PI, 5 + 10 * unit(rng), 2 * CV_PI * unit(rng)});
+    }
+
+    std::vector<cv::Mat> frames;
+    for (int f = 0; f < count; f++)
+    {
+        cv::Mat frame(size, CV_8UC3);
+        for (int y = 0; y < size.height; y++)
+        {
+            uchar *p = frame.ptr<uchar>(y);
+            for (int x = 0; x < size.width; x++)
+            {
+                int level = 200;
+                for (const Blob &b : blobs)
+                {
+                    double t = b.phase + 2 * CV_PI * f / count;
+                    double dx = x - b.cx - b.orbit * std::cos(t), dy = y - b.cy - b.orbit * std::sin(t);
+                    double u = (dx * std::cos(b.angle) + dy * std::sin(b.angle)) / b.rx;
+                    double v = (-dx * std::sin(b.angle) + dy * std::cos(b.angle)) / b.ry;
+                    if (u * u + v * v <= 1)
+                        level = 40;
+                }
+                p[3 * x] = p[3 * x + 1] = p[3 * x + 2] = (uchar)level;
+            }
+        }
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+int main()
+{
+    if (!allocationCountingEnabled())
+    {
+        printf("allocation_check: configure with -DCOUNT_ALLOCATIONS=ON to count allocations\n");
+        return 0;
+    }
+
+    // The same frames go through twice: the first pass grows every buffer
+    // to its largest size, so the second must not allocate at all
+    std::vector<cv::Mat> frames = syntheticFrames(cv::Size(320, 240), 12, 20);
+    PipelineContext context;
+    for (cv::Mat &frame : frames)
+        context.process(frame, 100, 50);
+
+    int failures = 0;
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        if (context.process(frames[i], 100, 50) != 0)
+        {
+            printf("allocation_check: frame %zu failed\n", i);
+            failures++;
+        }
+        else if (context.frameAllocations() != 0)
+        {
+            printf("allocation_check: frame %zu made %llu allocations after warm-up\n", i,
+                   (unsigned long long)context.frameAllocations());
+            failures++;
+        }
+    }
+    printf("allocation_check: %zu frames, %d with allocations, %zu regions in the last\n", frames.size(), failures,
+           context.regions().size());
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+/**
+ * @file batch_recognize.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Headless recognition of a video file or image directory as fast as possible
+ * @date 2024-02-26
+ * 
+ */
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "filters.hpp"
+#include "pipeline.hpp"
+#include "feature_db.hpp"
+#include "embedder.hpp"
+#include "frame_source.hpp"
+#include "stream_server.hpp"
+
+static void usage(const char *name)
+{
+    std::cerr << "Usage: " << name << " <video|image directory> [options]" << std::endl;
+    std::cerr << "  --out <file>        detections CSV (default detections.csv)" << std::endl;
+    std::cerr << "  --db <features>     feature database (.csv or .fdb) to classify against" << std::endl;
+    std::cerr << "  --model <onnx>      classify by DNN embedding instead of Hu moments" << std::endl;
+    std::cerr << "  --batch <n>         batch size the model was exported with (default 20)" << std::endl;
+    std::cerr << "  --threshold <t>     foreground threshold, or auto to follow the lighting (default 100)" << std::endl;
+    std::cerr << "  --min-region <n>    smallest region in pixels (default 500)" << std::endl;
+    std::cerr << "  --threads <n>       threads for the image operators (default all)" << std::endl;
+    std::cerr << "  --incremental       only recompute the tiles that changed since the last frame" << std::endl;
+    std::cerr << "  --metrics <prefix>  write <prefix>.prom and <prefix>_trace.json every 5 s" << std::endl;
+    std::cerr << "  --trace-every <n>   frames between traced frames (default 100)" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return -1;
+    }
+    std::string input = argv[1];
+    std::string out_file = "detections.csv", db_file, model_file, metrics_prefix;
+    int exported_batch = 20, threshold = 100, min_region = 500, trace_every = 100;
+    bool incremental = false;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--incremental") {
+            incremental = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return -1;
+        }
+        if (arg == "--out") out_file = argv[++i];
+        else if (arg == "--db") db_file = argv[++i];
+        else if (arg == "--model") model_file = argv[++i];
+        else if (arg == "--batch") exported_batch = atoi(argv[++i]);
+        else if (arg == "--threshold") {
+            std::string t = argv[++i];
+            threshold = t == "auto" ? AUTO_THRESHOLD : atoi(t.c_str());
+        }
+        else if (arg == "--min-region") min_region = atoi(argv[++i]);
+        else if (arg == "--threads") setFilterThreads(atoi(argv[++i]));
+        else if (arg == "--metrics") metrics_prefix = argv[++i];
+        else if (arg == "--trace-every") trace_every = atoi(argv[++i]);
+        else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // A directory is read image by image, a number is a camera, anything else is opened as a video
+    FrameSource source;
+    if (source.open(input) != 0) {
+        return -1;
+    }
+
+    FeatureDatabase db;
+    if (!db_file.empty() && db.open(db_file) != 0) {
+        return -1;
+    }
+    Embedder embedder;
+    if (!model_file.empty()) {
+        if (embedder.load(model_file, exported_batch) != 0) {
+            return -1;
+        }
+        if (!db.empty() && db.dimension() != embedder.dimension()) {
+            std::cerr << "Error: Feature database does not match the model" << std::endl;
+            return -1;
+        }
+    }
+    else if (!db.empty() && db.dimension() != 7) {
+        std::cerr << "Error: Feature database does not hold Hu moments; pass --model" << std::endl;
+        return -1;
+    }
+
+    FILE *out = fopen(out_file.c_str(), "w");
+    if (!out) {
+        std::cerr << "Error: Unable to open " << out_file << std::endl;
+        return -1;
+    }
+    fprintf(out, "frame,track,label,distance,x,y,w,h\n");
+
+    // Offline input is never dropped: every queue blocks instead
+    Pipeline pipeline;
+    pipeline.addStage("capture", [&](FrameData &d) {
+        return source.read(d.frame);
+    });
+    if (incremental) {
+        IncrementalParams params;
+        params.threshold = threshold;
+        params.minRegionSize = min_region;
+        addIncrementalStages(pipeline, params, QUEUE_BLOCK);
+    }
+    else {
+        addSegmentationStages(pipeline, threshold, min_region, QUEUE_BLOCK);
+    }
+
+    EmbeddingBatch batch;
+    pipeline.addStage("classify", [&](FrameData &d) {
+        classifyRegions(d, db, model_file.empty() ? nullptr : &embedder, batch);
+        return true;
+    });
+
+    pipeline.addStage("write", [&](FrameData &d) {
+        for (size_t i = 0; i < d.features.size(); i++) {
+            const RegionFeatures &f = d.features[i];
+            fprintf(out, "%llu,%d,%s,%.6g,%d,%d,%d,%d\n", (unsigned long long)d.index, d.regions[f.label].trackId,
+                    d.matchLabels[i].c_str(), d.matchDistances[i],
+                    f.boundingBox.x, f.boundingBox.y, f.boundingBox.width, f.boundingBox.height);
+        }
+        return true;
+    });
+
+    PipelineMetrics metrics(metrics_prefix.empty() ? 0 : trace_every);
+    pipeline.setMetrics(&metrics);
+    if (!metrics_prefix.empty()) {
+        metrics.startExport(metrics_prefix + ".prom", metrics_prefix + "_trace.json");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    pipeline.run();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    metrics.stopExport();
+    fclose(out);
+
+    // Throughput and where the time went
+    std::vector<StageStats> stats = pipeline.stats();
+    uint64_t frames = stats.back().frames;
+    printf("%llu frames in %.2f s: %.1f fps\n", (unsigned long long)frames, seconds, seconds > 0 ? frames / seconds : 0.0);
+    for (int i = 0; i < metrics.stageCount(); i++) {
+        const LatencyHistogram &h = metrics.stageLatency(i);
+        printf("  %-10s %8.2f ms/frame  p50 %7.2f ms  p99 %7.2f ms\n", metrics.stageName(i).c_str(),
+               h.count() ? h.sum() * 1e-6 / h.count() : 0.0, h.percentile(50) * 1e-6, h.percentile(99) * 1e-6);
+    }
+    printf("  %-10s p50 %7.2f ms  p99 %7.2f ms\n", "latency", metrics.frameLatency().percentile(50) * 1e-6,
+           metrics.frameLatency().percentile(99) * 1e-6);
+    printf("Detections written to %s\n", out_file.c_str());
+    return 0;
+}
@@ -0,0 +1,239 @@
+/**
+ * @file bitmask.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Bit-packed binary masks and word-parallel morphology
+ * @date 2024-02-26
+ *
+ */
+
+#include "bitmask.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void BitMask::create(int rows, int cols)
+{
+    numRows = std::max(rows, 0);
+    numCols = std::max(cols, 0);
+    stride = (numCols + 63) / 64;
+    bits.resize((size_t)numRows * stride);
+}
+
+void BitMask::clear()
+{
+    std::fill(bits.begin(), bits.end(), 0);
+}
+
+void BitMask::packRow(int y, const uchar *pixels)
+{
+    uint64_t *words = row(y);
+    std::fill(words, words + stride, 0);
+    int x = 0;
+#if defined(__SSE2__)
+    // 16 pixels per compare; the chunks never straddle a word
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= numCols; x += 16)
+    {
+        int background = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pixels + x)), zero));
+        words[x >> 6] |= (uint64_t)(~background & 0xFFFF) << (x & 63);
+    }
+#endif
+    for (; x < numCols; x++)
+        if (pixels[x])
+            words[x >> 6] |= 1ULL << (x & 63);
+}
+
+int BitMask::fromMat(const cv::Mat &src)
+{
+    if (src.type() != CV_8UC1)
+    {
+        std::cout << "BitMask expects an 8-bit single-channel image" << std::endl;
+        return -1;
+    }
+    create(src.rows, src.cols);
+    for (int y = 0; y < numRows; y++)
+        packRow(y, src.ptr<uchar>(y));
+    return 0;
+}
+
+void BitMask::toMat(cv::Mat &dst) const
+{
+    // Eight output pixels for each byte of bits
+    static const std::vector<uint64_t> spread = [] {
+        std::vector<uint64_t> table(256);
+        for (int b = 0; b < 256; b++)
+            for (int k = 0; k < 8; k++)
+                if (b & (1 << k))
+                    table[b] |= 0xFFULL << (8 * k);
+        return table;
+    }();
+
+    dst.create(numRows, numCols, CV_8U);
+    for (int y = 0; y < numRows; y++)
+    {
+        const uint64_t *words = row(y);
+        uchar *out = dst.ptr<uchar>(y);
+        int x = 0;
+        for (; x + 8 <= numCols; x += 8)
+        {
+            uint64_t px = spread[(words[x >> 6] >> (x & 63)) & 0xFF];
+            std::memcpy(out + x, &px, 8);
+        }
+        for (; x < numCols; x++)
+            out[x] = get(y, x) ? 255 : 0;
+    }
+}
+
+long long BitMask::count() const
+{
+    long long n = 0;
+    for (uint64_t w : bits)
+        n += __builtin_popcountll(w);
+    return n;
+}
+
+// out bit x = in bit x + d, and 0 past the end of the row
+static void lookAhead(const uint64_t *in, uint64_t *out, int n, int d)
+{
+    int q = d >> 6, r = d & 63;
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t lo = i + q < n ? in[i + q] : 0;
+        uint64_t hi = i + q + 1 < n ? in[i + q + 1] : 0;
+        out[i] = r ? (lo >> r) | (hi << (64 - r)) : lo;
+    }
+}
+
+// out bit x = in bit x - d, and 0 before the start of the row
+static void lookBehind(const uint64_t *in, uint64_t *out, int n, int d)
+{
+    int q = d >> 6, r = d & 63;
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t hi = i - q >= 0 ? in[i - q] : 0;
+        uint64_t lo = i - q - 1 >= 0 ? in[i - q - 1] : 0;
+        out[i] = r ? (hi << r) | (lo >> (64 - r)) : hi;
+    }
+}
+
+struct OrOp { uint64_t operator()(uint64_t a, uint64_t b) const { return a | b; } };
+struct AndOp { uint64_t operator()(uint64_t a, uint64_t b) const { return a & b; } };
+
+// Combines every pixel with the m pixels on either side of it. The window is
+// grown by doubling, so it costs about 2 log2(m) shifted passes per direction
+// instead of 2m. Columns whose window leaves the row are masked off later.
+template <typename Op>
+static void rowPass(const uint64_t *in, uint64_t *out, int n, int m, uint64_t *ahead, uint64_t *behind, uint64_t *shifted, Op op)
+{
+    std::copy(in, in + n, ahead);
+    std::copy(in, in + n, behind);
+    for (int span = 1; span <= m;)
+    {
+        int s = std::min(span, m + 1 - span);
+        lookAhead(ahead, shifted, n, s);
+        for (int i = 0; i < n; i++)
+            ahead[i] = op(ahead[i], shifted[i]);
+        lookBehind(behind, shifted, n, s);
+        for (int i = 0; i < n; i++)
+            behind[i] = op(behind[i], shifted[i]);
+        span += s;
+    }
+    for (int i = 0; i < n; i++)
+        out[i] = op(ahead[i], behind[i]);
+}
+
+// Shared body of the packed erosion() and dilation(): the square kernel is a
+// row pass followed by a column pass, and the cross combines a column pass of
+// the raw rows with the row pass of the centre row.
+template <typename Op>
+static void morphology(const BitMask &in, BitMask &dst, int m, bool cross, Op op, BitMaskScratch &s)
+{
+    int rows = in.rows(), cols = in.cols(), n = in.wordsPerRow();
+    dst.create(rows, cols);
+
+    // Columns whose whole window lies inside the image
+    std::vector<uint64_t> &valid = s.valid;
+    valid.assign(n, 0);
+    for (int x = m; x < cols - m; x++)
+        valid[x >> 6] |= 1ULL << (x & 63);
+
+    std::vector<uint64_t> &ahead = s.ahead, &behind = s.behind, &shifted = s.shifted, &horiz = s.horiz, &acc = s.acc;
+    for (std::vector<uint64_t> *buf : {&ahead, &behind, &shifted, &horiz, &acc})
+        buf->resize(n);
+    BitMask &rowsDone = s.rowPass;
+    if (!cross)
+    {
+        rowsDone.create(rows, cols);
+        for (int y = 0; y < rows; y++)
+            rowPass(in.row(y), rowsDone.row(y), n, m, ahead.data(), behind.data(), shifted.data(), op);
+    }
+    const BitMask &columnInput = cross ? in : rowsDone;
+
+    for (int y = 0; y < rows; y++)
+    {
+        uint64_t *out = dst.row(y);
+        if (y < m || y >= rows - m)
+        {
+            std::fill(out, out + n, 0);
+            continue;
+        }
+        std::copy(columnInput.row(y - m), columnInput.row(y - m) + n, acc.begin());
+        for (int k = y - m + 1; k <= y + m; k++)
+        {
+            const uint64_t *r = columnInput.row(k);
+            for (int i = 0; i < n; i++)
+                acc[i] = op(acc[i], r[i]);
+        }
+        if (cross)
+        {
+            rowPass(in.row(y), horiz.data(), n, m, ahead.data(), behind.data(), shifted.data(), op);
+            for (int i = 0; i < n; i++)
+                acc[i] = op(acc[i], horiz[i]);
+        }
+        for (int i = 0; i < n; i++)
+            out[i] = acc[i] & valid[i];
+    }
+}
+
+// Checks the arguments shared by the packed morphology operators
+static int packedMorphology(const BitMask &src, BitMask &dst, int kernelSize, int connectedness, bool isMax, BitMaskScratch *scratch)
+{
+    if (connectedness != 8 && connectedness != 4)
+    {
+        // Print an error message if the connectedness is neither 4 nor 8
+        std::cout << "Connectedness can only be 4 or 8" << std::endl;
+        dst.create(src.rows(), src.cols());
+        dst.clear();
+        return -1;
+    }
+
+    BitMaskScratch local;
+    BitMaskScratch &s = scratch ? *scratch : local;
+
+    // Output rows read several input rows, so work from a copy if src is dst
+    if (&src == &dst)
+        s.copy = src;
+    const BitMask &in = (&src == &dst) ? s.copy : src;
+
+    int m = std::max(kernelSize / 2, 0);
+    if (isMax)
+        morphology(in, dst, m, connectedness == 4, OrOp(), s);
+    else
+        morphology(in, dst, m, connectedness == 4, AndOp(), s);
+    return 0;
+}
+
+int erosion(const BitMask &src, BitMask &dst, int kernelSize, int connectedness, BitMaskScratch *scratch)
+{
+    return packedMorphology(src, dst, kernelSize, connectedness, false, scratch);
+}
+
+int dilation(const BitMask &src, BitMask &dst, int kernelSize, int connectedness, BitMaskScratch *scratch)
+{
+    return packedMorphology(src, dst, kernelSize, connectedness, true, scratch);
+}
@@ -0,0 +1,347 @@
+/**
+ * @file embedder.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief In-process DNN embedding of object crops
+ * @date 2024-02-26
+ * 
+ */
+
+#include "embedder.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+// ImageNet statistics used by torchvision's Normalize, in RGB order
+static const float imagenetMean[3] = {0.485f, 0.456f, 0.406f};
+static const float imagenetStd[3] = {0.229f, 0.224f, 0.225f};
+
+// (v / 255 - mean) / std as one multiply-add per channel
+static void normalization(float scale[3], float offset[3])
+{
+    for (int c = 0; c < 3; c++)
+    {
+        scale[c] = 1.0f / (255.0f * imagenetStd[c]);
+        offset[c] = -imagenetMean[c] / imagenetStd[c];
+    }
+}
+
+void RoiResampler::Filter::build(int inSize, int outSize)
+{
+    if (inSize == in && outSize == out)
+        return;
+    in = inSize;
+    out = outSize;
+
+    // PIL's bilinear filter: a triangle stretched by the shrink factor, so
+    // every input sample contributes when shrinking
+    double scale = (double)in / out;
+    double filterScale = std::max(scale, 1.0);
+    double support = filterScale;
+    taps = (int)std::ceil(support) * 2 + 1;
+    first.assign(out, 0);
+    count.assign(out, 0);
+    weights.assign((size_t)out * taps, 0.0f);
+    for (int i = 0; i < out; i++)
+    {
+        double center = (i + 0.5) * scale;
+        int x0 = std::max((int)(center - support + 0.5), 0);
+        int x1 = std::min((int)(center + support + 0.5), in);
+        x1 = std::min(x1, x0 + taps);
+        double total = 0.0;
+        float *w = &weights[(size_t)i * taps];
+        for (int x = x0; x < x1; x++)
+        {
+            double t = std::abs((x - center + 0.5) / filterScale);
+            w[x - x0] = (float)std::max(1.0 - t, 0.0);
+            total += w[x - x0];
+        }
+        for (int x = x0; x < x1 && total > 0.0; x++)
+            w[x - x0] = (float)(w[x - x0] / total);
+        first[i] = x0;
+        count[i] = x1 - x0;
+    }
+}
+
+int RoiResampler::resample(const cv::Mat &frame, const cv::Rect &region, float *tensor, cv::Size size)
+{
+    cv::Rect roi = region & cv::Rect(0, 0, frame.cols, frame.rows);
+    if (roi.area() <= 0 || frame.type() != CV_8UC3 || size.area() <= 0)
+        return (-1);
+    xFilter.build(roi.width, size.width);
+    yFilter.build(roi.height, size.height);
+
+    // Horizontal pass over the crop rows, read in place from the frame
+    int rowLen = size.width * 3;
+    rows.resize((size_t)roi.height * rowLen);
+    for (int y = 0; y < roi.height; y++)
+    {
+        const uchar *src = frame.ptr<uchar>(roi.y + y) + roi.x * 3;
+        float *dst = &rows[(size_t)y * rowLen];
+        for (int x = 0; x < size.width; x++)
+        {
+            const uchar *p = src + xFilter.first[x] * 3;
+            const float *w = &xFilter.weights[(size_t)x * xFilter.taps];
+            float b = 0, g = 0, r = 0;
+            for (int t = 0; t < xFilter.count[x]; t++, p += 3)
+            {
+                b += w[t] * p[0];
+                g += w[t] * p[1];
+                r += w[t] * p[2];
+            }
+            dst[3 * x] = b;
+            dst[3 * x + 1] = g;
+            dst[3 * x + 2] = r;
+        }
+    }
+
+    // Vertical pass, normalized and split into RGB planes on the way out
+    float scale[3], offset[3];
+    normalization(scale, offset);
+    size_t plane = (size_t)size.width * size.height;
+    for (int y = 0; y < size.height; y++)
+    {
+        const float *w = &yFilter.weights[(size_t)y * yFilter.taps];
+        const float *src = &rows[(size_t)yFilter.first[y] * rowLen];
+        float *r = tensor + (size_t)y * size.width;
+        float *g = r + plane, *b = r + 2 * plane;
+        for (int x = 0; x < size.width; x++)
+        {
+            float sb = 0, sg = 0, sr = 0;
+            const float *p = src + 3 * x;
+            for (int t = 0; t < yFilter.count[y]; t++, p += rowLen)
+            {
+                sb += w[t] * p[0];
+                sg += w[t] * p[1];
+                sr += w[t] * p[2];
+            }
+            r[x] = sr * scale[0] + offset[0];
+            g[x] = sg * scale[1] + offset[1];
+            b[x] = sb * scale[2] + offset[2];
+        }
+    }
+    return (0);
+}
+
+int RoiResampler::resample(const cv::Mat &frame, const cv::RotatedRect &roi, float *tensor, cv::Size size)
+{
+    if (frame.empty() || frame.type() != CV_8UC3 || size.area() <= 0 || roi.size.width <= 0 || roi.size.height <= 0)
+        return (-1);
+
+    // Output (x, y) maps to the frame along the rectangle's width and height axes
+    double angle = roi.angle * CV_PI / 180.0;
+    double ca = std::cos(angle), sa = std::sin(angle);
+    double sx = roi.size.width / size.width, sy = roi.size.height / size.height;
+
+    // Average n x n bilinear samples per pixel when shrinking
+    int nx = std::min(std::max((int)std::ceil(sx), 1), 4);
+    int ny = std::min(std::max((int)std::ceil(sy), 1), 4);
+    float norm = 1.0f / (nx * ny);
+
+    float scale[3], offset[3];
+    normalization(scale, offset);
+    size_t plane = (size_t)size.width * size.height;
+    int maxX = frame.cols - 1, maxY = frame.rows - 1;
+    for (int y = 0; y < size.height; y++)
+    {
+        float *r = tensor + (size_t)y * size.width;
+        float *g = r + plane, *b = r + 2 * plane;
+        for (int x = 0; x < size.width; x++)
+        {
+            float acc[3] = {0, 0, 0};
+            for (int j = 0; j < ny; j++)
+            {
+                double v = (y + (j + 0.5) / ny) * sy - roi.size.height * 0.5;
+                for (int i = 0; i < nx; i++)
+                {
+                    double u = (x + (i + 0.5) / nx) * sx - roi.size.width * 0.5;
+                    // Pixel centres are at integer coordinates
+                    double fx = roi.center.x + u * ca - v * sa - 0.5;
+                    double fy = roi.center.y + u * sa + v * ca - 0.5;
+                    fx = std::min(std::max(fx, 0.0), (double)maxX);
+                    fy = std::min(std::max(fy, 0.0), (double)maxY);
+                    int x0 = (int)fx, y0 = (int)fy;
+                    int x1 = std::min(x0 + 1, maxX), y1 = std::min(y0 + 1, maxY);
+                    float ax = (float)(fx - x0), ay = (float)(fy - y0);
+                    const uchar *p00 = frame.ptr<uchar>(y0) + 3 * x0, *p01 = frame.ptr<uchar>(y0) + 3 * x1;
+                    const uchar *p10 = frame.ptr<uchar>(y1) + 3 * x0, *p11 = frame.ptr<uchar>(y1) + 3 * x1;
+                    for (int c = 0; c < 3; c++)
+                    {
+                        float top = p00[c] + ax * (p01[c] - p00[c]);
+                        float bottom = p10[c] + ax * (p11[c] - p10[c]);
+                        acc[c] += top + ay * (bottom - top);
+                    }
+                }
+            }
+            r[x] = acc[2] * norm * scale[0] + offset[0];
+            g[x] = acc[1] * norm * scale[1] + offset[1];
+            b[x] = acc[0] * norm * scale[2] + offset[2];
+        }
+    }
+    return (0);
+}
+
+float *EmbeddingBatch::nextSlot()
+{
+    size_t slot = (size_t)3 * Embedder::inputHeight * Embedder::inputWidth;
+    tensor.resize(tensor.size() + slot);
+    return tensor.data() + tensor.size() - slot;
+}
+
+void EmbeddingBatch::reserve(int n)
+{
+    tensor.reserve((size_t)n * 3 * Embedder::inputHeight * Embedder::inputWidth);
+    tags.reserve(n);
+}
+
+int EmbeddingBatch::add(int key, const cv::Mat &frame, const cv::Rect &roi)
+{
+    size_t used = tensor.size();
+    if (resampler.resample(frame, roi, nextSlot(), cv::Size(Embedder::inputWidth, Embedder::inputHeight)) != 0)
+    {
+        tensor.resize(used);
+        return (-1);
+    }
+    tags.push_back(key);
+    return (0);
+}
+
+int EmbeddingBatch::add(int key, const cv::Mat &frame, const cv::RotatedRect &roi)
+{
+    size_t used = tensor.size();
+    if (resampler.resample(frame, roi, nextSlot(), cv::Size(Embedder::inputWidth, Embedder::inputHeight)) != 0)
+    {
+        tensor.resize(used);
+        return (-1);
+    }
+    tags.push_back(key);
+    return (0);
+}
+
+int EmbeddingBatch::run(Embedder &embedder, cv::Mat &features, std::vector<int> &keys)
+{
+    keys.swap(tags);
+    int result = embedder.embedBatch(tensor.data(), (int)keys.size(), features);
+    clear();
+    return result;
+}
+
+int Embedder::load(const std::string &modelPath, int exportedBatch)
+{
+    dim = 0;
+    try
+    {
+        net = cv::dnn::readNetFromONNX(modelPath);
+    }
+    catch (const cv::Exception &e)
+    {
+        std::cerr << "Unable to load model " << modelPath << ": " << e.what() << std::endl;
+        return (-1);
+    }
+    if (net.empty())
+    {
+        std::cerr << "Unable to load model " << modelPath << std::endl;
+        return (-1);
+    }
+    net.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
+    net.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+
+    // Probe with blank inputs: a batch of two working means any batch does,
+    // otherwise fall back to a batch of one or the exported batch
+    auto probe = [&](int count, cv::Mat &out) {
+        int sizes[4] = {count, 3, inputHeight, inputWidth};
+        padded.create(4, sizes, CV_32F);
+        memset(padded.ptr<float>(), 0, padded.total() * sizeof(float));
+        return forward(padded, count, out, true);
+    };
+    cv::Mat out;
+    if (probe(2, out) == 0)
+        fixedBatch = 0;
+    else if (probe(1, out) == 0)
+        fixedBatch = 1;
+    else if (exportedBatch > 1 && probe(exportedBatch, out) == 0)
+        fixedBatch = exportedBatch;
+    else
+    {
+        std::cerr << "Model " << modelPath << " does not accept 3x" << inputHeight << "x" << inputWidth << " input" << std::endl;
+        return (-1);
+    }
+    dim = out.cols;
+    return (0);
+}
+
+int Embedder::embed(const cv::Mat &image, std::vector<float> &features)
+{
+    return embed(image, cv::Rect(0, 0, image.cols, image.rows), features);
+}
+
+int Embedder::embed(const cv::Mat &frame, const cv::Rect &roi, std::vector<float> &features)
+{
+    if (empty() || single.add(0, frame, roi) != 0)
+        return (-1);
+    if (single.run(*this, singleOut, singleKeys) != 0)
+        return (-1);
+    const float *p = singleOut.ptr<float>(0);
+    features.assign(p, p + dim);
+    return (0);
+}
+
+int Embedder::embedBatch(const float *tensor, int count, cv::Mat &features)
+{
+    if (empty() || count < 0)
+        return (-1);
+    features.create(count, dim, CV_32F);
+    if (count == 0)
+        return (0);
+
+    // One pass for a dynamic batch; chunks of the exported size otherwise,
+    // where only the last chunk is padded with blank slots
+    size_t slot = (size_t)3 * inputHeight * inputWidth;
+    int chunk = fixedBatch > 0 ? fixedBatch : count;
+    int sizes[4] = {chunk, 3, inputHeight, inputWidth};
+    cv::Mat out;
+    for (int start = 0; start < count; start += chunk)
+    {
+        int n = std::min(chunk, count - start);
+        cv::Mat input;
+        if (n == chunk)
+        {
+            // The caller's tensor is passed to the network without a copy
+            input = cv::Mat(4, sizes, CV_32F, const_cast<float *>(tensor + start * slot));
+        }
+        else
+        {
+            padded.create(4, sizes, CV_32F);
+            memcpy(padded.ptr<float>(), tensor + start * slot, n * slot * sizeof(float));
+            memset(padded.ptr<float>() + n * slot, 0, (chunk - n) * slot * sizeof(float));
+            input = padded;
+        }
+        if (forward(input, chunk, out) != 0 || out.cols != dim)
+            return (-1);
+        memcpy(features.ptr<float>(start), out.ptr<float>(), (size_t)n * dim * sizeof(float));
+    }
+    return (0);
+}
+
+int Embedder::forward(const cv::Mat &input, int count, cv::Mat &out, bool quiet)
+{
+    cv::Mat result;
+    try
+    {
+        net.setInput(input);
+        result = net.forward();
+    }
+    catch (const cv::Exception &e)
+    {
+        if (!quiet)
+            std::cerr << "Embedding failed: " << e.what() << std::endl;
+        return (-1);
+    }
+
+    // One embedding per batch slot, whatever the rank of the output, flattened to a row each
+    if (result.empty() || result.type() != CV_32F || result.total() % count != 0)
+        return (-1);
+    out = cv::Mat(count, (int)(result.total() / count), CV_32F, result.ptr<float>()).clone();
+    return (0);
+}
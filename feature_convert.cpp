@@ -0,0 +1,53 @@
+/**
+ * @file feature_convert.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Converts feature databases between CSV and the memory-mapped binary format
+ * @date 2024-02-26
+ * 
+ */
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "feature_db.hpp"
+
+// True if the file name ends with the given extension
+static bool hasExtension(const std::string &name, const std::string &ext)
+{
+    return name.size() >= ext.size() && name.compare(name.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <input> <output> [hu|dnn]" << std::endl;
+        std::cerr << "  Writes the binary format when output ends in .fdb, CSV otherwise." << std::endl;
+        return -1;
+    }
+    std::string input = argv[1], output = argv[2];
+
+    FeatureDatabase db;
+    if (db.open(input) != 0) {
+        return -1;
+    }
+
+    // Tag the kind of features, if given
+    if (argc > 3) {
+        if (strcmp(argv[3], "hu") == 0) {
+            db.setKind(FEATURE_HU_MOMENTS);
+        }
+        else if (strcmp(argv[3], "dnn") == 0) {
+            db.setKind(FEATURE_DNN_EMBEDDING);
+        }
+        else {
+            std::cerr << "Unknown feature kind " << argv[3] << std::endl;
+            return -1;
+        }
+    }
+
+    int result = hasExtension(output, ".fdb") ? db.saveBinary(output) : db.saveCsv(output);
+    if (result != 0) {
+        return -1;
+    }
+    std::cout << "Wrote " << db.size() << " rows of " << db.dimension() << " features ("
+              << db.labels().size() << " labels) to " << output << std::endl;
+    return 0;
+}
@@ -0,0 +1,376 @@
+/**
+ * @file feature_db.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief In-memory store of labelled feature vectors used for object matching
+ * @date 2024-02-26
+ * 
+ */
+
+#include "feature_db.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char featureMagic[8] = {'F', 'E', 'A', 'T', 'D', 'B', '\0', '\0'};
+static const uint32_t featureVersion = 1;
+static const uint32_t featureByteOrder = 0x01020304;
+
+// Read-only mapping of a whole file, unmapped with the last database using it
+struct FeatureDatabase::MappedFile {
+    void *addr = MAP_FAILED;
+    size_t length = 0;
+    ~MappedFile()
+    {
+        if (addr != MAP_FAILED)
+            munmap(addr, length);
+    }
+};
+
+// Largest feature dimension accepted from a binary file
+static const uint32_t maxFeatureDimension = 1 << 16;
+
+// Whether count items of size bytes starting at offset fit in length bytes, without overflowing
+static bool sectionFits(uint64_t offset, uint64_t count, uint64_t size, uint64_t length)
+{
+    return offset <= length && (size == 0 || count <= (length - offset) / size);
+}
+
+// Rounds offset up to a multiple of align
+static uint64_t alignUp(uint64_t offset, uint64_t align)
+{
+    return (offset + align - 1) / align * align;
+}
+
+int FeatureDatabase::open(const std::string &filename)
+{
+    // Binary databases start with the magic bytes
+    char magic[sizeof(featureMagic)] = {0};
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp)
+    {
+        printf("Unable to open feature file\n");
+        return (-1);
+    }
+    size_t got = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+
+    if (got == sizeof(magic) && memcmp(magic, featureMagic, sizeof(magic)) == 0)
+        return map(filename);
+    return load(filename);
+}
+
+int FeatureDatabase::load(const std::string &filename)
+{
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp)
+    {
+        printf("Unable to open feature file\n");
+        return (-1);
+    }
+
+    // Read the whole file in one go and parse it in memory
+    printf("Reading %s\n", filename.c_str());
+    std::string text;
+    char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        text.append(buffer, n);
+    fclose(fp);
+
+    clear();
+    std::vector<float> values;
+    size_t pos = 0;
+    int lineNo = 0;
+    while (pos < text.size())
+    {
+        size_t eol = text.find('\n', pos);
+        if (eol == std::string::npos)
+            eol = text.size();
+        size_t end = eol;
+        if (end > pos && text[end - 1] == '\r')
+            end--;
+        lineNo++;
+
+        // Label up to the first comma, then the feature values
+        size_t comma = text.find(',', pos);
+        if (end > pos && comma != std::string::npos && comma < end)
+        {
+            std::string label = text.substr(pos, comma - pos);
+            values.clear();
+            const char *p = text.c_str() + comma + 1;
+            const char *stop = text.c_str() + end;
+            while (p < stop)
+            {
+                // An empty or unparsable field reads as 0 and leaves p on its own
+                // comma, so the search below steps over exactly one delimiter
+                char *next;
+                float v = strtof(p, &next);
+                if (next > stop)
+                {
+                    v = 0;
+                    next = (char *)p;
+                }
+                values.push_back(v);
+                p = next;
+                while (p < stop && *p != ',')
+                    p++;
+                p++;
+            }
+            if (add(label, values) != 0)
+                printf("Skipping line %d of %s: expected %d values, got %d\n",
+                       lineNo, filename.c_str(), dim, (int)values.size());
+        }
+        pos = eol + 1;
+    }
+    printf("Finished reading CSV file\n");
+    return (0);
+}
+
+int FeatureDatabase::map(const std::string &filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Unable to open feature file\n");
+        return (-1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FeatureFileHeader))
+    {
+        printf("Feature file %s is too short\n", filename.c_str());
+        ::close(fd);
+        return (-1);
+    }
+
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    file->length = (size_t)st.st_size;
+    file->addr = mmap(nullptr, file->length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (file->addr == MAP_FAILED)
+    {
+        printf("Unable to map feature file %s\n", filename.c_str());
+        return (-1);
+    }
+
+    // Validate the header and that every section lies inside the file. The
+    // counts are bounded first, so none of the sizes below can overflow.
+    const char *base = (const char *)file->addr;
+    FeatureFileHeader h;
+    memcpy(&h, base, sizeof(h));
+    bool ok = memcmp(h.magic, featureMagic, sizeof(featureMagic)) == 0 &&
+              h.version == featureVersion && h.byteOrder == featureByteOrder &&
+              h.fileSize == file->length && h.count <= (uint64_t)INT32_MAX &&
+              h.numLabels <= (uint64_t)INT32_MAX &&
+              h.dimension <= maxFeatureDimension && (h.dimension > 0 || h.count == 0) &&
+              h.labelIndexOffset % alignof(int32_t) == 0 && h.featureOffset % 64 == 0 &&
+              h.stringOffsetsOffset % alignof(uint64_t) == 0 &&
+              sectionFits(h.labelIndexOffset, h.count, sizeof(int32_t), h.fileSize) &&
+              sectionFits(h.featureOffset, h.count * h.dimension, sizeof(float), h.fileSize) &&
+              sectionFits(h.stringOffsetsOffset, h.numLabels + 1, sizeof(uint64_t), h.fileSize) &&
+              h.stringDataOffset <= h.fileSize;
+    if (!ok)
+    {
+        printf("Feature file %s has an unsupported or corrupt header\n", filename.c_str());
+        return (-1);
+    }
+
+    clear();
+
+    // Only the distinct label strings are copied out; the rows stay in the
+    // mapping. The strings must run back to back up to the end of the file,
+    // and a name seen twice would leave label ids without a string.
+    const uint64_t *stringOffsets = (const uint64_t *)(base + h.stringOffsetsOffset);
+    uint64_t stringBytes = h.fileSize - h.stringDataOffset;
+    bool labelsOk = stringOffsets[0] == 0 && stringOffsets[h.numLabels] == stringBytes;
+    for (uint64_t i = 0; labelsOk && i < h.numLabels; i++)
+    {
+        uint64_t s = stringOffsets[i], e = stringOffsets[i + 1];
+        labelsOk = s <= e && e <= stringBytes;
+        if (labelsOk)
+        {
+            std::string name(base + h.stringDataOffset + s, e - s);
+            labelsOk = labelIds.find(name) == labelIds.end();
+            if (labelsOk)
+                internLabel(name);
+        }
+    }
+    if (!labelsOk)
+    {
+        printf("Feature file %s has a corrupt label table\n", filename.c_str());
+        clear();
+        return (-1);
+    }
+
+    mappedLabels = (const int32_t *)(base + h.labelIndexOffset);
+    for (uint64_t i = 0; i < h.count; i++)
+    {
+        if (mappedLabels[i] < 0 || (uint64_t)mappedLabels[i] >= h.numLabels)
+        {
+            printf("Feature file %s has a row with an unknown label\n", filename.c_str());
+            clear();
+            return (-1);
+        }
+    }
+    mappedFeatures = (const float *)(base + h.featureOffset);
+    mapping = file;
+    dim = (int)h.dimension;
+    count = (int)h.count;
+    featureKind = (FeatureKind)h.kind;
+    return (0);
+}
+
+int FeatureDatabase::saveBinary(const std::string &filename) const
+{
+    // Lay out the sections
+    FeatureFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, featureMagic, sizeof(featureMagic));
+    h.version = featureVersion;
+    h.byteOrder = featureByteOrder;
+    h.dimension = (uint32_t)dim;
+    h.kind = featureKind;
+    h.count = (uint64_t)count;
+    h.numLabels = labelNames.size();
+    h.labelIndexOffset = sizeof(FeatureFileHeader);
+    h.featureOffset = alignUp(h.labelIndexOffset + h.count * sizeof(int32_t), 64);
+    h.stringOffsetsOffset = alignUp(h.featureOffset + h.count * h.dimension * sizeof(float), 8);
+    h.stringDataOffset = h.stringOffsetsOffset + (h.numLabels + 1) * sizeof(uint64_t);
+
+    std::vector<uint64_t> stringOffsets(1, 0);
+    for (const std::string &name : labelNames)
+        stringOffsets.push_back(stringOffsets.back() + name.size());
+    h.fileSize = h.stringDataOffset + stringOffsets.back();
+
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if (!fp)
+    {
+        printf("Unable to open output file %s\n", filename.c_str());
+        return (-1);
+    }
+
+    // Writes zero bytes up to the given offset
+    auto padTo = [fp](uint64_t offset) {
+        static const char zeros[64] = {0};
+        long pos = ftell(fp);
+        if (pos >= 0 && (uint64_t)pos < offset)
+            fwrite(zeros, 1, (size_t)(offset - pos), fp);
+    };
+
+    fwrite(&h, sizeof(h), 1, fp);
+    for (int i = 0; i < count; i++)
+    {
+        int32_t l = labelIndex(i);
+        fwrite(&l, sizeof(l), 1, fp);
+    }
+    padTo(h.featureOffset);
+    fwrite(data(), sizeof(float), (size_t)count * dim, fp);
+    padTo(h.stringOffsetsOffset);
+    fwrite(stringOffsets.data(), sizeof(uint64_t), stringOffsets.size(), fp);
+    for (const std::string &name : labelNames)
+        fwrite(name.data(), 1, name.size(), fp);
+
+    bool ok = !ferror(fp);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok)
+    {
+        printf("Error writing %s\n", filename.c_str());
+        return (-1);
+    }
+    return (0);
+}
+
+int FeatureDatabase::saveCsv(const std::string &filename) const
+{
+    FILE *fp = fopen(filename.c_str(), "w");
+    if (!fp)
+    {
+        printf("Unable to open output file %s\n", filename.c_str());
+        return (-1);
+    }
+
+    char tmp[64];
+    for (int i = 0; i < count; i++)
+    {
+        fputs(label(i).c_str(), fp);
+        const float *r = row(i);
+        for (int j = 0; j < dim; j++)
+        {
+            // Shortest %g text that reads back as the same float
+            for (int precision = 1; precision <= 9; precision++)
+            {
+                snprintf(tmp, sizeof(tmp), ",%.*g", precision, r[j]);
+                if (strtof(tmp + 1, nullptr) == r[j])
+                    break;
+            }
+            fputs(tmp, fp);
+        }
+        fputc('\n', fp);
+    }
+
+    bool ok = !ferror(fp);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok)
+    {
+        printf("Error writing %s\n", filename.c_str());
+        return (-1);
+    }
+    return (0);
+}
+
+int FeatureDatabase::add(const std::string &label, const std::vector<float> &values)
+{
+    if (values.empty())
+        return (-1);
+    if (count == 0)
+        dim = (int)values.size();
+    else if ((int)values.size() != dim)
+        return (-1);
+
+    detach();
+    features.insert(features.end(), values.begin(), values.end());
+    rowLabels.push_back(internLabel(label));
+    count++;
+    return (0);
+}
+
+void FeatureDatabase::clear()
+{
+    dim = 0;
+    count = 0;
+    featureKind = FEATURE_UNKNOWN;
+    features.clear();
+    rowLabels.clear();
+    labelNames.clear();
+    labelIds.clear();
+    mapping.reset();
+    mappedFeatures = nullptr;
+    mappedLabels = nullptr;
+}
+
+void FeatureDatabase::detach()
+{
+    // Copy the mapped rows into memory so they can be modified
+    if (!mapping)
+        return;
+    features.assign(mappedFeatures, mappedFeatures + (size_t)count * dim);
+    rowLabels.assign(mappedLabels, mappedLabels + count);
+    mapping.reset();
+    mappedFeatures = nullptr;
+    mappedLabels = nullptr;
+}
+
+int FeatureDatabase::internLabel(const std::string &label)
+{
+    auto it = labelIds.find(label);
+    if (it != labelIds.end())
+        return it->second;
+    int id = (int)labelNames.size();
+    labelNames.push_back(label);
+    labelIds.emplace(label, id);
+    return id;
+}
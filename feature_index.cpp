@@ -0,0 +1,54 @@
+/**
+ * @file feature_index.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Builds or extends the HNSW index of a feature database and reports its recall
+ * @date 2024-02-26
+ * 
+ */
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "feature_db.hpp"
+#include "hnsw_index.hpp"
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <features.csv|features.fdb> [k] [efSearch] [M] [efConstruction] [l2|cosine]" << std::endl;
+        std::cerr << "  Writes <features>.hnsw next to the feature file. M, efConstruction and the metric" << std::endl;
+        std::cerr << "  only apply when the index is built from scratch." << std::endl;
+        return -1;
+    }
+    std::string db_file = argv[1];
+    std::string index_file = db_file + ".hnsw";
+    int k = argc > 2 ? atoi(argv[2]) : 10;
+
+    HnswParams params;
+    if (argc > 3) params.efSearch = atoi(argv[3]);
+    if (argc > 4) params.M = atoi(argv[4]);
+    if (argc > 5) params.efConstruction = atoi(argv[5]);
+    if (argc > 6) params.metric = std::string(argv[6]) == "cosine" ? DISTANCE_COSINE : DISTANCE_L2;
+
+    FeatureDatabase db;
+    if (db.open(db_file) != 0) {
+        return -1;
+    }
+
+    // Extend an existing index with the rows added since it was saved
+    HnswIndex index(params);
+    if (index.load(index_file, db) == 0) {
+        std::cout << "Loaded " << index.size() << " rows from " << index_file << std::endl;
+    }
+    int added = index.update(db);
+    if (added < 0) {
+        return -1;
+    }
+    if (added > 0 && index.save(index_file) != 0) {
+        return -1;
+    }
+    std::cout << "Indexed " << added << " new rows, " << index.size() << " in total" << std::endl;
+
+    RecallReport report = measureRecall(index, db, k, std::min(1000, db.size()));
+    std::cout << "recall@" << report.k << " over " << report.queries << " queries: " << report.recall << std::endl;
+    std::cout << "exact search " << report.exactMs << " ms/query, index search " << report.indexMs << " ms/query" << std::endl;
+    return 0;
+}
@@ -0,0 +1,312 @@
+/**
+ * @file feature_match.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Nearest-neighbour search over a FeatureDatabase
+ * @date 2024-02-26
+ * 
+ */
+
+#include "feature_match.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Pool used for large searches, created on first use. Searches keep the
+// returned pointer while they run, so setMatchThreads() never frees a pool in use.
+static std::shared_ptr<ThreadPool> matchPool;
+static int matchThreads = 0;
+static std::mutex matchPoolMutex;
+
+static std::shared_ptr<ThreadPool> pool()
+{
+    std::lock_guard<std::mutex> lock(matchPoolMutex);
+    if (!matchPool)
+        matchPool = std::make_shared<ThreadPool>(matchThreads);
+    return matchPool;
+}
+
+void setMatchThreads(int numThreads)
+{
+    std::lock_guard<std::mutex> lock(matchPoolMutex);
+    matchThreads = numThreads;
+    matchPool.reset();
+}
+
+int getMatchThreads()
+{
+    return pool()->size();
+}
+
+#if defined(__AVX2__)
+static float horizontalSum(__m128 s)
+{
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+static float horizontalSum(__m256 v)
+{
+    return horizontalSum(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+static __m256 multiplyAdd(__m256 a, __m256 b, __m256 c)
+{
+#if defined(__FMA__)
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+#elif defined(__SSE2__)
+static float horizontalSum(__m128 s)
+{
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#endif
+
+// Squared L2 distance between a and b
+static float squaredDistance(const float *a, const float *b, int dim)
+{
+    int j = 0;
+    float sum = 0.0f;
+#if defined(__AVX2__)
+    if (dim >= 8)
+    {
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+        for (; j + 16 <= dim; j += 16)
+        {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + j), _mm256_loadu_ps(b + j));
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + j + 8), _mm256_loadu_ps(b + j + 8));
+            acc0 = multiplyAdd(d0, d0, acc0);
+            acc1 = multiplyAdd(d1, d1, acc1);
+        }
+        for (; j + 8 <= dim; j += 8)
+        {
+            __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + j), _mm256_loadu_ps(b + j));
+            acc0 = multiplyAdd(d, d, acc0);
+        }
+        sum = horizontalSum(_mm256_add_ps(acc0, acc1));
+    }
+    // A 4-wide step keeps short vectors such as Hu moments off the scalar tail
+    for (; j + 4 <= dim; j += 4)
+    {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + j), _mm_loadu_ps(b + j));
+        sum += horizontalSum(_mm_mul_ps(d, d));
+    }
+#elif defined(__SSE2__)
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    for (; j + 8 <= dim; j += 8)
+    {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + j), _mm_loadu_ps(b + j));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + j + 4), _mm_loadu_ps(b + j + 4));
+        acc0 = _mm_add_ps(_mm_mul_ps(d0, d0), acc0);
+        acc1 = _mm_add_ps(_mm_mul_ps(d1, d1), acc1);
+    }
+    for (; j + 4 <= dim; j += 4)
+    {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + j), _mm_loadu_ps(b + j));
+        acc0 = _mm_add_ps(_mm_mul_ps(d, d), acc0);
+    }
+    sum = horizontalSum(_mm_add_ps(acc0, acc1));
+#endif
+    for (; j < dim; j++)
+    {
+        float d = a[j] - b[j];
+        sum += d * d;
+    }
+    return sum;
+}
+
+// Dot product of a and b, and the squared length of a
+static void dotAndNorm(const float *a, const float *b, int dim, float &dot, float &norm)
+{
+    int j = 0;
+    dot = 0.0f;
+    norm = 0.0f;
+#if defined(__AVX2__)
+    if (dim >= 8)
+    {
+        __m256 accDot = _mm256_setzero_ps(), accNorm = _mm256_setzero_ps();
+        for (; j + 8 <= dim; j += 8)
+        {
+            __m256 va = _mm256_loadu_ps(a + j);
+            accDot = multiplyAdd(va, _mm256_loadu_ps(b + j), accDot);
+            accNorm = multiplyAdd(va, va, accNorm);
+        }
+        dot = horizontalSum(accDot);
+        norm = horizontalSum(accNorm);
+    }
+    for (; j + 4 <= dim; j += 4)
+    {
+        __m128 va = _mm_loadu_ps(a + j);
+        dot += horizontalSum(_mm_mul_ps(va, _mm_loadu_ps(b + j)));
+        norm += horizontalSum(_mm_mul_ps(va, va));
+    }
+#elif defined(__SSE2__)
+    __m128 accDot = _mm_setzero_ps(), accNorm = _mm_setzero_ps();
+    for (; j + 4 <= dim; j += 4)
+    {
+        __m128 va = _mm_loadu_ps(a + j);
+        accDot = _mm_add_ps(_mm_mul_ps(va, _mm_loadu_ps(b + j)), accDot);
+        accNorm = _mm_add_ps(_mm_mul_ps(va, va), accNorm);
+    }
+    dot = horizontalSum(accDot);
+    norm = horizontalSum(accNorm);
+#endif
+    for (; j < dim; j++)
+    {
+        dot += a[j] * b[j];
+        norm += a[j] * a[j];
+    }
+}
+
+float featureDistance(const float *a, const float *b, int dim, DistanceMetric metric)
+{
+    if (metric == DISTANCE_L2)
+        return std::sqrt(squaredDistance(a, b, dim));
+    float dot, normA, unused, normB;
+    dotAndNorm(a, b, dim, dot, normA);
+    dotAndNorm(b, b, dim, unused, normB);
+    if (normA <= 0.0f || normB <= 0.0f)
+        return 1.0f;
+    return 1.0f - dot / std::sqrt(normA * normB);
+}
+
+// Scores rows [r0, r1) against the query. L2 scores are squared distances,
+// so the square root is only taken for the rows that are returned.
+class RowScorer {
+public:
+    RowScorer(const FeatureDatabase &db, const float *query, DistanceMetric metric)
+        : db(db), query(query), metric(metric), dim(db.dimension())
+    {
+        float dot;
+        dotAndNorm(query, query, dim, dot, queryNorm);
+        queryNorm = std::sqrt(queryNorm);
+    }
+
+    float score(int i) const
+    {
+        const float *r = db.row(i);
+        if (metric == DISTANCE_L2)
+            return squaredDistance(r, query, dim);
+        float dot, norm;
+        dotAndNorm(r, query, dim, dot, norm);
+        if (norm <= 0.0f || queryNorm <= 0.0f)
+            return 1.0f;
+        return 1.0f - dot / (std::sqrt(norm) * queryNorm);
+    }
+
+    float distance(float score) const
+    {
+        return metric == DISTANCE_L2 ? std::sqrt(score) : score;
+    }
+
+private:
+    const FeatureDatabase &db;
+    const float *query;
+    DistanceMetric metric;
+    int dim;
+    float queryNorm = 0.0f;
+};
+
+// Rows per task; below this a search runs on the calling thread
+static const int minRowsPerTask = 16384;
+
+// Splits rows [0, rows) into chunks, calls prepare(chunks), then runs
+// body(chunk, r0, r1) for each chunk on the pool. Searches too small to split
+// never touch the pool, so it is only created once a database needs it.
+template <typename Prepare, typename Body>
+static int forEachChunk(int rows, Prepare prepare, Body body)
+{
+    if (rows >= 2 * minRowsPerTask)
+    {
+        std::shared_ptr<ThreadPool> p = pool();
+        int chunks = std::max(1, std::min(p->size(), rows / minRowsPerTask));
+        if (chunks > 1)
+        {
+            prepare(chunks);
+            p->parallelFor(chunks, [&](int c) { body(c, (int)((long long)rows * c / chunks), (int)((long long)rows * (c + 1) / chunks)); });
+            return chunks;
+        }
+    }
+    prepare(1);
+    body(0, 0, rows);
+    return 1;
+}
+
+void computeDistances(const FeatureDatabase &db, const float *query, DistanceMetric metric, std::vector<float> &distances)
+{
+    distances.resize(db.size());
+    if (db.empty())
+        return;
+    RowScorer scorer(db, query, metric);
+    forEachChunk(db.size(), [](int) {}, [&](int, int r0, int r1) {
+        for (int i = r0; i < r1; i++)
+            distances[i] = scorer.distance(scorer.score(i));
+    });
+}
+
+// Orders candidates by score, then by row so ties are deterministic
+typedef std::pair<float, int> Candidate;
+
+// Keeps the k smallest candidates seen in a max-heap
+static void keepBest(std::vector<Candidate> &heap, int k, Candidate c)
+{
+    if ((int)heap.size() < k)
+    {
+        heap.push_back(c);
+        std::push_heap(heap.begin(), heap.end());
+    }
+    else if (c < heap.front())
+    {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = c;
+        std::push_heap(heap.begin(), heap.end());
+    }
+}
+
+std::vector<FeatureMatch> findNearest(const FeatureDatabase &db, const float *query, int k, DistanceMetric metric)
+{
+    std::vector<FeatureMatch> matches;
+    if (db.empty() || k <= 0)
+        return matches;
+    k = std::min(k, db.size());
+
+    RowScorer scorer(db, query, metric);
+    std::vector<std::vector<Candidate>> heaps;
+    int chunks = forEachChunk(db.size(), [&](int n) { heaps.resize(n); }, [&](int c, int r0, int r1) {
+        std::vector<Candidate> &heap = heaps[c];
+        heap.reserve(k);
+        for (int i = r0; i < r1; i++)
+        {
+            float s = scorer.score(i);
+            // Most rows lose to the current k-th best and never touch the heap
+            if ((int)heap.size() == k && !(s <= heap.front().first))
+                continue;
+            keepBest(heap, k, Candidate(s, i));
+        }
+    });
+
+    // Merge the per-chunk heaps
+    std::vector<Candidate> best;
+    best.reserve(k);
+    for (int c = 0; c < chunks; c++)
+        for (const Candidate &cand : heaps[c])
+            keepBest(best, k, cand);
+    std::sort_heap(best.begin(), best.end());
+
+    matches.reserve(best.size());
+    for (const Candidate &cand : best)
+        matches.push_back({cand.second, db.labelIndex(cand.second), scorer.distance(cand.first)});
+    return matches;
+}
@@ -7,308 +7,903 @@
  */
 
 #include "filters.hpp"
+#include "bitmask.hpp"
+#include "run_labels.hpp"
+#include "thread_pool.hpp"
+
+#include <climits>
+#include <memory>
+#include <mutex>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Pool shared by the image operators, created on first use. Callers keep the
+// returned pointer for the whole operation, so setFilterThreads() only drops
+// the old pool and the last operation still using it frees it.
+static std::shared_ptr<ThreadPool> filterPool;
+static int filterThreads = 0;
+static std::mutex filterPoolMutex;
+
+static std::shared_ptr<ThreadPool> pool()
+{
+    std::lock_guard<std::mutex> lock(filterPoolMutex);
+    if (!filterPool)
+        filterPool = std::make_shared<ThreadPool>(filterThreads);
+    return filterPool;
+}
 
-int thresholding(cv::Mat& src, cv::Mat& dst ,int threshold)
+void setFilterThreads(int numThreads)
 {
-    // Convert image to grayscale
-    cv::Mat grayscale_img;
-    cv::cvtColor(src, grayscale_img, cv::COLOR_BGR2GRAY);
-    
-    // Apply Gaussian blur to reduce noise
-    cv::GaussianBlur(grayscale_img, grayscale_img, cv::Size(5, 5), 0);
-    
-    // Create temporary image for thresholding
-    cv::Mat temp = cv::Mat::zeros(src.size(), CV_8U);
+    std::lock_guard<std::mutex> lock(filterPoolMutex);
+    filterThreads = numThreads;
+    filterPool.reset();
+}
+
+int getFilterThreads()
+{
+    return pool()->size();
+}
+
+// Number of bands forEachBand() cuts rows [0, rows) into on a pool of
+// `threads`. Each band reads `halo` extra rows on either side, so bands are
+// kept well above the halo height and small images run as a single band.
+static int bandCount(int threads, int rows, int halo)
+{
+    int minRows = std::max(16, 4 * halo);
+    return std::max(1, std::min(threads, rows / minRows));
+}
 
-    // Loop through each pixel
-    for (int i = 0; i < src.rows; i++)
+// Makes room in buffers, if any, for the buffers of `bands` bands
+static void reserveBands(FilterBuffers *buffers, int bands);
+
+// Splits rows [0, rows) into bandCount() bands and runs body(y0, y1, band) for
+// each of them on the pool, after making room for every band in buffers. Every
+// output row is computed exactly as in the serial path.
+template <typename Body>
+static void forEachBand(int rows, int halo, FilterBuffers *buffers, Body body)
+{
+    std::shared_ptr<ThreadPool> p = pool();
+    int bands = bandCount(p->size(), rows, halo);
+    reserveBands(buffers, bands);
+    if (bands == 1)
     {
-        for (int j = 0; j < src.cols; j++)
-        {
-            // Get pixel value
-            uchar pixel_value = grayscale_img.at<uchar>(i, j);
-            
-            // Thresholding
-            if (pixel_value > threshold) {
-                temp.at<uchar>(i, j) = 0;
-            }
-            else {
-                temp.at<uchar>(i, j) = 255;
-            }
-        }
+        body(0, rows, 0);
+        return;
     }
-    
-    // Copy temporary image to output
-    dst = temp.clone();
-    
-    // Return success
-    return 0;
+    // A single captured reference fits std::function's inline storage, so dispatch does not allocate
+    auto run = [&](int b) { body(rows * b / bands, rows * (b + 1) / bands, b); };
+    p->parallelFor(bands, [&run](int b) { run(b); });
 }
 
-int erosion(cv::Mat & src, cv::Mat & dst, int kernelSize, int connectedness)
+// Reflect an out-of-range index back into [0, n) like cv::BORDER_REFLECT_101
+static int reflect101(int i, int n)
 {
-    // Get the number of rows and columns in the source image
-    int num_rows = src.rows;
-    int num_cols = src.cols;
+    if (n == 1)
+        return 0;
+    while (i < 0 || i >= n)
+    {
+        if (i < 0)
+            i = -i;
+        if (i >= n)
+            i = 2 * n - 2 - i;
+    }
+    return i;
+}
 
-    // Initialize the destination image with zeros
-    dst = cv::Mat::zeros(src.size(), src.type());
+// BGR(A) -> luma with the fixed-point weights cvtColor uses for 8-bit images
+static void grayRow(const uchar *bgr, uchar *gray, int n, int channels)
+{
+    if (channels == 1)
+    {
+        std::memcpy(gray, bgr, n);
+        return;
+    }
+    for (int x = 0; x < n; x++, bgr += channels)
+        gray[x] = (uchar)((bgr[0] * 1868 + bgr[1] * 9617 + bgr[2] * 4899 + (1 << 13)) >> 14);
+}
 
-    // Calculate the radius of the kernel
-    int m = kernelSize / 2;
+// Horizontal 1 4 6 4 1 pass. p is the gray row with two reflected pixels on
+// each side, so out[x] is centered on p[x + 2]. Sums fit in 16 bits (<= 4080).
+static void blurRow5(const uchar *p, ushort *out, int n)
+{
+    int x = 0;
+#if defined(__AVX2__)
+    for (; x + 16 <= n; x += 16)
+    {
+        __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + x)));
+        __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + x + 1)));
+        __m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + x + 2)));
+        __m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + x + 3)));
+        __m256i e = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + x + 4)));
+        __m256i s = _mm256_add_epi16(_mm256_add_epi16(a, e), _mm256_slli_epi16(_mm256_add_epi16(b, d), 2));
+        s = _mm256_add_epi16(s, _mm256_add_epi16(_mm256_slli_epi16(c, 2), _mm256_slli_epi16(c, 1)));
+        _mm256_storeu_si256((__m256i *)(out + x), s);
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 8 <= n; x += 8)
+    {
+        __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p + x)), zero);
+        __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p + x + 1)), zero);
+        __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p + x + 2)), zero);
+        __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p + x + 3)), zero);
+        __m128i e = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p + x + 4)), zero);
+        __m128i s = _mm_add_epi16(_mm_add_epi16(a, e), _mm_slli_epi16(_mm_add_epi16(b, d), 2));
+        s = _mm_add_epi16(s, _mm_add_epi16(_mm_slli_epi16(c, 2), _mm_slli_epi16(c, 1)));
+        _mm_storeu_si128((__m128i *)(out + x), s);
+    }
+#endif
+    for (; x < n; x++)
+        out[x] = (ushort)(p[x] + p[x + 4] + 4 * (p[x + 1] + p[x + 3]) + 6 * p[x + 2]);
+}
 
-    // Perform erosion based on the type of connectivity
-    if (connectedness == 8)
+// Vertical 1 4 6 4 1 pass over five row sums, rounded back to 8 bits like
+// GaussianBlur's fixed-point path, then inverted against the threshold.
+// The weighted sum stays below 65536 so everything runs in 16-bit lanes.
+static void blurColThreshold5(const ushort *const r[5], uchar *out, int n, int threshold)
+{
+    int x = 0;
+    threshold = std::min(std::max(threshold, -1), 255);
+#if defined(__AVX2__)
+    const __m256i round = _mm256_set1_epi16(128);
+    const __m256i thr = _mm256_set1_epi16((short)threshold);
+    const __m256i white = _mm256_set1_epi16(255);
+    for (; x + 32 <= n; x += 32)
     {
-        // Iterate over each pixel in the source image
-        for (int i = m; i < num_rows - m; i++)
+        __m256i res[2];
+        for (int k = 0; k < 2; k++)
         {
-            for (int j = m; j < num_cols - m; j++)
-            {
-                // Initialize the minimum value to maximum
-                uchar min_val = 255;
-
-                // Iterate over the kernel region
-                for (int k = -m; k <= m; k++)
-                {
-                    for (int l = -m; l <= m; l++)
-                    {
-                        // Get the pixel value from the source image
-                        uchar pixel = src.at<uchar>(i + k, j + l);
-
-                        // Update the minimum value if the pixel value is smaller
-                        if (pixel < min_val)
-                            min_val = pixel;
-                    }
-                }
-
-                // Assign the minimum value to the destination image
-                dst.at<uchar>(i, j) = min_val;
-            }
+            int o = x + 16 * k;
+            __m256i a = _mm256_loadu_si256((const __m256i *)(r[0] + o));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(r[1] + o));
+            __m256i c = _mm256_loadu_si256((const __m256i *)(r[2] + o));
+            __m256i d = _mm256_loadu_si256((const __m256i *)(r[3] + o));
+            __m256i e = _mm256_loadu_si256((const __m256i *)(r[4] + o));
+            __m256i s = _mm256_add_epi16(_mm256_add_epi16(a, e), _mm256_slli_epi16(_mm256_add_epi16(b, d), 2));
+            s = _mm256_add_epi16(s, _mm256_add_epi16(_mm256_slli_epi16(c, 2), _mm256_slli_epi16(c, 1)));
+            s = _mm256_srli_epi16(_mm256_add_epi16(s, round), 8);
+            res[k] = _mm256_andnot_si256(_mm256_cmpgt_epi16(s, thr), white);
         }
+        // packus works per 128-bit lane, so restore the order afterwards
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(res[0], res[1]), 0xD8);
+        _mm256_storeu_si256((__m256i *)(out + x), packed);
     }
-    else if (connectedness == 4)
+#elif defined(__SSE2__)
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i thr = _mm_set1_epi16((short)threshold);
+    const __m128i white = _mm_set1_epi16(255);
+    for (; x + 16 <= n; x += 16)
     {
-        // Iterate over each pixel in the source image
-        for (int i = m; i < num_rows - m; i++)
+        __m128i res[2];
+        for (int k = 0; k < 2; k++)
         {
-            for (int j = m; j < num_cols - m; j++)
-            {
-                // Initialize the minimum value to maximum
-                uchar min_val = 255;
+            int o = x + 8 * k;
+            __m128i a = _mm_loadu_si128((const __m128i *)(r[0] + o));
+            __m128i b = _mm_loadu_si128((const __m128i *)(r[1] + o));
+            __m128i c = _mm_loadu_si128((const __m128i *)(r[2] + o));
+            __m128i d = _mm_loadu_si128((const __m128i *)(r[3] + o));
+            __m128i e = _mm_loadu_si128((const __m128i *)(r[4] + o));
+            __m128i s = _mm_add_epi16(_mm_add_epi16(a, e), _mm_slli_epi16(_mm_add_epi16(b, d), 2));
+            s = _mm_add_epi16(s, _mm_add_epi16(_mm_slli_epi16(c, 2), _mm_slli_epi16(c, 1)));
+            s = _mm_srli_epi16(_mm_add_epi16(s, round), 8);
+            res[k] = _mm_andnot_si128(_mm_cmpgt_epi16(s, thr), white);
+        }
+        _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(res[0], res[1]));
+    }
+#endif
+    for (; x < n; x++)
+    {
+        int v = (r[0][x] + r[4][x] + 4 * (r[1][x] + r[3][x]) + 6 * r[2][x] + 128) >> 8;
+        out[x] = v > threshold ? 0 : 255;
+    }
+}
 
-                // Iterate over the horizontal and vertical lines in the kernel
-                for (int k = -m; k <= m; k++)
-                {
-                    // Get the pixel value from the source image along the horizontal line
-                    uchar pixel = src.at<uchar>(i + k, j);
-                    
-                    // Update the minimum value if the pixel value is smaller
-                    if (pixel < min_val)
-                        min_val = pixel;
-                }
+// Checks that src is an 8-bit image the threshold kernel can read
+static bool checkThresholdInput(const cv::Mat &src)
+{
+    int channels = src.channels();
+    if (src.depth() != CV_8U || (channels != 1 && channels != 3 && channels != 4))
+    {
+        std::cout << "Thresholding expects an 8-bit BGR image" << std::endl;
+        return false;
+    }
+    return true;
+}
 
-                for (int l = -m; l <= m; l++)
+// Row-streaming form of the fused grayscale -> 5x5 Gaussian blur -> inverted
+// threshold kernel. Only the last five horizontally blurred rows are kept.
+// Rows [y0, y1) are produced in order: out(i) says where row i is written and
+// emit(i, row) is called once it is ready.
+class ThresholdStream
+{
+public:
+    template <typename Out, typename Emit>
+    void run(const cv::Mat &src, int threshold, int y0, int y1, Out out, Emit emit)
+    {
+        int num_rows = src.rows;
+        int num_cols = src.cols;
+        int channels = src.channels();
+
+        // Gray row padded by two reflected pixels on each side, and a ring of five blurred rows
+        padded.resize(num_cols + 4);
+        ring.resize(5 * (size_t)num_cols);
+        int lastRow = std::max(y0 - 2, 0) - 1;
+
+        for (int i = y0; i < y1; i++)
+        {
+            // Bring in every source row the 5-tap window around row i needs
+            int need = std::min(i + 2, num_rows - 1);
+            while (lastRow < need)
+            {
+                lastRow++;
+                uchar *g = padded.data() + 2;
+                grayRow(src.ptr<uchar>(lastRow), g, num_cols, channels);
+                for (int k = 1; k <= 2; k++)
                 {
-                    // Get the pixel value from the source image along the vertical line
-                    uchar pixel = src.at<uchar>(i, j + l);
-                    
-                    // Update the minimum value if the pixel value is smaller
-                    if (pixel < min_val)
-                        min_val = pixel;
+                    g[-k] = g[reflect101(-k, num_cols)];
+                    g[num_cols - 1 + k] = g[reflect101(num_cols - 1 + k, num_cols)];
                 }
-
-                // Assign the minimum value to the destination image
-                dst.at<uchar>(i, j) = min_val;
+                blurRow5(padded.data(), ring.data() + (size_t)(lastRow % 5) * num_cols, num_cols);
             }
+
+            // Vertical pass over the reflected window, then threshold
+            const ushort *rows[5];
+            for (int k = 0; k < 5; k++)
+                rows[k] = ring.data() + (size_t)(reflect101(i + k - 2, num_rows) % 5) * num_cols;
+            uchar *d = out(i);
+            blurColThreshold5(rows, d, num_cols, threshold);
+            emit(i, (const uchar *)d);
         }
     }
-    else
+
+private:
+    std::vector<uchar> padded;
+    std::vector<ushort> ring;
+};
+
+// Min / max selectors used by the morphology engine
+struct MinOp { uchar operator()(uchar a, uchar b) const { return a < b ? a : b; } };
+struct MaxOp { uchar operator()(uchar a, uchar b) const { return a > b ? a : b; } };
+
+// Running min/max of width 2m+1 along one row (van Herk/Gil-Werman).
+// The row is cut into blocks of the window width; g holds the prefix extremum
+// and h the suffix extremum of every block, so each window is op(h[j-m], g[j+m])
+// and the cost per pixel is three comparisons whatever the kernel size.
+// Writes out[j] for j in [m, n - m).
+template <typename Op>
+static void vhgwRow(const uchar *in, uchar *out, int n, int m, uchar *g, uchar *h, Op op)
+{
+    int w = 2 * m + 1;
+    for (int b = 0; b < n; b += w)
     {
-        // Print an error message if the connectedness is neither 4 nor 8
-        std::cout << "Connectedness can only be 4 or 8" << std::endl;
-        return -1;
+        int e = std::min(b + w, n);
+        g[b] = in[b];
+        for (int j = b + 1; j < e; j++)
+            g[j] = op(g[j - 1], in[j]);
+        h[e - 1] = in[e - 1];
+        for (int j = e - 2; j >= b; j--)
+            h[j] = op(h[j + 1], in[j]);
     }
-    return 0;
+    for (int j = m; j < n - m; j++)
+        out[j] = op(h[j - m], g[j + m]);
 }
 
-int dilation(cv::Mat & src, cv::Mat & dst, int kernelSize, int connectedness)
+// Row-streaming erosion/dilation engine behind erosion(), dilation() and
+// preprocessFrame(). Source rows are pushed in order and finished rows come
+// back in order through emit(i, row).
+// 8-connected uses a square kernel: a van Herk/Gil-Werman pass along each row,
+// then the same decomposition down the columns, one whole row at a time.
+// 4-connected uses a cross-shaped kernel: the column pass runs on the raw rows
+// and is combined with a row pass of the centre row.
+// The column pass only needs the current and previous block of 2m+1 rows, so
+// just 2 * (2m+1) rows are kept. Pixels closer than kernelSize / 2 to the
+// border come out 0, exactly as the original per-tap loops left them.
+// A stream can cover a band [y0, y1) of the output: it then expects source rows
+// [firstRow(), endRow()), i.e. the band plus a halo of m rows on each side.
+class MorphStream
 {
-    // Get the number of rows and columns in the source image
-    int num_rows = src.rows;
-    int num_cols = src.cols;
+public:
+    void reset(int rows, int cols, int kernelSize, int connectedness, bool isMax, int y0 = 0, int y1 = -1)
+    {
+        num_rows = rows;
+        num_cols = cols;
+        m = std::max(kernelSize / 2, 0);
+        w = 2 * m + 1;
+        slots = 2 * w;
+        cross = (connectedness == 4);
+        useMax = isMax;
+        bandStart = y0;
+        bandEnd = (y1 < 0) ? rows : y1;
+        first = std::max(bandStart - m, 0);
+        last = std::min(bandEnd + m, rows);
+        next = first;
+        c0 = m;
+        c1 = std::max(num_cols - m, m);
+
+        size_t ringSize = (size_t)slots * num_cols;
+        vIn.resize(ringSize);
+        g.resize(ringSize);
+        h.resize(ringSize);
+        gRow.resize(num_cols);
+        hRow.resize(num_cols);
+        horiz.resize(num_cols);
+        out.assign(num_cols, 0);
+        zero.assign(num_cols, 0);
+    }
 
-    // Initialize the destination image with zeros
-    dst = cv::Mat::zeros(src.size(), src.type());
+    template <typename Emit>
+    void push(const uchar *row, Emit emit)
+    {
+        if (useMax)
+            pushOp(row, MaxOp(), emit);
+        else
+            pushOp(row, MinOp(), emit);
+    }
+
+    // Emit the bottom border rows once every source row has been pushed
+    template <typename Emit>
+    void finish(Emit emit)
+    {
+        for (int i = std::max(std::max(m, num_rows - m), bandStart); i < bandEnd; i++)
+            emit(i, (const uchar *)zero.data());
+    }
 
-    // Calculate the radius of the kernel
-    int m = kernelSize / 2;
+    int firstRow() const { return first; }
+    int endRow() const { return last; }
 
-    // Perform dilation based on the type of connectivity
-    if (connectedness == 8)
+private:
+    uchar *slot(std::vector<uchar> &buf, int r) { return buf.data() + (size_t)(r % slots) * num_cols; }
+
+    template <typename Op, typename Emit>
+    void pushOp(const uchar *row, Op op, Emit emit)
     {
-        // Iterate over each pixel in the source image
-        for (int i = m; i < num_rows - m; i++)
+        int r = next++;
+        int rel = r - first;
+
+        // Input of the column pass: the row pass result, or the raw row for the cross
+        uchar *v = slot(vIn, r);
+        if (cross)
+            std::memcpy(v, row, num_cols);
+        else
+            vhgwRow(row, v, num_cols, m, gRow.data(), hRow.data(), op);
+
+        // Prefix extremum down the current block
+        uchar *gr = slot(g, r);
+        if (rel % w == 0)
+            std::memcpy(gr + c0, v + c0, c1 - c0);
+        else
         {
-            for (int j = m; j < num_cols - m; j++)
-            {
-                // Initialize the maximum value to minimum
-                uchar max_val = 0;
-
-                // Iterate over the kernel region
-                for (int k = -m; k <= m; k++)
-                {
-                    for (int l = -m; l <= m; l++)
-                    {
-                        // Get the pixel value from the source image
-                        uchar pixel = src.at<uchar>(i + k, j + l);
-
-                        // Update the maximum value if the pixel value is larger
-                        if (pixel > max_val)
-                            max_val = pixel;
-                    }
-                }
+            const uchar *prev = slot(g, r - 1);
+            for (int j = c0; j < c1; j++)
+                gr[j] = op(prev[j], v[j]);
+        }
 
-                // Assign the maximum value to the destination image
-                dst.at<uchar>(i, j) = max_val;
+        // Suffix extremum once the block is complete
+        if (rel % w == w - 1 || r == last - 1)
+        {
+            int b = r - rel % w;
+            std::memcpy(slot(h, r) + c0, v + c0, c1 - c0);
+            for (int i = r - 1; i >= b; i--)
+            {
+                const uchar *nextRow = slot(h, i + 1), *cur = slot(vIn, i);
+                uchar *hi = slot(h, i);
+                for (int j = c0; j < c1; j++)
+                    hi[j] = op(nextRow[j], cur[j]);
             }
         }
+
+        // Top border rows are 0; row r - m is complete once row r is in
+        if (r < m)
+        {
+            if (r >= bandStart)
+                emit(r, (const uchar *)zero.data());
+            return;
+        }
+        int i = r - m;
+        if (i < m || i < bandStart)
+            return;
+
+        const uchar *hi = slot(h, i - m), *gi = slot(g, i + m);
+        uchar *o = out.data();
+        for (int j = c0; j < c1; j++)
+            o[j] = op(hi[j], gi[j]);
+        if (cross)
+        {
+            vhgwRow(slot(vIn, i), horiz.data(), num_cols, m, gRow.data(), hRow.data(), op);
+            for (int j = c0; j < c1; j++)
+                o[j] = op(o[j], horiz[j]);
+        }
+        emit(i, (const uchar *)o);
     }
-    else if (connectedness == 4)
+
+    int num_rows = 0, num_cols = 0, m = 0, w = 1, slots = 2, c0 = 0, c1 = 0;
+    int bandStart = 0, bandEnd = 0, first = 0, last = 0, next = 0;
+    bool cross = false, useMax = false;
+    std::vector<uchar> vIn, g, h, gRow, hRow, horiz, out, zero;
+};
+
+// Line buffers of one row band
+struct BandBuffers
+{
+    ThresholdStream threshold;
+    MorphStream dilate, erode;
+    std::vector<uchar> row;
+};
+
+struct FilterBuffers::State
+{
+    std::vector<BandBuffers> bands;
+    cv::Mat copy; ///< Input of an operator whose output is its input
+    BitMask grown; ///< Dilated mask of the packed preprocessFrame()
+    BitMaskScratch morph;
+
+    // Segmentation tables
+    std::vector<int> keptLabels, trackIndex;
+    std::vector<cv::Point2d> keptCentroids;
+    std::vector<cv::Vec3b> colors;
+    std::vector<std::map<int, RegionInfo>::node_type> spareNodes;
+};
+
+FilterBuffers::FilterBuffers() : impl(new State()) {}
+
+FilterBuffers::~FilterBuffers() {}
+
+static void reserveBands(FilterBuffers *buffers, int bands)
+{
+    if (buffers && (int)buffers->state().bands.size() < bands)
+        buffers->state().bands.resize(bands);
+}
+
+// Buffers of one band: the caller's if it passed any, otherwise `local`
+static BandBuffers &bandBuffers(FilterBuffers *buffers, int band, BandBuffers &local)
+{
+    return buffers ? buffers->state().bands[band] : local;
+}
+
+// Copy of src that stays valid while dst is rewritten
+static cv::Mat inputCopy(const cv::Mat &src, FilterBuffers *buffers)
+{
+    if (!buffers)
+        return src.clone();
+    src.copyTo(buffers->state().copy);
+    return buffers->state().copy;
+}
+
+int thresholding(cv::Mat& src, cv::Mat& dst ,int threshold, FilterBuffers *buffers)
+{
+    // Fused grayscale -> 5x5 Gaussian blur -> inverted binary threshold,
+    // streamed over the rows once and written straight into dst
+    if (!checkThresholdInput(src))
+        return -1;
+
+    // Keep a header on src so dst.create() cannot free it if both are the same Mat
+    cv::Mat in = (src.data == dst.data) ? inputCopy(src, buffers) : src;
+    dst.create(in.size(), CV_8U);
+
+    // Each band re-reads two rows above and below for the blur window
+    forEachBand(in.rows, 2, buffers, [&](int y0, int y1, int band) {
+        BandBuffers local;
+        BandBuffers &b = bandBuffers(buffers, band, local);
+        b.threshold.run(in, threshold, y0, y1,
+                        [&](int i) { return dst.ptr<uchar>(i); },
+                        [](int, const uchar *) {});
+    });
+
+    // Return success
+    return 0;
+}
+
+int thresholding(cv::Mat &src, BitMask &dst, int threshold, FilterBuffers *buffers)
+{
+    // Same kernel as thresholding(), but each finished row is packed straight
+    // away, so the byte mask never exists beyond one row per band
+    if (!checkThresholdInput(src))
+        return -1;
+    dst.create(src.rows, src.cols);
+
+    forEachBand(src.rows, 2, buffers, [&](int y0, int y1, int band) {
+        BandBuffers local;
+        BandBuffers &b = bandBuffers(buffers, band, local);
+        b.row.resize(src.cols);
+        b.threshold.run(src, threshold, y0, y1,
+                        [&](int) { return b.row.data(); },
+                        [&](int i, const uchar *r) { dst.packRow(i, r); });
+    });
+    return 0;
+}
+
+int sampleHistogram(const cv::Mat &src, int rowStep, int histogram[256])
+{
+    if (!checkThresholdInput(src))
+        return -1;
+    rowStep = std::max(rowStep, 1);
+
+    // Whole rows convert with the same code as thresholding() and read the
+    // least memory per sample. Consecutive pixels count into four separate
+    // histograms, so equal neighbours do not wait on one counter.
+    int hist[4][256] = {};
+    uchar gray[1024];
+    int samples = 0;
+    for (int y = rowStep / 2; y < src.rows; y += rowStep)
     {
-        // Iterate over each pixel in the source image
-        for (int i = m; i < num_rows - m; i++)
+        const uchar *row = src.ptr<uchar>(y);
+        for (int x0 = 0; x0 < src.cols; x0 += (int)sizeof(gray))
         {
-            for (int j = m; j < num_cols - m; j++)
+            int n = std::min((int)sizeof(gray), src.cols - x0);
+            grayRow(row + (size_t)x0 * src.channels(), gray, n, src.channels());
+            int x = 0;
+            for (; x + 4 <= n; x += 4)
             {
-                // Initialize the maximum value to minimum
-                uchar max_val = 0;
-
-                // Iterate over the horizontal and vertical lines in the kernel
-                for (int k = -m; k <= m; k++)
-                {
-                    // Get the pixel value from the source image along the horizontal line
-                    uchar pixel = src.at<uchar>(i + k, j);
-                    
-                    // Update the maximum value if the pixel value is larger
-                    if (pixel > max_val)
-                        max_val = pixel;
-                }
+                hist[0][gray[x]]++;
+                hist[1][gray[x + 1]]++;
+                hist[2][gray[x + 2]]++;
+                hist[3][gray[x + 3]]++;
+            }
+            for (; x < n; x++)
+                hist[0][gray[x]]++;
+        }
+        samples += src.cols;
+    }
+    for (int v = 0; v < 256; v++)
+        histogram[v] = hist[0][v] + hist[1][v] + hist[2][v] + hist[3][v];
+    return samples;
+}
 
-                for (int l = -m; l <= m; l++)
-                {
-                    // Get the pixel value from the source image along the vertical line
-                    uchar pixel = src.at<uchar>(i, j + l);
-                    
-                    // Update the maximum value if the pixel value is larger
-                    if (pixel > max_val)
-                        max_val = pixel;
-                }
+int otsuThreshold(const int histogram[256], double *separation)
+{
+    double total = 0, sum = 0;
+    for (int v = 0; v < 256; v++)
+    {
+        total += histogram[v];
+        sum += (double)v * histogram[v];
+    }
 
-                // Assign the maximum value to the destination image
-                dst.at<uchar>(i, j) = max_val;
-            }
+    // Between-class variance of the split after level t, for every t. Empty
+    // levels between the classes give a run of equal maxima; the middle of the
+    // run keeps the threshold clear of both classes.
+    int first = 0, last = 0;
+    double bestVariance = -1, bestGap = 0, below = 0, belowSum = 0;
+    for (int t = 0; t < 255; t++)
+    {
+        below += histogram[t];
+        belowSum += (double)t * histogram[t];
+        double above = total - below;
+        if (below == 0 || above == 0)
+            continue;
+        double meanBelow = belowSum / below, meanAbove = (sum - belowSum) / above;
+        double variance = below * above * (meanAbove - meanBelow) * (meanAbove - meanBelow);
+        if (variance > bestVariance * (1 + 1e-9))
+        {
+            bestVariance = variance;
+            first = last = t;
+            bestGap = meanAbove - meanBelow;
         }
+        else if (variance >= bestVariance * (1 - 1e-9) && last == t - 1)
+            last = t;
     }
-    else
+    if (separation)
+        *separation = bestGap;
+    return (first + last) / 2;
+}
+
+AutoThreshold::AutoThreshold(int initial, double smoothing, int rowStep, double minSeparation)
+    : initialValue(initial), step(std::max(rowStep, 1)), current(initial),
+      alpha(std::min(std::max(smoothing, 0.0), 1.0)), minGap(minSeparation), average(initial)
+{
+}
+
+int AutoThreshold::update(const cv::Mat &frame)
+{
+    int histogram[256];
+    if (sampleHistogram(frame, step, histogram) <= 0)
+        return current;
+    double gap = 0;
+    int t = otsuThreshold(histogram, &gap);
+    if (gap < minGap)
+        return current;
+
+    // The first usable frame is taken as is; later ones are blended in
+    average = settled ? average + alpha * (t - average) : t;
+    settled = true;
+    if (std::abs(average - current) >= hold)
+        current = (int)std::lround(average);
+    return current;
+}
+
+void AutoThreshold::setHysteresis(double levels)
+{
+    hold = std::max(levels, 1.0);
+}
+
+void AutoThreshold::reset()
+{
+    current = initialValue;
+    average = initialValue;
+    settled = false;
+}
+
+// Checks the connectedness argument shared by the morphology operators
+static bool checkConnectedness(int connectedness)
+{
+    if (connectedness != 8 && connectedness != 4)
     {
         // Print an error message if the connectedness is neither 4 nor 8
         std::cout << "Connectedness can only be 4 or 8" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Shared body of erosion() and dilation()
+static int morphology(cv::Mat &src, cv::Mat &dst, int kernelSize, int connectedness, bool isMax, FilterBuffers *buffers)
+{
+    // Bands read each other's rows as halo, so work from a copy if src is dst
+    cv::Mat in = (src.data == dst.data) ? inputCopy(src, buffers) : src;
+    if (!checkConnectedness(connectedness))
+    {
+        dst = cv::Mat::zeros(in.size(), in.type());
         return -1;
     }
+    dst.create(in.size(), in.type());
+
+    int halo = std::max(kernelSize / 2, 0);
+    forEachBand(in.rows, halo, buffers, [&](int y0, int y1, int band) {
+        BandBuffers local;
+        BandBuffers &b = bandBuffers(buffers, band, local);
+        MorphStream &stream = isMax ? b.dilate : b.erode;
+        stream.reset(in.rows, in.cols, kernelSize, connectedness, isMax, y0, y1);
+        auto emit = [&](int i, const uchar *row) { std::memcpy(dst.ptr<uchar>(i), row, in.cols); };
+        for (int i = stream.firstRow(); i < stream.endRow(); i++)
+            stream.push(in.ptr<uchar>(i), emit);
+        stream.finish(emit);
+    });
     return 0;
 }
 
-// Function to get color for a region based on its centroid
-cv::Vec3b getColorForRegion(cv::Point2d centroid, std::map<int, RegionInfo>& prevRegions) {
-    // Iterate through previous regions
-    for (const auto& reg : prevRegions) {
-        // Get centroid of previous region
-        cv::Point2d prevCentroid = reg.second.centroid;
-        
-        // Calculate distance between centroids
-        double distance = cv::norm(centroid - prevCentroid);
-
-        // If distance is within threshold, return color of previous region
-        if (distance < 50) {
-            return reg.second.color;
-        }
-    }
+int erosion(cv::Mat & src, cv::Mat & dst, int kernelSize, int connectedness, FilterBuffers *buffers)
+{
+    // Minimum over the kernel
+    return morphology(src, dst, kernelSize, connectedness, false, buffers);
+}
 
-    // If no matching region found, return a random color
-    return cv::Vec3b(rand() % 256, rand() % 256, rand() % 256);
+int dilation(cv::Mat & src, cv::Mat & dst, int kernelSize, int connectedness, FilterBuffers *buffers)
+{
+    // Maximum over the kernel
+    return morphology(src, dst, kernelSize, connectedness, true, buffers);
 }
 
-// Function to segment objects in an image
-cv::Mat segmentObjects(cv::Mat &src, cv::Mat &dst, int minRegionSize, std::map<int, RegionInfo>& prevRegions) {
-    // Variables for connected components analysis
-    cv::Mat labels, stats, centroids;
-    int nLabels = cv::connectedComponentsWithStats(src, labels, stats, centroids, 8, CV_32S);
+int preprocessFrame(cv::Mat &src, cv::Mat &dst, int threshold, int dilateSize, int dilateConnectedness, int erodeSize, int erodeConnectedness, FilterBuffers *buffers)
+{
+    if (!checkThresholdInput(src) || !checkConnectedness(dilateConnectedness) || !checkConnectedness(erodeConnectedness))
+        return -1;
+
+    // Keep a header on src so dst.create() cannot free it if both are the same Mat
+    cv::Mat in = (src.data == dst.data) ? inputCopy(src, buffers) : src;
+    int num_rows = in.rows;
+    int num_cols = in.cols;
+    dst.create(in.size(), CV_8U);
+
+    int dilateHalo = std::max(dilateSize / 2, 0);
+    int erodeHalo = std::max(erodeSize / 2, 0);
+    forEachBand(num_rows, dilateHalo + erodeHalo + 2, buffers, [&](int y0, int y1, int band) {
+        // Each thresholded row goes straight into the dilation line buffers, each
+        // dilated row into the erosion line buffers, and only eroded rows reach dst.
+        // The erosion band needs erodeHalo extra dilated rows, which in turn need
+        // dilateHalo extra thresholded rows.
+        BandBuffers local;
+        BandBuffers &b = bandBuffers(buffers, band, local);
+        ThresholdStream &thresholdStage = b.threshold;
+        MorphStream &dilateStage = b.dilate, &erodeStage = b.erode;
+        erodeStage.reset(num_rows, num_cols, erodeSize, erodeConnectedness, false, y0, y1);
+        dilateStage.reset(num_rows, num_cols, dilateSize, dilateConnectedness, true,
+                          erodeStage.firstRow(), erodeStage.endRow());
+        std::vector<uchar> &thresholdedRow = b.row;
+        thresholdedRow.resize(num_cols);
+
+        auto toDst = [&](int i, const uchar *row) { std::memcpy(dst.ptr<uchar>(i), row, num_cols); };
+        auto toErode = [&](int, const uchar *row) { erodeStage.push(row, toDst); };
+        thresholdStage.run(in, threshold, dilateStage.firstRow(), dilateStage.endRow(),
+                           [&](int) { return thresholdedRow.data(); },
+                           [&](int, const uchar *row) { dilateStage.push(row, toErode); });
+        dilateStage.finish(toErode);
+        erodeStage.finish(toDst);
+    });
 
-    // Initialize destination image
-    dst = cv::Mat::zeros(src.size(), CV_8UC3);
+    // Return success
+    return 0;
+}
 
-    // Map to store current regions
-    std::map<int, RegionInfo> currentRegions;
+int preprocessFrame(cv::Mat &src, BitMask &dst, int threshold, int dilateSize, int dilateConnectedness, int erodeSize, int erodeConnectedness, FilterBuffers *buffers)
+{
+    // Packed threshold, then the word-parallel morphology on the packed mask
+    BitMask localGrown;
+    BitMask &grown = buffers ? buffers->state().grown : localGrown;
+    BitMaskScratch *morph = buffers ? &buffers->state().morph : nullptr;
+    if (thresholding(src, dst, threshold, buffers) != 0 ||
+        dilation(dst, grown, dilateSize, dilateConnectedness, morph) != 0 ||
+        erosion(grown, dst, erodeSize, erodeConnectedness, morph) != 0)
+        return -1;
+    return 0;
+}
 
-    // Iterate through labels
+// Tracks and paints the regions of a finished labeling
+static void segmentLabeled(cv::Mat &dst, int minRegionSize, std::map<int, RegionInfo>& prevRegions, RegionTracker& tracker, const RunLabeling &labeling, FilterBuffers *buffers) {
+    int nLabels = labeling.count();
+    std::unique_ptr<FilterBuffers> localBuffers;
+    if (!buffers) {
+        localBuffers.reset(new FilterBuffers());
+        buffers = localBuffers.get();
+    }
+    FilterBuffers::State &b = buffers->state();
+
+    // Labels and centroids of the regions that meet the minimum size
+    std::vector<int> &keptLabels = b.keptLabels;
+    std::vector<cv::Point2d> &keptCentroids = b.keptCentroids;
+    keptLabels.clear();
+    keptCentroids.clear();
     for (int i = 1; i < nLabels; i++) {
-        // Get area and centroid of region
-        int area = stats.at<int>(i, cv::CC_STAT_AREA);
-        cv::Point2d centroid(centroids.at<double>(i, 0), centroids.at<double>(i, 1));
-
-        // Check if region meets minimum size requirement
-        if (area > minRegionSize) {
-            // Get color for region based on centroid
-            cv::Vec3b color = getColorForRegion(centroid, prevRegions);
-            
-            // Add current region to map
-            currentRegions[i] = {centroid, color};
-
-            // Assign color to pixels of current region in destination image
-            for (int y = 0; y < labels.rows; y++) {
-                for (int x = 0; x < labels.cols; x++) {
-                    if (labels.at<int>(y, x) == i) {
-                        dst.at<cv::Vec3b>(y, x) = color;
-                    }
-                }
-            }
+        const RunMoments &region = labeling.stats(i);
+        if (region.area() > minRegionSize) {
+            keptLabels.push_back(i);
+            keptCentroids.push_back(region.centroid());
         }
     }
 
-    // Update previous regions with current regions
-    prevRegions = std::move(currentRegions);
-    
-    // Return labels (connected components)
+    // Match the regions to the tracks of previous frames
+    std::vector<cv::Vec3b> &colors = b.colors;
+    colors.assign(nLabels, cv::Vec3b(0, 0, 0));
+    tracker.update(keptCentroids, labeling.size(), b.trackIndex);
+
+    // The map nodes of the last frame are refilled rather than freed and allocated again
+    while (!prevRegions.empty())
+        b.spareNodes.push_back(prevRegions.extract(prevRegions.begin()));
+    for (size_t k = 0; k < keptLabels.size(); k++) {
+        const Track &track = tracker.tracks()[b.trackIndex[k]];
+        RegionInfo info = {keptCentroids[k], track.color, track.id};
+        if (b.spareNodes.empty()) {
+            prevRegions.emplace_hint(prevRegions.end(), keptLabels[k], info);
+        }
+        else {
+            std::map<int, RegionInfo>::node_type node = std::move(b.spareNodes.back());
+            b.spareNodes.pop_back();
+            node.key() = keptLabels[k];
+            node.mapped() = info;
+            prevRegions.insert(prevRegions.end(), std::move(node));
+        }
+        colors[keptLabels[k]] = track.color;
+    }
+
+    // Background and small regions stay black
+    labeling.paint(dst, colors);
+}
+
+// Function to segment objects in an image, keeping the labeling as runs
+int segmentObjects(const cv::Mat &src, cv::Mat &dst, int minRegionSize, std::map<int, RegionInfo>& prevRegions, RegionTracker& tracker, RunLabeling &labeling, FilterBuffers *buffers) {
+    // Connected components and their statistics, straight from the row runs
+    if (labeling.compute(src) < 0)
+        return -1;
+    segmentLabeled(dst, minRegionSize, prevRegions, tracker, labeling, buffers);
+    return 0;
+}
+
+// Function to segment objects in a packed mask
+int segmentObjects(const BitMask &src, cv::Mat &dst, int minRegionSize, std::map<int, RegionInfo>& prevRegions, RegionTracker& tracker, RunLabeling &labeling, FilterBuffers *buffers) {
+    labeling.compute(src);
+    segmentLabeled(dst, minRegionSize, prevRegions, tracker, labeling, buffers);
+    return 0;
+}
+
+// Function to segment objects in an image
+cv::Mat segmentObjects(cv::Mat &src, cv::Mat &dst, int minRegionSize, std::map<int, RegionInfo>& prevRegions, RegionTracker& tracker) {
+    RunLabeling labeling;
+    cv::Mat labels;
+    if (segmentObjects(src, dst, minRegionSize, prevRegions, tracker, labeling) != 0)
+        return labels;
+
+    // Only the kept regions go into the label image, which keeps it 16-bit
+    std::vector<int> remap(labeling.count(), 0);
+    for (const auto &reg : prevRegions)
+        remap[reg.first] = reg.first;
+    labeling.labelImage(labels, remap);
     return labels;
 }
 
-// Function to compute features for a region
-cv::Moments computeFeatures(cv::Mat &src, const cv::Mat &labels, int label, const cv::Point2d &centroid, const cv::Vec3b &color) {
-    // Create mask for the specified label
-    cv::Mat mask = cv::Mat::zeros(labels.size(), CV_8U);
-    for (int y = 0; y < labels.rows; ++y) {
-        for (int x = 0; x < labels.cols; ++x) {
-            if (labels.at<int>(y, x) == label) {
-                mask.at<uchar>(y, x) = 255;
-            }
+// Moment sums of one region plus the end points of its runs
+struct MomentAccumulator : RunMoments {
+    // First and last pixel of every run: their convex hull is the region's hull
+    std::vector<cv::Point> extents;
+
+    // Adds the pixels x0 <= x < x1 of row y
+    void addRun(int y, int x0, int x1)
+    {
+        RunMoments::addRun(y, x0, x1);
+        extents.push_back(cv::Point(x0, y));
+        if (x1 - 1 != x0)
+            extents.push_back(cv::Point(x1 - 1, y));
+    }
+
+    // Folds in the sums of a later band of rows
+    void merge(const MomentAccumulator &o)
+    {
+        RunMoments::merge(o);
+        extents.insert(extents.end(), o.extents.begin(), o.extents.end());
+    }
+};
+
+// Adds the runs of equal labels in rows [y0, y1) to the accumulators of the regions in slotOf
+template <typename T>
+static void accumulateRuns(const cv::Mat &labels, int y0, int y1, const std::vector<int> &slotOf, std::vector<MomentAccumulator> &acc)
+{
+    int maxLabel = (int)slotOf.size() - 1;
+    for (int y = y0; y < y1; y++) {
+        const T *row = labels.ptr<T>(y);
+        int x = 0;
+        while (x < labels.cols) {
+            // Walk one run of equal labels
+            T l = row[x];
+            int x0 = x;
+            while (x < labels.cols && row[x] == l)
+                x++;
+            if ((int)l < 0 || (int)l > maxLabel || slotOf[l] < 0)
+                continue;
+            acc[slotOf[l]].addRun(y, x0, x);
         }
     }
+}
 
-    // Calculate moments of the mask
-    cv::Moments m = cv::moments(mask, true);
-    
-    // Calculate orientation angle
-    double angle = 0.5 * std::atan2(2 * m.mu11, m.mu20 - m.mu02);
+// Function to compute features for all tracked regions in one pass
+std::vector<RegionFeatures> computeAllFeatures(const cv::Mat &labels, const std::map<int, RegionInfo> &regions) {
+    std::vector<RegionFeatures> table;
+    if (regions.empty())
+        return table;
+
+    // Label -> position in the table
+    int maxLabel = regions.rbegin()->first;
+    std::vector<int> slotOf(std::max(maxLabel, 0) + 1, -1);
+    for (const auto &reg : regions) {
+        if (reg.first >= 0)
+            slotOf[reg.first] = (int)table.size();
+        table.push_back(RegionFeatures());
+        table.back().label = reg.first;
+    }
+    size_t numRegions = table.size();
+
+    // Each band of rows accumulates its own sums; they are merged in band order
+    std::vector<std::pair<int, std::vector<MomentAccumulator>>> partial;
+    std::mutex partialMutex;
+    forEachBand(labels.rows, 0, nullptr, [&](int y0, int y1, int) {
+        std::vector<MomentAccumulator> acc(numRegions);
+        if (labels.depth() == CV_16U)
+            accumulateRuns<ushort>(labels, y0, y1, slotOf, acc);
+        else
+            accumulateRuns<int>(labels, y0, y1, slotOf, acc);
+        std::lock_guard<std::mutex> lock(partialMutex);
+        partial.emplace_back(y0, std::move(acc));
+    });
+    std::sort(partial.begin(), partial.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    std::vector<MomentAccumulator> total(numRegions);
+    for (const auto &band : partial)
+        for (size_t k = 0; k < numRegions; k++)
+            total[k].merge(band.second[k]);
+
+    std::vector<cv::Point> hull;
+    for (size_t k = 0; k < numRegions; k++)
+        runFeatures(total[k], total[k].extents, table[k], hull);
+    return table;
+}
 
-    // Find minimum area rectangle enclosing the region
-    std::vector<cv::Point> points;
-    cv::findNonZero(mask, points);
-    cv::RotatedRect rotRect = cv::minAreaRect(points);
+// Function to draw the oriented box and orientation line of a region
+void drawFeatures(cv::Mat &src, const RegionFeatures &features, const cv::Vec3b &color) {
+    if (features.moments.m00 == 0)
+        return;
 
     // Get corner points of the rectangle
     cv::Point2f rectPoints[4];
-    rotRect.points(rectPoints);
+    features.orientedBox.points(rectPoints);
     
     // Draw rectangle around the region
     for (int j = 0; j < 4; j++) {
@@ -316,12 +911,23 @@ cv::Moments computeFeatures(cv::Mat &src, const cv::Mat &labels, int label, cons
     }
 
     // Get center and endpoint for drawing orientation line
-    cv::Point center = rotRect.center;
-    cv::Point endpoint(center.x + cos(angle) * 100, center.y + sin(angle) * 100);
+    cv::Point center = features.orientedBox.center;
+    cv::Point endpoint(center.x + cos(features.orientation) * 100, center.y + sin(features.orientation) * 100);
     
     // Draw orientation line
     cv::line(src, center, endpoint, cv::Scalar(color), 2);
+}
+
+// Function to compute features for a region
+cv::Moments computeFeatures(cv::Mat &src, const cv::Mat &labels, int label, const cv::Point2d &centroid, const cv::Vec3b &color) {
+    // Same single pass as computeAllFeatures(), restricted to one label
+    std::map<int, RegionInfo> one;
+    one[label] = {centroid, color};
+    std::vector<RegionFeatures> features = computeAllFeatures(labels, one);
+
+    // Draw the oriented box and orientation line
+    drawFeatures(src, features[0], color);
 
     // Return computed moments
-    return m;
+    return features[0].moments;
 }
@@ -0,0 +1,405 @@
+/**
+ * @file filters_bench.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Microbenchmarks of the filters.cpp operators on synthetic frames
+ * @date 2024-02-26
+ *
+ */
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bitmask.hpp"
+#include "filters.hpp"
+#include "incremental.hpp"
+#include "pipeline_context.hpp"
+#include "run_labels.hpp"
+
+// One benchmarked configuration
+struct BenchResult {
+    std::string op;        // Operator name
+    std::string res;       // Resolution name
+    int param = 0;         // Kernel size, or 0
+    long long pixels = 0;  // Pixels per call
+    double bytes = 0;      // Input bytes per call
+    double medianNs = 0, p90Ns = 0, p99Ns = 0;
+
+    double nsPerPixel() const { return medianNs / pixels; }
+    double mbPerSecond() const { return bytes / (medianNs * 1e-9) / 1e6; }
+    std::string key() const { return op + "/" + res + "/" + std::to_string(param); }
+};
+
+struct BenchOptions {
+    std::vector<std::string> resolutions = {"480p", "720p", "1080p", "4k"};
+    std::vector<int> kernels = {3, 5, 9, 15};
+    int objects = 8;
+    double size = 0.1;  // Object radius as a fraction of the frame height
+    double noise = 8.0; // Standard deviation of the pixel noise
+    int warmup = 3;
+    int reps = 25;
+    unsigned seed = 1;
+    std::string json, csv, baseline;
+    double tolerance = 0.10;
+};
+
+static bool resolutionSize(const std::string &name, cv::Size &size)
+{
+    static const std::map<std::string, cv::Size> sizes = {
+        {"480p", cv::Size(640, 480)}, {"720p", cv::Size(1280, 720)},
+        {"1080p", cv::Size(1920, 1080)}, {"4k", cv::Size(3840, 2160)}};
+    auto it = sizes.find(name);
+    if (it == sizes.end())
+        return false;
+    size = it->second;
+    return true;
+}
+
+// Dark ellipses on a light background with Gaussian noise, the same for a given seed
+static cv::Mat syntheticFrame(cv::Size size, const BenchOptions &opt)
+{
+    std::mt19937 rng(opt.seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::normal_distribution<double> noise(0.0, opt.noise);
+
+    struct Blob { double cx, cy, rx, ry, angle; int level; };
+    std::vector<Blob> blobs;
+    double radius = std::max(2.0, opt.size * size.height);
+    for (int i = 0; i < opt.objects; i++)
+    {
+        Blob b;
+        b.cx = unit(rng) * size.width;
+        b.cy = unit(rng) * size.height;
+        b.rx = radius * (0.5 + unit(rng));
+        b.ry = radius * (0.3 + 0.7 * unit(rng));
+        b.angle = unit(rng) * CV_PI;
+        b.level = 20 + (int)(unit(rng) * 50);
+        blobs.push_back(b);
+    }
+
+    cv::Mat frame(size, CV_8UC3);
+    for (int y = 0; y < size.height; y++)
+    {
+        uchar *p = frame.ptr<uchar>(y);
+        for (int x = 0; x < size.width; x++)
+        {
+            int level = 200;
+            for (const Blob &b : blobs)
+            {
+                double dx = x - b.cx, dy = y - b.cy;
+                double u = (dx * std::cos(b.angle) + dy * std::sin(b.angle)) / b.rx;
+                double v = (-dx * std::sin(b.angle) + dy * std::cos(b.angle)) / b.ry;
+                if (u * u + v * v <= 1.0)
+                    level = b.level;
+            }
+            for (int c = 0; c < 3; c++)
+                p[3 * x + c] = cv::saturate_cast<uchar>(level + (c - 1) * 6 + noise(rng));
+        }
+    }
+    return frame;
+}
+
+// Times fn after the warmup runs; returns sorted per-call times in ns
+static std::vector<double> timeRuns(const std::function<void()> &fn, const BenchOptions &opt)
+{
+    for (int i = 0; i < opt.warmup; i++)
+        fn();
+    std::vector<double> ns;
+    for (int i = 0; i < opt.reps; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        ns.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(ns.begin(), ns.end());
+    return ns;
+}
+
+// Nearest-rank percentile of sorted values
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    size_t rank = (size_t)std::ceil(p / 100.0 * sorted.size());
+    return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+static void record(std::vector<BenchResult> &results, const std::string &op, const std::string &res, int param,
+                   cv::Size size, double bytesPerPixel, const std::vector<double> &ns)
+{
+    BenchResult r;
+    r.op = op;
+    r.res = res;
+    r.param = param;
+    r.pixels = (long long)size.area();
+    r.bytes = bytesPerPixel * r.pixels;
+    r.medianNs = percentile(ns, 50);
+    r.p90Ns = percentile(ns, 90);
+    r.p99Ns = percentile(ns, 99);
+    results.push_back(r);
+    printf("%-20s %-6s %4d %10.3f %10.3f %10.3f %10.1f\n", op.c_str(), res.c_str(), param,
+           r.nsPerPixel(), r.p90Ns / r.pixels, r.p99Ns / r.pixels, r.mbPerSecond());
+    fflush(stdout);
+}
+
+static void runBenchmarks(const BenchOptions &opt, std::vector<BenchResult> &results)
+{
+    printf("%-20s %-6s %4s %10s %10s %10s %10s\n", "operator", "res", "k", "ns/px p50", "ns/px p90", "ns/px p99", "MB/s");
+    for (const std::string &res : opt.resolutions)
+    {
+        cv::Size size;
+        if (!resolutionSize(res, size))
+        {
+            std::cerr << "Unknown resolution " << res << std::endl;
+            continue;
+        }
+        cv::Mat frame = syntheticFrame(size, opt);
+        cv::Mat binary, out, eroded, segmented;
+
+        thresholding(frame, binary, 100);
+        record(results, "thresholding", res, 0, size, 3, timeRuns([&] { thresholding(frame, out, 100); }, opt));
+
+        for (int k : opt.kernels)
+        {
+            record(results, "erosion4", res, k, size, 1, timeRuns([&] { erosion(binary, out, k, 4); }, opt));
+            record(results, "erosion8", res, k, size, 1, timeRuns([&] { erosion(binary, out, k, 8); }, opt));
+            record(results, "dilation4", res, k, size, 1, timeRuns([&] { dilation(binary, out, k, 4); }, opt));
+            record(results, "dilation8", res, k, size, 1, timeRuns([&] { dilation(binary, out, k, 8); }, opt));
+        }
+
+        record(results, "preprocessFrame", res, 5, size, 3,
+               timeRuns([&] { preprocessFrame(frame, eroded, 100, 5, 8, 5, 4); }, opt));
+
+        // The same operators on the packed one-bit mask
+        BitMask packed, packedOut;
+        record(results, "thresholdPacked", res, 0, size, 3, timeRuns([&] { thresholding(frame, packed, 100); }, opt));
+        for (int k : opt.kernels)
+        {
+            record(results, "erosion4Packed", res, k, size, 0.125, timeRuns([&] { erosion(packed, packedOut, k, 4); }, opt));
+            record(results, "erosion8Packed", res, k, size, 0.125, timeRuns([&] { erosion(packed, packedOut, k, 8); }, opt));
+            record(results, "dilation4Packed", res, k, size, 0.125, timeRuns([&] { dilation(packed, packedOut, k, 4); }, opt));
+            record(results, "dilation8Packed", res, k, size, 0.125, timeRuns([&] { dilation(packed, packedOut, k, 8); }, opt));
+        }
+        record(results, "preprocessPacked", res, 5, size, 3,
+               timeRuns([&] { preprocessFrame(frame, packed, 100, 5, 8, 5, 4); }, opt));
+
+        // Per-frame cost of following the lighting: the histogram of every 16th row and its Otsu split
+        AutoThreshold lighting;
+        record(results, "autoThreshold", res, 16, size, 3, timeRuns([&] { lighting.update(frame); }, opt));
+
+        // The tracker sees the same frame every call, as it would a static scene
+        std::map<int, RegionInfo> regions;
+        RegionTracker tracker;
+        cv::Mat labels = segmentObjects(eroded, segmented, 500, regions, tracker);
+        record(results, "segmentObjects", res, 0, size, 1,
+               timeRuns([&] { labels = segmentObjects(eroded, segmented, 500, regions, tracker); }, opt));
+
+        record(results, "computeAllFeatures", res, 0, size, 2,
+               timeRuns([&] { computeAllFeatures(labels, regions); }, opt));
+
+        // The run labeling alone, against OpenCV's pixel labeling, then features from the runs
+        RunLabeling labeling;
+        cv::Mat ccLabels, ccStats, ccCentroids;
+        record(results, "runLabeling", res, 0, size, 1, timeRuns([&] { labeling.compute(eroded); }, opt));
+        record(results, "runLabelingPacked", res, 0, size, 0.125, timeRuns([&] { labeling.compute(packed); }, opt));
+        record(results, "connectedComponents", res, 0, size, 1, timeRuns([&] {
+            cv::connectedComponentsWithStats(eroded, ccLabels, ccStats, ccCentroids, 8, CV_32S);
+        }, opt));
+        record(results, "runFeatures", res, 0, size, 1, timeRuns([&] { labeling.features(regions); }, opt));
+
+        // The packed chain with fresh buffers on every call, then on a PipelineContext that keeps them
+        BitMask chainMask;
+        RunLabeling chainLabeling;
+        RegionTracker chainTracker;
+        std::map<int, RegionInfo> chainRegions;
+        cv::Mat chainSegmented;
+        record(results, "pipelineFresh", res, 0, size, 3, timeRuns([&] {
+            preprocessFrame(frame, chainMask, 100, 5, 8, 5, 4);
+            segmentObjects(chainMask, chainSegmented, 500, chainRegions, chainTracker, chainLabeling);
+            chainLabeling.features(chainRegions);
+        }, opt));
+        PipelineContext context;
+        record(results, "pipelineContext", res, 0, size, 3, timeRuns([&] { context.process(frame, 100, 500); }, opt));
+        if (allocationCountingEnabled())
+            printf("%-20s %-6s %llu allocations per frame\n", "pipelineContext", res.c_str(),
+                   (unsigned long long)context.frameAllocations());
+
+        // Incremental segmentation of an unchanged frame, and of one object moving a few pixels per call
+        IncrementalSegmenter incremental;
+        RegionTracker incrementalTracker;
+        incremental.process(frame, incrementalTracker);
+        record(results, "incrementalStatic", res, 0, size, 3,
+               timeRuns([&] { incremental.process(frame, incrementalTracker); }, opt));
+        cv::Mat moving = frame.clone();
+        int step = 0;
+        record(results, "incrementalMotion", res, 0, size, 3, timeRuns([&] {
+            cv::Rect box((step++ * 4) % (size.width - 64), size.height / 2, 48, 48);
+            frame.copyTo(moving);
+            moving(box).setTo(cv::Scalar(30, 30, 30));
+            incremental.process(moving, incrementalTracker);
+        }, opt));
+
+        if (regions.count(1))
+        {
+            cv::Mat canvas = frame.clone();
+            record(results, "computeFeatures", res, 0, size, 4,
+                   timeRuns([&] { computeFeatures(canvas, labels, 1, regions[1].centroid, regions[1].color); }, opt));
+        }
+    }
+}
+
+static int writeCsv(const std::string &file, const std::vector<BenchResult> &results)
+{
+    std::ofstream out(file);
+    if (!out)
+    {
+        std::cerr << "Unable to open " << file << std::endl;
+        return (-1);
+    }
+    out << "operator,resolution,param,pixels,median_ns,p90_ns,p99_ns,ns_per_pixel,mb_per_s\n";
+    for (const BenchResult &r : results)
+        out << r.op << "," << r.res << "," << r.param << "," << r.pixels << "," << r.medianNs << ","
+            << r.p90Ns << "," << r.p99Ns << "," << r.nsPerPixel() << "," << r.mbPerSecond() << "\n";
+    return (0);
+}
+
+static int writeJson(const std::string &file, const std::vector<BenchResult> &results, const BenchOptions &opt)
+{
+    std::ofstream out(file);
+    if (!out)
+    {
+        std::cerr << "Unable to open " << file << std::endl;
+        return (-1);
+    }
+    out << "{\n  \"threads\": " << getFilterThreads() << ",\n  \"reps\": " << opt.reps
+        << ",\n  \"seed\": " << opt.seed << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &r = results[i];
+        out << "    {\"operator\": \"" << r.op << "\", \"resolution\": \"" << r.res << "\", \"param\": " << r.param
+            << ", \"pixels\": " << r.pixels << ", \"median_ns\": " << r.medianNs << ", \"p90_ns\": " << r.p90Ns
+            << ", \"p99_ns\": " << r.p99Ns << ", \"ns_per_pixel\": " << r.nsPerPixel()
+            << ", \"mb_per_s\": " << r.mbPerSecond() << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return (0);
+}
+
+// Compares median ns/pixel against a CSV written by an earlier run.
+// Returns the number of configurations slower than the baseline by more than the tolerance.
+static int compareBaseline(const std::string &file, const std::vector<BenchResult> &results, double tolerance)
+{
+    std::ifstream in(file);
+    if (!in)
+    {
+        std::cerr << "Unable to open baseline " << file << std::endl;
+        return (-1);
+    }
+    std::map<std::string, double> baseline;
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line))
+    {
+        std::stringstream ss(line);
+        std::vector<std::string> cols;
+        std::string col;
+        while (std::getline(ss, col, ','))
+            cols.push_back(col);
+        if (cols.size() >= 8)
+            baseline[cols[0] + "/" + cols[1] + "/" + cols[2]] = atof(cols[7].c_str());
+    }
+
+    int regressions = 0;
+    for (const BenchResult &r : results)
+    {
+        auto it = baseline.find(r.key());
+        if (it == baseline.end() || it->second <= 0)
+            continue;
+        double ratio = r.nsPerPixel() / it->second;
+        if (ratio > 1.0 + tolerance)
+        {
+            printf("REGRESSION %-30s %.3f -> %.3f ns/px (%+.1f%%)\n", r.key().c_str(), it->second, r.nsPerPixel(), (ratio - 1) * 100);
+            regressions++;
+        }
+    }
+    printf("%d regression(s) beyond %.0f%% against %s\n", regressions, tolerance * 100, file.c_str());
+    return regressions;
+}
+
+static std::vector<std::string> splitList(const std::string &s)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+static void usage(const char *name)
+{
+    std::cerr << "Usage: " << name << " [options]" << std::endl;
+    std::cerr << "  --res 480p,720p,1080p,4k  resolutions to run" << std::endl;
+    std::cerr << "  --kernels 3,5,9,15        morphology kernel sizes" << std::endl;
+    std::cerr << "  --objects <n>             objects per frame (default 8)" << std::endl;
+    std::cerr << "  --size <f>                object radius as a fraction of the height (default 0.1)" << std::endl;
+    std::cerr << "  --noise <sigma>           pixel noise (default 8)" << std::endl;
+    std::cerr << "  --warmup <n> --reps <n>   untimed and timed calls (default 3, 25)" << std::endl;
+    std::cerr << "  --threads <n>             threads for the operators (default all)" << std::endl;
+    std::cerr << "  --seed <n>                synthetic frame seed (default 1)" << std::endl;
+    std::cerr << "  --csv <file> --json <file>  machine-readable results" << std::endl;
+    std::cerr << "  --baseline <csv> [--tolerance 0.10]  exit 1 on median ns/pixel regressions" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return -1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--res") opt.resolutions = splitList(value);
+        else if (arg == "--kernels") {
+            opt.kernels.clear();
+            for (const std::string &k : splitList(value)) opt.kernels.push_back(atoi(k.c_str()));
+        }
+        else if (arg == "--objects") opt.objects = atoi(value.c_str());
+        else if (arg == "--size") opt.size = atof(value.c_str());
+        else if (arg == "--noise") opt.noise = atof(value.c_str());
+        else if (arg == "--warmup") opt.warmup = atoi(value.c_str());
+        else if (arg == "--reps") opt.reps = std::max(1, atoi(value.c_str()));
+        else if (arg == "--threads") setFilterThreads(atoi(value.c_str()));
+        else if (arg == "--seed") opt.seed = (unsigned)atoi(value.c_str());
+        else if (arg == "--csv") opt.csv = value;
+        else if (arg == "--json") opt.json = value;
+        else if (arg == "--baseline") opt.baseline = value;
+        else if (arg == "--tolerance") opt.tolerance = atof(value.c_str());
+        else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    printf("filters_bench: %d thread(s), %d objects, noise %.1f, %d warmup + %d reps\n",
+           getFilterThreads(), opt.objects, opt.noise, opt.warmup, opt.reps);
+    std::vector<BenchResult> results;
+    runBenchmarks(opt, results);
+
+    if (!opt.csv.empty() && writeCsv(opt.csv, results) != 0) return -1;
+    if (!opt.json.empty() && writeJson(opt.json, results, opt) != 0) return -1;
+    if (!opt.baseline.empty()) {
+        int regressions = compareBaseline(opt.baseline, results, opt.tolerance);
+        if (regressions != 0) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+/**
+ * @file frame_scheduler.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Latency-budget frame scheduler
+ * @date 2024-02-26
+ *
+ */
+
+#include "frame_scheduler.hpp"
+
+#include <algorithm>
+
+FrameScheduler::FrameScheduler(const SchedulerParams &params)
+    : config(params)
+{
+    if (config.scales.empty())
+        config.scales.push_back(1.0);
+    config.maxClassifyInterval = std::max(1, config.maxClassifyInterval);
+    config.maxStride = std::max(1, config.maxStride);
+
+    // Cheapest quality losses first: resolution, then classification rate, then frame rate
+    for (double s : config.scales)
+        ladder.push_back({s, 1, 1});
+    double smallest = config.scales.back();
+    for (int every = 2; every <= config.maxClassifyInterval; every *= 2)
+        ladder.push_back({smallest, every, 1});
+    for (int stride = 2; stride <= config.maxStride; stride++)
+        ladder.push_back({smallest, config.maxClassifyInterval, stride});
+}
+
+FrameDecision FrameScheduler::next()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const Level &l = ladder[current];
+    FrameDecision d;
+    d.level = current;
+    d.scale = l.scale;
+    d.process = captured++ % (uint64_t)l.stride == 0;
+    d.classify = d.process && processed % (uint64_t)l.classifyEvery == 0;
+    if (d.process)
+        processed++;
+    return d;
+}
+
+// Running average that starts at the first sample
+static void smooth(double &average, double sample, double weight)
+{
+    average = average < 0 ? sample : average + weight * (sample - average);
+}
+
+void FrameScheduler::report(const FrameDecision &decision, double processMs, double classifyMs)
+{
+    if (!decision.process)
+        return;
+    std::lock_guard<std::mutex> lock(mutex);
+    smooth(processCost, processMs / (decision.scale * decision.scale), config.smoothing);
+    if (decision.classify)
+        smooth(classifyCost, classifyMs, config.smoothing);
+
+    // Only frames processed at the current level count towards holding it
+    if (decision.level != current)
+        return;
+    held++;
+
+    double limit = config.degradeAt * config.deadlineMs;
+    if (predictLocked(current) > limit)
+    {
+        int target = current + 1;
+        while (target + 1 < (int)ladder.size() && predictLocked(target) > limit)
+            target++;
+        if (target < (int)ladder.size())
+        {
+            current = target;
+            held = 0;
+        }
+    }
+    else if (current > 0 && held >= config.holdFrames &&
+             predictLocked(current - 1) < config.upgradeAt * config.deadlineMs)
+    {
+        current--;
+        held = 0;
+    }
+}
+
+double FrameScheduler::predictLocked(int level) const
+{
+    if (processCost < 0)
+        return 0.0;
+    const Level &l = ladder[level];
+    double cost = processCost * l.scale * l.scale;
+    if (classifyCost > 0)
+        cost += classifyCost / l.classifyEvery;
+    return cost / l.stride;
+}
+
+double FrameScheduler::predictedMs(int level) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return predictLocked(std::min(std::max(level, 0), (int)ladder.size() - 1));
+}
+
+int FrameScheduler::level() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return current;
+}
+
+void scaleFeatures(std::vector<RegionFeatures> &features, double factor)
+{
+    if (factor == 1.0)
+        return;
+    for (RegionFeatures &f : features)
+    {
+        f.centroid = cv::Point2d(f.centroid.x * factor, f.centroid.y * factor);
+        f.boundingBox = cv::Rect(cvRound(f.boundingBox.x * factor), cvRound(f.boundingBox.y * factor),
+                                 cvRound(f.boundingBox.width * factor), cvRound(f.boundingBox.height * factor));
+        f.orientedBox = cv::RotatedRect(cv::Point2f(f.orientedBox.center.x * (float)factor, f.orientedBox.center.y * (float)factor),
+                                        cv::Size2f(f.orientedBox.size.width * (float)factor, f.orientedBox.size.height * (float)factor),
+                                        f.orientedBox.angle);
+    }
+}
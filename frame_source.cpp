@@ -0,0 +1,95 @@
+/**
+ * @file frame_source.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Frames from a camera, a video file or a directory of images
+ * @date 2024-02-26
+ *
+ */
+
+#include "frame_source.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <iostream>
+
+std::vector<std::string> listImages(const std::string &dir)
+{
+    static const char *extensions[] = {".png", ".jpg", ".jpeg", ".bmp", ".tif", ".tiff", ".ppm", ".pgm"};
+    std::vector<std::string> files;
+    for (const auto &entry : std::filesystem::directory_iterator(dir))
+    {
+        if (!entry.is_regular_file())
+            continue;
+        std::string ext = entry.path().extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        for (const char *e : extensions)
+        {
+            if (ext == e)
+            {
+                files.push_back(entry.path().string());
+                break;
+            }
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+int FrameSource::open(const std::string &source)
+{
+    close();
+    spec = source;
+    camera = !source.empty() && std::all_of(source.begin(), source.end(), ::isdigit);
+
+    if (camera)
+    {
+        if (!cap.open(std::stoi(source)))
+        {
+            std::cerr << "Error: Unable to open camera " << source << std::endl;
+            return -1;
+        }
+    }
+    else if (std::filesystem::is_directory(source))
+    {
+        images = listImages(source);
+        if (images.empty())
+        {
+            std::cerr << "Error: No images in " << source << std::endl;
+            return -1;
+        }
+    }
+    else if (!cap.open(source))
+    {
+        std::cerr << "Error: Unable to open " << source << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+bool FrameSource::read(cv::Mat &frame)
+{
+    if (!images.empty())
+    {
+        while (nextImage < images.size())
+        {
+            frame = cv::imread(images[nextImage++], cv::IMREAD_COLOR);
+            if (!frame.empty())
+                return true;
+        }
+        return false;
+    }
+    if (!cap.isOpened())
+        return false;
+    cap >> frame;
+    return !frame.empty();
+}
+
+void FrameSource::close()
+{
+    if (cap.isOpened())
+        cap.release();
+    images.clear();
+    nextImage = 0;
+    camera = false;
+}
@@ -0,0 +1,486 @@
+/**
+ * @file hnsw_index.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Approximate nearest-neighbour index (HNSW) over a FeatureDatabase
+ * @date 2024-02-26
+ *
+ */
+
+#include "hnsw_index.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <unordered_set>
+
+static const char hnswMagic[8] = {'H', 'N', 'S', 'W', 'I', 'D', 'X', '\0'};
+static const uint32_t hnswVersion = 2;
+
+// Highest layer accepted from a file; randomLevel() stays below 41 even for M = 2
+static const int maxHnswLevel = 64;
+
+// FNV-1a over the feature words of rows [r0, r1), continuing from h, so the
+// hash of a database can be extended as rows are appended
+static uint64_t hashRows(const FeatureDatabase &db, int r0, int r1, uint64_t h)
+{
+    size_t n = (size_t)db.dimension();
+    for (int i = r0; i < r1; i++)
+    {
+        const float *r = db.row(i);
+        for (size_t j = 0; j < n; j++)
+        {
+            uint32_t w;
+            memcpy(&w, r + j, sizeof(w));
+            h = (h ^ w) * 0x100000001b3ull;
+        }
+    }
+    return h;
+}
+
+static const uint64_t emptyRowsHash = 0xcbf29ce484222325ull;
+
+// Visit marks for one search. A node is visited when its mark equals the
+// current epoch, so clearing the set costs nothing between searches.
+struct HnswIndex::VisitedSet {
+    std::vector<uint32_t> marks;
+    uint32_t epoch = 0;
+
+    void reset(int n)
+    {
+        if ((int)marks.size() < n)
+            marks.resize(n, 0);
+        if (++epoch == 0)
+        {
+            std::fill(marks.begin(), marks.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    // Marks node i and returns true if it had not been visited yet
+    bool visit(int i)
+    {
+        if (marks[i] == epoch)
+            return false;
+        marks[i] = epoch;
+        return true;
+    }
+};
+
+HnswIndex::HnswIndex(const HnswParams &params) : config(params), rowsHash(emptyRowsHash), rng(params.seed)
+{
+    config.M = std::max(config.M, 2);
+    config.efConstruction = std::max(config.efConstruction, config.M);
+}
+
+HnswIndex::~HnswIndex() = default;
+
+void HnswIndex::clear()
+{
+    dim = 0;
+    entryPoint = -1;
+    maxLevel = -1;
+    rowsHash = emptyRowsHash;
+    rng.seed(config.seed);
+    levels.clear();
+    baseLinks.clear();
+    upperLinks.clear();
+}
+
+int *HnswIndex::links(int node, int level)
+{
+    if (level == 0)
+        return &baseLinks[(size_t)node * (maxLinks(0) + 1)];
+    return &upperLinks[node][(size_t)(level - 1) * (maxLinks(1) + 1)];
+}
+
+const int *HnswIndex::links(int node, int level) const
+{
+    return const_cast<HnswIndex *>(this)->links(node, level);
+}
+
+int HnswIndex::randomLevel()
+{
+    // Exponentially decaying level distribution, normalised by ln(M)
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    double u = std::max(uniform(rng), 1e-12);
+    return (int)(-std::log(u) / std::log((double)config.M));
+}
+
+std::unique_ptr<HnswIndex::VisitedSet> HnswIndex::acquireVisited() const
+{
+    std::lock_guard<std::mutex> lock(visitedMutex);
+    if (visitedPool.empty())
+        return std::unique_ptr<VisitedSet>(new VisitedSet());
+    std::unique_ptr<VisitedSet> visited = std::move(visitedPool.back());
+    visitedPool.pop_back();
+    return visited;
+}
+
+void HnswIndex::releaseVisited(std::unique_ptr<VisitedSet> visited) const
+{
+    std::lock_guard<std::mutex> lock(visitedMutex);
+    visitedPool.push_back(std::move(visited));
+}
+
+int HnswIndex::greedyDescend(const FeatureDatabase &db, const float *query, int entry, int fromLevel, int toLevel) const
+{
+    // Walk to the closest node on each layer above toLevel
+    int current = entry;
+    float best = featureDistance(db.row(current), query, dim, config.metric);
+    for (int level = fromLevel; level > toLevel; level--)
+    {
+        bool moved = true;
+        while (moved)
+        {
+            moved = false;
+            const int *l = links(current, level);
+            for (int j = 1; j <= l[0]; j++)
+            {
+                float d = featureDistance(db.row(l[j]), query, dim, config.metric);
+                if (d < best)
+                {
+                    best = d;
+                    current = l[j];
+                    moved = true;
+                }
+            }
+        }
+    }
+    return current;
+}
+
+std::vector<HnswIndex::Candidate> HnswIndex::searchLayer(const FeatureDatabase &db, const float *query, int entry, int ef, int level) const
+{
+    std::unique_ptr<VisitedSet> visited = acquireVisited();
+    visited->reset(size());
+
+    // Closest unexpanded candidates first; results keep the ef best, farthest on top
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+    std::priority_queue<Candidate> results;
+    float d = featureDistance(db.row(entry), query, dim, config.metric);
+    candidates.emplace(d, entry);
+    results.emplace(d, entry);
+    visited->visit(entry);
+
+    while (!candidates.empty())
+    {
+        Candidate c = candidates.top();
+        if (c.first > results.top().first && (int)results.size() >= ef)
+            break;
+        candidates.pop();
+
+        const int *l = links(c.second, level);
+        for (int j = 1; j <= l[0]; j++)
+        {
+            int n = l[j];
+            if (!visited->visit(n))
+                continue;
+            float dn = featureDistance(db.row(n), query, dim, config.metric);
+            if ((int)results.size() < ef || dn < results.top().first)
+            {
+                candidates.emplace(dn, n);
+                results.emplace(dn, n);
+                if ((int)results.size() > ef)
+                    results.pop();
+            }
+        }
+    }
+    releaseVisited(std::move(visited));
+
+    std::vector<Candidate> found;
+    found.reserve(results.size());
+    while (!results.empty())
+    {
+        found.push_back(results.top());
+        results.pop();
+    }
+    std::reverse(found.begin(), found.end());
+    return found;
+}
+
+void HnswIndex::selectNeighbors(const FeatureDatabase &db, std::vector<Candidate> &candidates, int m) const
+{
+    // Keep a candidate only if it is closer to the new node than to every
+    // neighbour kept so far, which spreads the links in different directions
+    std::sort(candidates.begin(), candidates.end());
+    if ((int)candidates.size() <= m)
+        return;
+    std::vector<Candidate> kept;
+    kept.reserve(m);
+    for (const Candidate &c : candidates)
+    {
+        if ((int)kept.size() >= m)
+            break;
+        bool diverse = true;
+        for (const Candidate &k : kept)
+        {
+            if (featureDistance(db.row(c.second), db.row(k.second), dim, config.metric) < c.first)
+            {
+                diverse = false;
+                break;
+            }
+        }
+        if (diverse)
+            kept.push_back(c);
+    }
+    candidates.swap(kept);
+}
+
+void HnswIndex::insert(const FeatureDatabase &db, int node)
+{
+    int level = randomLevel();
+    levels.push_back(level);
+    baseLinks.resize(baseLinks.size() + maxLinks(0) + 1, 0);
+    upperLinks.emplace_back((size_t)level * (maxLinks(1) + 1), 0);
+
+    if (entryPoint < 0)
+    {
+        entryPoint = node;
+        maxLevel = level;
+        return;
+    }
+
+    const float *query = db.row(node);
+    int current = greedyDescend(db, query, entryPoint, maxLevel, level);
+    for (int l = std::min(level, maxLevel); l >= 0; l--)
+    {
+        std::vector<Candidate> found = searchLayer(db, query, current, config.efConstruction, l);
+        current = found.front().second;
+
+        std::vector<Candidate> neighbors = found;
+        selectNeighbors(db, neighbors, config.M);
+        int *own = links(node, l);
+        own[0] = (int)neighbors.size();
+        for (size_t j = 0; j < neighbors.size(); j++)
+            own[j + 1] = neighbors[j].second;
+
+        // Link back, pruning neighbours that are already full
+        int capacity = maxLinks(l);
+        for (const Candidate &n : neighbors)
+        {
+            int *other = links(n.second, l);
+            if (other[0] < capacity)
+            {
+                other[++other[0]] = node;
+                continue;
+            }
+            std::vector<Candidate> pool;
+            pool.reserve(capacity + 1);
+            const float *base = db.row(n.second);
+            for (int j = 1; j <= other[0]; j++)
+                pool.emplace_back(featureDistance(db.row(other[j]), base, dim, config.metric), other[j]);
+            pool.emplace_back(n.first, node);
+            selectNeighbors(db, pool, capacity);
+            other[0] = (int)pool.size();
+            for (size_t j = 0; j < pool.size(); j++)
+                other[j + 1] = pool[j].second;
+        }
+    }
+
+    if (level > maxLevel)
+    {
+        entryPoint = node;
+        maxLevel = level;
+    }
+}
+
+int HnswIndex::update(const FeatureDatabase &db)
+{
+    if (db.size() < size() || (size() > 0 && db.dimension() != dim))
+    {
+        printf("Feature database does not match the index\n");
+        return (-1);
+    }
+    dim = db.dimension();
+    int first = size();
+    for (int i = first; i < db.size(); i++)
+        insert(db, i);
+    rowsHash = hashRows(db, first, db.size(), rowsHash);
+    return db.size() - first;
+}
+
+std::vector<FeatureMatch> HnswIndex::search(const FeatureDatabase &db, const float *query, int k, int ef) const
+{
+    std::vector<FeatureMatch> matches;
+    if (entryPoint < 0 || k <= 0 || db.dimension() != dim || db.size() < size())
+        return matches;
+    ef = std::max(ef > 0 ? ef : config.efSearch, k);
+
+    int current = greedyDescend(db, query, entryPoint, maxLevel, 0);
+    std::vector<Candidate> found = searchLayer(db, query, current, ef, 0);
+    for (int i = 0; i < k && i < (int)found.size(); i++)
+        matches.push_back({found[i].second, db.labelIndex(found[i].second), found[i].first});
+    return matches;
+}
+
+int HnswIndex::save(const std::string &filename) const
+{
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if (!fp)
+    {
+        printf("Unable to open output file %s\n", filename.c_str());
+        return (-1);
+    }
+
+    // magic, version, M, efConstruction, metric, dim, count, maxLevel, entryPoint,
+    // the hash of the indexed rows, then per node its level, layer 0 links and
+    // upper layer links
+    uint32_t head[8] = {hnswVersion, (uint32_t)config.M, (uint32_t)config.efConstruction, (uint32_t)config.metric,
+                        (uint32_t)dim, (uint32_t)size(), (uint32_t)maxLevel, (uint32_t)entryPoint};
+    fwrite(hnswMagic, 1, sizeof(hnswMagic), fp);
+    fwrite(head, sizeof(uint32_t), 8, fp);
+    fwrite(&rowsHash, sizeof(rowsHash), 1, fp);
+    fwrite(levels.data(), sizeof(int), levels.size(), fp);
+    fwrite(baseLinks.data(), sizeof(int), baseLinks.size(), fp);
+    for (const std::vector<int> &l : upperLinks)
+        if (!l.empty())
+            fwrite(l.data(), sizeof(int), l.size(), fp);
+
+    bool ok = !ferror(fp);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok)
+    {
+        printf("Error writing %s\n", filename.c_str());
+        return (-1);
+    }
+    return (0);
+}
+
+int HnswIndex::load(const std::string &filename, const FeatureDatabase &db)
+{
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp)
+        return (-1);
+
+    // The counts are checked against the database before anything is allocated
+    char magic[sizeof(hnswMagic)];
+    uint32_t head[8];
+    uint64_t savedHash = 0;
+    bool ok = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+              memcmp(magic, hnswMagic, sizeof(magic)) == 0 &&
+              fread(head, sizeof(uint32_t), 8, fp) == 8 && head[0] == hnswVersion &&
+              fread(&savedHash, sizeof(savedHash), 1, fp) == 1 &&
+              head[1] >= 2 && head[1] <= 1024 && head[2] >= 1 && head[3] <= DISTANCE_COSINE &&
+              (head[5] == 0 || (int)head[4] == db.dimension()) && head[5] <= (uint32_t)db.size() &&
+              (int)head[6] >= -1 && (int)head[6] <= maxHnswLevel;
+
+    // A graph of other vectors would search fine and return wrong rows, so
+    // the rows it covers must still be the ones it was built from
+    bool stale = ok && hashRows(db, 0, (int)head[5], emptyRowsHash) != savedHash;
+    ok = ok && !stale;
+
+    int savedEf = config.efSearch;
+    if (ok)
+    {
+        clear();
+        config.M = (int)head[1];
+        config.efConstruction = (int)head[2];
+        config.metric = (DistanceMetric)head[3];
+        config.efSearch = savedEf;
+        dim = (int)head[4];
+        int count = (int)head[5];
+        maxLevel = (int)head[6];
+        entryPoint = (int)head[7];
+
+        levels.resize(count);
+        baseLinks.resize((size_t)count * (maxLinks(0) + 1));
+        ok = fread(levels.data(), sizeof(int), count, fp) == (size_t)count &&
+             fread(baseLinks.data(), sizeof(int), baseLinks.size(), fp) == baseLinks.size();
+        upperLinks.resize(count);
+        for (int i = 0; ok && i < count; i++)
+        {
+            ok = levels[i] >= 0 && levels[i] <= maxLevel;
+            if (!ok)
+                break;
+            upperLinks[i].resize((size_t)levels[i] * (maxLinks(1) + 1));
+            ok = fread(upperLinks[i].data(), sizeof(int), upperLinks[i].size(), fp) == upperLinks[i].size();
+        }
+
+        // Every link must point at a node of the index
+        for (int i = 0; ok && i < count; i++)
+        {
+            for (int l = 0; ok && l <= levels[i]; l++)
+            {
+                const int *n = links(i, l);
+                ok = n[0] >= 0 && n[0] <= maxLinks(l);
+                for (int j = 1; ok && j <= n[0]; j++)
+                    ok = n[j] >= 0 && n[j] < count && levels[n[j]] >= l;
+            }
+        }
+        ok = ok && (count == 0 ? entryPoint == -1 : entryPoint >= 0 && entryPoint < count && levels[entryPoint] == maxLevel);
+    }
+    fclose(fp);
+
+    if (!ok)
+    {
+        if (stale)
+            printf("Index file %s was built from other features\n", filename.c_str());
+        else
+            printf("Index file %s is corrupt or does not match the feature database\n", filename.c_str());
+        clear();
+        return (-1);
+    }
+    rowsHash = savedHash;
+    // Later insertions draw fresh levels; the count keeps them distinct from the first build
+    rng.seed(config.seed + (unsigned)size());
+    return (0);
+}
+
+RecallReport measureRecall(const HnswIndex &index, const FeatureDatabase &db, int k, int numQueries, unsigned seed)
+{
+    RecallReport report;
+    report.k = k;
+    if (db.empty() || index.size() == 0 || k <= 0)
+        return report;
+
+    // Spread of each feature over a sample of rows, to scale the perturbation
+    int dim = db.dimension();
+    int sampleRows = std::min(db.size(), 1000);
+    std::vector<double> mean(dim, 0.0), spread(dim, 0.0);
+    for (int i = 0; i < sampleRows; i++)
+        for (int j = 0; j < dim; j++)
+            mean[j] += db.row(i)[j] / sampleRows;
+    for (int i = 0; i < sampleRows; i++)
+        for (int j = 0; j < dim; j++)
+            spread[j] += (db.row(i)[j] - mean[j]) * (db.row(i)[j] - mean[j]) / sampleRows;
+
+    // A stored row would find itself at distance 0 and inflate recall, so
+    // every query is a row moved by noise of a tenth of each feature's spread
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> pick(0, db.size() - 1);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+    std::vector<float> query(dim);
+    long found = 0, expected = 0;
+    double exactMs = 0.0, indexMs = 0.0;
+    for (int q = 0; q < numQueries; q++)
+    {
+        const float *base = db.row(pick(rng));
+        for (int j = 0; j < dim; j++)
+            query[j] = base[j] + 0.1f * (float)std::sqrt(spread[j]) * noise(rng);
+
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<FeatureMatch> exact = findNearest(db, query.data(), k, index.params().metric);
+        auto t1 = std::chrono::steady_clock::now();
+        std::vector<FeatureMatch> approx = index.search(db, query.data(), k);
+        auto t2 = std::chrono::steady_clock::now();
+        exactMs += std::chrono::duration<double, std::milli>(t1 - t0).count();
+        indexMs += std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+        std::unordered_set<int> rows;
+        for (const FeatureMatch &m : approx)
+            rows.insert(m.row);
+        for (const FeatureMatch &m : exact)
+            found += rows.count(m.row);
+        expected += (long)exact.size();
+    }
+
+    report.queries = numQueries;
+    report.recall = expected > 0 ? (double)found / expected : 0.0;
+    report.exactMs = numQueries > 0 ? exactMs / numQueries : 0.0;
+    report.indexMs = numQueries > 0 ? indexMs / numQueries : 0.0;
+    return report;
+}
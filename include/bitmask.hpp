@@ -0,0 +1,106 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file bitmask.hpp
+ * @brief Binary mask packed one bit per pixel, with word-parallel morphology.
+ */
+
+#ifndef BITMASK_HPP
+#define BITMASK_HPP
+
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Binary image stored one bit per pixel in 64-bit words.
+ * @details Pixel x of a row is bit x % 64 of word x / 64, and every row starts
+ * on a new word. Bits past the last column are always 0, so whole words can be
+ * read and combined without masking. A 1080p mask takes 260 KB instead of 2 MB.
+ */
+class BitMask {
+public:
+    BitMask() {}
+    BitMask(int rows, int cols) { create(rows, cols); }
+
+    /**
+     * @brief Resizes the mask; the contents are undefined unless the size was already rows x cols.
+     */
+    void create(int rows, int cols);
+
+    /**
+     * @brief Clears every pixel.
+     */
+    void clear();
+
+    /**
+     * @brief Packs an 8-bit single-channel image; nonzero pixels are set.
+     * @return Returns 0 on success, -1 if src is not 8-bit single-channel.
+     */
+    int fromMat(const cv::Mat &src);
+
+    /**
+     * @brief Unpacks into a CV_8U image of 0 and 255.
+     */
+    void toMat(cv::Mat &dst) const;
+
+    /**
+     * @brief Packs one row of 8-bit pixels; nonzero pixels are set.
+     */
+    void packRow(int y, const uchar *pixels);
+
+    int rows() const { return numRows; } ///< Number of rows.
+    int cols() const { return numCols; } ///< Number of columns.
+    int wordsPerRow() const { return stride; } ///< Words in each row.
+    cv::Size size() const { return cv::Size(numCols, numRows); } ///< Size in pixels.
+    bool empty() const { return bits.empty(); } ///< Whether the mask has no pixels.
+    uint64_t *row(int y) { return bits.data() + (size_t)y * stride; } ///< Words of row y.
+    const uint64_t *row(int y) const { return bits.data() + (size_t)y * stride; } ///< Words of row y.
+    bool get(int y, int x) const { return (row(y)[x >> 6] >> (x & 63)) & 1; } ///< Whether pixel (x, y) is set.
+
+    /**
+     * @brief Number of set pixels.
+     */
+    long long count() const;
+
+private:
+    int numRows = 0, numCols = 0, stride = 0;
+    std::vector<uint64_t> bits;
+};
+
+/**
+ * @brief Working memory of the packed erosion() and dilation(), kept between calls.
+ */
+struct BitMaskScratch {
+    std::vector<uint64_t> valid, ahead, behind, shifted, horiz, acc; ///< One packed row each.
+    BitMask rowPass; ///< Row pass of the square kernel.
+    BitMask copy; ///< Copy of the input when it is also the output.
+};
+
+/**
+ * @brief Erosion of a packed mask, 64 pixels per word operation.
+ * @details Same kernel and border as erosion() on a 0/255 cv::Mat: a square
+ * for 8-connected, a cross for 4-connected, and pixels closer than
+ * kernelSize / 2 to the border come out 0.
+ * @param src Input mask.
+ * @param dst Output mask; may be src.
+ * @param kernelSize Size of the erosion kernel.
+ * @param connectedness Type of connectivity (4 or 8).
+ * @param scratch Working memory to reuse across calls, or nullptr to allocate it.
+ * @return Returns 0 on success, -1 on failure.
+ */
+int erosion(const BitMask &src, BitMask &dst, int kernelSize, int connectedness, BitMaskScratch *scratch = nullptr);
+
+/**
+ * @brief Dilation of a packed mask, 64 pixels per word operation.
+ * @details Same kernel and border as dilation() on a 0/255 cv::Mat.
+ * @param src Input mask.
+ * @param dst Output mask; may be src.
+ * @param kernelSize Size of the dilation kernel.
+ * @param connectedness Type of connectivity (4 or 8).
+ * @param scratch Working memory to reuse across calls, or nullptr to allocate it.
+ * @return Returns 0 on success, -1 on failure.
+ */
+int dilation(const BitMask &src, BitMask &dst, int kernelSize, int connectedness, BitMaskScratch *scratch = nullptr);
+
+#endif
@@ -0,0 +1,191 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file embedder.hpp
+ * @brief In-process DNN embedding of object crops through the OpenCV DNN module.
+ */
+
+#ifndef EMBEDDER_HPP
+#define EMBEDDER_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Crops, resamples and normalizes a region of a BGR frame straight into
+ * the network input, in place of the crop + PNG + Resize([256, 128]) + ToTensor
+ * + ImageNet Normalize steps of onnx_inference.py.
+ * @details The frame is only read; no copy of the crop is made. Axis-aligned
+ * regions use the antialiased bilinear filter of PIL's resize, applied one
+ * axis at a time with the coefficients cached per crop size. Rotated regions
+ * are sampled bilinearly, averaging several samples per pixel when shrinking.
+ * BGR to RGB and the mean/std normalization are folded into the final write.
+ */
+class RoiResampler {
+public:
+    /**
+     * @brief Resamples an axis-aligned region.
+     * @param frame BGR 8-bit frame.
+     * @param roi Region of the frame; parts outside the frame are ignored.
+     * @param tensor Output: three planes (R, G, B) of size.height x size.width floats.
+     * @param size Network input size.
+     * @return Returns 0 on success, -1 if the region is empty or the frame is not BGR.
+     */
+    int resample(const cv::Mat &frame, const cv::Rect &roi, float *tensor, cv::Size size);
+
+    /**
+     * @brief Resamples a rotated region, with its width along the output rows.
+     * @param frame BGR 8-bit frame.
+     * @param roi Region of the frame; samples outside the frame repeat its edge.
+     * @param tensor Output: three planes (R, G, B) of size.height x size.width floats.
+     * @param size Network input size.
+     * @return Returns 0 on success, -1 if the region is empty or the frame is not BGR.
+     */
+    int resample(const cv::Mat &frame, const cv::RotatedRect &roi, float *tensor, cv::Size size);
+
+private:
+    // Taps of a 1-D resampling filter from `in` to `out` samples
+    struct Filter {
+        int in = -1, out = -1;
+        std::vector<int> first, count; ///< First input sample and number of taps of each output.
+        std::vector<float> weights;    ///< `taps` weights per output.
+        int taps = 0;
+        void build(int inSize, int outSize);
+    };
+
+    Filter xFilter, yFilter;
+    std::vector<float> rows; ///< Horizontally resampled crop rows.
+};
+
+class Embedder;
+
+/**
+ * @brief Crops collected for one forward pass, possibly over several frames.
+ * @details Each region is resampled and normalized from the frame straight
+ * into a reusable NCHW tensor as it is added, so the frames need not be kept. Embeddings come back in
+ * the order the crops were added, tagged with the caller's keys.
+ */
+class EmbeddingBatch {
+public:
+    /**
+     * @brief Resamples a region of a frame into the next batch slot.
+     * @param key Caller's tag for the crop, such as a region label or track ID.
+     * @param frame BGR 8-bit frame.
+     * @param roi Region of the frame.
+     * @return Returns 0 on success, -1 if the region is empty or the frame not BGR.
+     */
+    int add(int key, const cv::Mat &frame, const cv::Rect &roi);
+
+    /**
+     * @brief Resamples a rotated region of a frame into the next batch slot.
+     * @param key Caller's tag for the crop.
+     * @param frame BGR 8-bit frame.
+     * @param roi Region of the frame, such as RegionFeatures::orientedBox.
+     * @return Returns 0 on success, -1 if the region is empty or the frame not BGR.
+     */
+    int add(int key, const cv::Mat &frame, const cv::RotatedRect &roi);
+
+    /**
+     * @brief Resamples a whole image into the next batch slot.
+     * @param key Caller's tag for the crop.
+     * @param image BGR 8-bit crop.
+     * @return Returns 0 on success, -1 if the crop is empty or not BGR.
+     */
+    int add(int key, const cv::Mat &image) { return add(key, image, cv::Rect(0, 0, image.cols, image.rows)); }
+
+    /**
+     * @brief Preallocates room for n crops, so adding them does not allocate.
+     */
+    void reserve(int n);
+
+    /**
+     * @brief Embeds every crop added so far in one pass and empties the batch.
+     * @param embedder Loaded network.
+     * @param features Output: one row per crop, in the order the crops were added.
+     * @param keys Output: the key of each row.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int run(Embedder &embedder, cv::Mat &features, std::vector<int> &keys);
+
+    int size() const { return (int)tags.size(); } ///< Number of crops waiting.
+    bool empty() const { return tags.empty(); } ///< True when no crops are waiting.
+    void clear() { tags.clear(); tensor.clear(); } ///< Drops the waiting crops; the buffer is kept.
+
+private:
+    float *nextSlot();
+
+    std::vector<int> tags;
+    std::vector<float> tensor;
+    RoiResampler resampler;
+};
+
+/**
+ * @brief Embedding network loaded once and run on object crops.
+ */
+class Embedder {
+public:
+    /**
+     * @brief Loads an ONNX model.
+     * @details The model is probed for a dynamic batch size, so a batch holds
+     * exactly as many crops as there are. Models exported with a fixed batch,
+     * like the 20-image batch of onnx_inference.py, are run in chunks of that
+     * size with only the last chunk padded.
+     * @param modelPath Path of the .onnx file.
+     * @param exportedBatch Batch size the model was exported with, used if other sizes fail; 0 for none.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int load(const std::string &modelPath, int exportedBatch = 0);
+
+    /**
+     * @brief True until a model is loaded.
+     */
+    bool empty() const { return dim == 0; }
+
+    /**
+     * @brief Length of the embeddings.
+     */
+    int dimension() const { return dim; }
+
+    /**
+     * @brief Embeds one BGR crop.
+     * @param image BGR 8-bit crop of the object.
+     * @param features Output embedding.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int embed(const cv::Mat &image, std::vector<float> &features);
+
+    /**
+     * @brief Embeds one region of a frame without copying it out.
+     * @param frame BGR 8-bit frame.
+     * @param roi Region of the frame.
+     * @param features Output embedding.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int embed(const cv::Mat &frame, const cv::Rect &roi, std::vector<float> &features);
+
+    /**
+     * @brief Embeds normalized crops in as few forward passes as the model allows.
+     * @param tensor count x 3 x inputHeight x inputWidth floats, as written by RoiResampler.
+     * @param count Number of crops.
+     * @param features Output: count x dimension() embeddings, one row per crop.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int embedBatch(const float *tensor, int count, cv::Mat &features);
+
+    static const int inputWidth = 128;  ///< Network input width.
+    static const int inputHeight = 256; ///< Network input height.
+
+private:
+    int forward(const cv::Mat &input, int count, cv::Mat &out, bool quiet = false);
+
+    cv::dnn::Net net;
+    int fixedBatch = 0; ///< Batch the model requires, or 0 if any batch works.
+    int dim = 0;
+    EmbeddingBatch single;
+    std::vector<int> singleKeys;
+    cv::Mat singleOut;
+    cv::Mat padded;
+};
+
+#endif
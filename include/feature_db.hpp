@@ -0,0 +1,163 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file feature_db.hpp
+ * @brief In-memory store of labelled feature vectors used for object matching.
+ */
+
+#ifndef FEATURE_DB_HPP
+#define FEATURE_DB_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief What the feature vectors in a database describe.
+ */
+enum FeatureKind : uint32_t {
+    FEATURE_UNKNOWN = 0,       ///< Not recorded.
+    FEATURE_HU_MOMENTS = 1,    ///< Hu moment invariants of a region (task5).
+    FEATURE_DNN_EMBEDDING = 2  ///< Embedding from the ONNX network (task9).
+};
+
+/**
+ * @brief Header of the binary feature database format (.fdb).
+ * @details Layout, all little-endian:
+ *  - this header;
+ *  - int32 label index per row;
+ *  - float32 features, row-major count x dimension, starting on a 64-byte boundary;
+ *  - uint64 offsets of each label string into the string data, plus an end offset;
+ *  - the label strings, one per distinct label, not NUL-terminated.
+ * All offsets are from the start of the file. The features are stored row by
+ * row rather than one array per feature: the HNSW index and the per-row
+ * distance kernels read whole rows at random, and a row spread over
+ * `dimension` arrays would cost a cache miss per feature.
+ */
+struct FeatureFileHeader {
+    char magic[8];                ///< "FEATDB\0\0".
+    uint32_t version;             ///< Format version, currently 1.
+    uint32_t byteOrder;           ///< 0x01020304 as written by the producer.
+    uint32_t dimension;           ///< Length of each feature vector.
+    uint32_t kind;                ///< FeatureKind tag.
+    uint64_t count;               ///< Number of rows.
+    uint64_t numLabels;           ///< Number of distinct labels.
+    uint64_t labelIndexOffset;    ///< Offset of the int32 label indices.
+    uint64_t featureOffset;       ///< Offset of the float32 feature block.
+    uint64_t stringOffsetsOffset; ///< Offset of the uint64 string offsets.
+    uint64_t stringDataOffset;    ///< Offset of the string data.
+    uint64_t fileSize;            ///< Total size, to detect truncated files.
+};
+
+/**
+ * @brief Feature vectors and their labels, loaded once and kept resident.
+ * @details Features live in one row-major float array (size() x dimension()).
+ * Each distinct label string is stored once and rows refer to it by index.
+ * A binary database is memory-mapped read-only, so opening it parses nothing
+ * and its pages are shared by every process that maps the same file.
+ */
+class FeatureDatabase {
+public:
+    /**
+     * @brief Opens a database, memory-mapping binary files and parsing anything else as CSV.
+     * @param filename Path of the .fdb or CSV file.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int open(const std::string &filename);
+
+    /**
+     * @brief Loads a CSV file of "label,f1,f2,..." rows, replacing the current contents.
+     * @param filename Path of the CSV file.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int load(const std::string &filename);
+
+    /**
+     * @brief Memory-maps a binary database, replacing the current contents.
+     * @param filename Path of the .fdb file.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int map(const std::string &filename);
+
+    /**
+     * @brief Writes the database in the binary format.
+     * @param filename Path of the .fdb file.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int saveBinary(const std::string &filename) const;
+
+    /**
+     * @brief Writes the database as CSV, with the shortest text that reads back to the same floats.
+     * @param filename Path of the CSV file.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int saveCsv(const std::string &filename) const;
+
+    /**
+     * @brief Appends one row. The first row fixes the dimension.
+     * @details A memory-mapped database is copied into memory first.
+     * @param label Label of the row.
+     * @param features Feature vector.
+     * @return Returns 0 on success, -1 if the dimension does not match.
+     */
+    int add(const std::string &label, const std::vector<float> &features);
+
+    /**
+     * @brief Removes every row and label.
+     */
+    void clear();
+
+    int size() const { return count; } ///< Number of rows.
+    int dimension() const { return dim; } ///< Length of each feature vector.
+    bool empty() const { return count == 0; } ///< True when there are no rows.
+    FeatureKind kind() const { return featureKind; } ///< What the features describe.
+    void setKind(FeatureKind k) { featureKind = k; } ///< Tags the features.
+
+    /**
+     * @brief Pointer to the features of row i.
+     */
+    const float *row(int i) const { return data() + (size_t)i * dim; }
+
+    /**
+     * @brief All features, row-major.
+     */
+    const float *data() const { return mapping ? mappedFeatures : features.data(); }
+
+    /**
+     * @brief Index of the label of row i into the label table.
+     */
+    int labelIndex(int i) const { return mapping ? mappedLabels[i] : rowLabels[i]; }
+
+    /**
+     * @brief Label of row i.
+     */
+    const std::string &label(int i) const { return labelNames[labelIndex(i)]; }
+
+    /**
+     * @brief Distinct labels, indexed by labelIndex().
+     */
+    const std::vector<std::string> &labels() const { return labelNames; }
+
+private:
+    struct MappedFile;
+
+    int internLabel(const std::string &label);
+    void detach();
+
+    int dim = 0;
+    int count = 0;
+    FeatureKind featureKind = FEATURE_UNKNOWN;
+    std::vector<float> features;
+    std::vector<int> rowLabels;
+    std::vector<std::string> labelNames;
+    std::unordered_map<std::string, int> labelIds;
+
+    // Set while the rows come from a memory-mapped file
+    std::shared_ptr<MappedFile> mapping;
+    const float *mappedFeatures = nullptr;
+    const int32_t *mappedLabels = nullptr;
+};
+
+#endif
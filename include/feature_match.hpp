@@ -0,0 +1,75 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file feature_match.hpp
+ * @brief Nearest-neighbour search over a FeatureDatabase.
+ */
+
+#ifndef FEATURE_MATCH_HPP
+#define FEATURE_MATCH_HPP
+
+#include <vector>
+#include "feature_db.hpp"
+
+/**
+ * @brief Distance used to rank database rows against a query.
+ */
+enum DistanceMetric {
+    DISTANCE_L2,     ///< Euclidean distance.
+    DISTANCE_COSINE  ///< 1 - cosine similarity; rows or queries of zero length are at distance 1.
+};
+
+/**
+ * @brief One database row returned by a search.
+ */
+struct FeatureMatch {
+    int row;        ///< Row in the database.
+    int label;      ///< Index of the row's label into FeatureDatabase::labels().
+    float distance; ///< Distance to the query.
+};
+
+/**
+ * @brief Sets the number of threads used by findNearest().
+ * @param numThreads Total number of threads; 0 uses all hardware threads.
+ */
+void setMatchThreads(int numThreads);
+
+/**
+ * @brief Number of threads used by findNearest().
+ */
+int getMatchThreads();
+
+/**
+ * @brief Distance between two feature vectors, using the same kernels as findNearest().
+ * @param a First vector.
+ * @param b Second vector.
+ * @param dim Length of both vectors.
+ * @param metric Distance to compute.
+ * @return Returns the distance.
+ */
+float featureDistance(const float *a, const float *b, int dim, DistanceMetric metric);
+
+/**
+ * @brief Distance from the query to every row of the database.
+ * @param db Database to search.
+ * @param query Query vector of db.dimension() floats.
+ * @param metric Distance to compute.
+ * @param distances Output, resized to db.size().
+ */
+void computeDistances(const FeatureDatabase &db, const float *query, DistanceMetric metric, std::vector<float> &distances);
+
+/**
+ * @brief Finds the k rows closest to the query.
+ * @details Rows are scanned with SIMD kernels over the contiguous feature
+ * block, in parallel for large databases, keeping a bounded heap of the best
+ * k instead of sorting every distance. Ties go to the lower row, so the result
+ * does not depend on the thread count.
+ * @param db Database to search.
+ * @param query Query vector of db.dimension() floats.
+ * @param k Number of matches to return.
+ * @param metric Distance to rank by.
+ * @return Returns up to k matches, closest first.
+ */
+std::vector<FeatureMatch> findNearest(const FeatureDatabase &db, const float *query, int k, DistanceMetric metric = DISTANCE_L2);
+
+#endif
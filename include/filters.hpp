@@ -5,9 +5,17 @@
  * @brief This file contains functions for image processing and object segmentation.
  */
 
+#ifndef FILTERS_HPP
+#define FILTERS_HPP
+
 #include <opencv2/opencv.hpp>
 #include <stdio.h>
 #include<iostream>
+#include <memory>
+#include "tracker.hpp"
+
+class BitMask;
+class RunLabeling;
 
 /**
  * @brief Struct to store information about a segmented region.
@@ -15,6 +23,57 @@
 struct RegionInfo {
     cv::Point2d centroid; ///< Centroid of the region.
     cv::Vec3b color; ///< Color of the region.
+    int trackId = -1; ///< Persistent ID assigned by the RegionTracker.
+};
+
+/**
+ * @brief Sets how many threads the image operators split each frame across.
+ * @details Frames are cut into row bands that run on a shared thread pool; the
+ * result is identical to the single-threaded path. Safe to call while frames
+ * are being processed: operators already running finish on the old pool.
+ * @param numThreads Number of threads; 0 uses all hardware threads, 1 runs serially.
+ */
+void setFilterThreads(int numThreads);
+
+/**
+ * @brief Returns the number of threads the image operators use.
+ */
+int getFilterThreads();
+
+/**
+ * @brief Working memory of the image operators, kept from call to call.
+ * @details Passing the same FilterBuffers to every call keeps the line
+ * buffers of each row band, the intermediate masks and the segmentation
+ * tables, so once the frame size and region count settle the operators do not
+ * allocate. Use one FilterBuffers per thread of calls; PipelineContext owns one
+ * per stream.
+ */
+class FilterBuffers {
+public:
+    FilterBuffers();
+    ~FilterBuffers();
+
+    FilterBuffers(const FilterBuffers &) = delete;
+    FilterBuffers &operator=(const FilterBuffers &) = delete;
+
+    struct State;
+    State &state() { return *impl; } ///< Buffers themselves, defined in filters.cpp.
+
+private:
+    std::unique_ptr<State> impl;
+};
+
+/**
+ * @brief Features of one segmented region.
+ */
+struct RegionFeatures {
+    int label = 0; ///< Label of the region in the label image.
+    cv::Moments moments; ///< Spatial, central and normalized central moments.
+    double huMoments[7] = {0, 0, 0, 0, 0, 0, 0}; ///< Hu invariants of the moments.
+    double orientation = 0; ///< Angle of the axis of least central moment, in radians.
+    cv::Point2d centroid; ///< Centroid of the region.
+    cv::Rect boundingBox; ///< Axis-aligned bounding box.
+    cv::RotatedRect orientedBox; ///< Minimum-area oriented bounding box.
 };
 
 /**
@@ -23,9 +82,10 @@ struct RegionInfo {
  * @param dst Output image after erosion.
  * @param kernelSize Size of the erosion kernel.
  * @param connectedness Type of connectivity (4 or 8).
+ * @param buffers Working memory to reuse across calls, or nullptr to allocate it.
  * @return Returns 0 on success, -1 on failure.
  */
-int erosion(cv::Mat & src, cv::Mat & dst, int kernelSize, int connectedness);
+int erosion(cv::Mat & src, cv::Mat & dst, int kernelSize, int connectedness, FilterBuffers *buffers = nullptr);
 
 /**
  * @brief Performs dilation operation on a binary image.
@@ -33,36 +93,174 @@ int erosion(cv::Mat & src, cv::Mat & dst, int kernelSize, int connectedness);
  * @param dst Output image after dilation.
  * @param kernelSize Size of the dilation kernel.
  * @param connectedness Type of connectivity (4 or 8).
+ * @param buffers Working memory to reuse across calls, or nullptr to allocate it.
  * @return Returns 0 on success, -1 on failure.
  */
-int dilation(cv::Mat & src, cv::Mat & dst, int kernelSize, int connectedness);
+int dilation(cv::Mat & src, cv::Mat & dst, int kernelSize, int connectedness, FilterBuffers *buffers = nullptr);
 
 /**
  * @brief Performs thresholding operation on an input image.
  * @param src Input image.
  * @param dst Output binary image after thresholding.
  * @param kernelSize Size of the thresholding kernel.
+ * @param buffers Working memory to reuse across calls, or nullptr to allocate it.
+ * @return Returns 0 on success, -1 on failure.
+ */
+int thresholding(cv::Mat & src, cv::Mat & dst, int kernelSize, FilterBuffers *buffers = nullptr);
+
+/**
+ * @brief Performs thresholding and packs the result one bit per pixel.
+ * @details Same foreground as thresholding(); no byte mask is written.
+ * @param src Input image.
+ * @param dst Output packed mask.
+ * @param threshold Threshold, as for thresholding().
+ * @param buffers Working memory to reuse across calls, or nullptr to allocate it.
+ * @return Returns 0 on success, -1 on failure.
+ */
+int thresholding(cv::Mat &src, BitMask &dst, int threshold, FilterBuffers *buffers = nullptr);
+
+/**
+ * @brief Threshold value that asks for an AutoThreshold instead of a fixed level.
+ */
+const int AUTO_THRESHOLD = -1;
+
+/**
+ * @brief Luminance histogram of a sample of an image's rows.
+ * @details Takes every pixel of every rowStep-th row, 1 in 16 of the image
+ * for a rowStep of 16, with the gray conversion thresholding() uses.
+ * @param src Input 8-bit BGR, BGRA or gray image.
+ * @param rowStep Rows between sampled rows, at least 1.
+ * @param histogram Output counts of the 256 gray levels.
+ * @return Returns the number of samples, or -1 if src is not an 8-bit image.
+ */
+int sampleHistogram(const cv::Mat &src, int rowStep, int histogram[256]);
+
+/**
+ * @brief Otsu's threshold: the split of a histogram that maximizes the between-class variance.
+ * @param histogram Counts of the 256 gray levels.
+ * @param separation If not nullptr, receives the distance between the two class means in gray levels.
+ * @return Returns the threshold; levels above it are background, as in thresholding().
+ */
+int otsuThreshold(const int histogram[256], double *separation = nullptr);
+
+/**
+ * @brief Foreground threshold that follows the lighting from frame to frame.
+ * @details Each update() takes Otsu's split of a sampleHistogram() of the
+ * frame and blends it into an exponential moving average. Frames whose two
+ * classes are less than minSeparation levels apart, such as an empty scene,
+ * leave the threshold where it was, and the reported value only moves once the
+ * average has drifted a whole level (the hysteresis), so it does not flicker
+ * between two.
+ */
+class AutoThreshold {
+public:
+    /**
+     * @param initial Threshold until the first frame with two classes.
+     * @param smoothing Weight of each new frame in the moving average, in (0, 1].
+     * @param rowStep Rows between sampled rows, passed to sampleHistogram().
+     * @param minSeparation Smallest distance between the class means that moves the threshold.
+     */
+    explicit AutoThreshold(int initial = 100, double smoothing = 0.1, int rowStep = 16, double minSeparation = 30);
+
+    /**
+     * @brief Updates the threshold from a frame.
+     * @param frame Input 8-bit BGR, BGRA or gray frame.
+     * @return Returns the threshold to use for this frame.
+     */
+    int update(const cv::Mat &frame);
+
+    /**
+     * @brief Goes back to the initial threshold; the next frame with two classes is taken as is.
+     */
+    void reset();
+
+    /**
+     * @brief Sets how far the average must drift from the returned threshold before it moves.
+     * @param levels Gray levels, at least 1. Callers that pay for every change,
+     * such as IncrementalSegmenter, use a wider band.
+     */
+    void setHysteresis(double levels);
+
+    int value() const { return current; } ///< Threshold returned by the last update().
+
+private:
+    int initialValue, step, current;
+    double alpha, minGap, average;
+    double hold = 1.0; ///< Hysteresis in gray levels.
+    bool settled = false;
+};
+
+/**
+ * @brief Fused preprocessing: thresholding, then dilation, then erosion in a single sweep.
+ * @details Same result as calling thresholding(), dilation() and erosion() one after
+ * another, but row bands stream through all three operators via rolling line buffers
+ * and only the final cleaned mask is written.
+ * @param src Input BGR image.
+ * @param dst Output cleaned binary image.
+ * @param threshold Threshold passed to thresholding().
+ * @param dilateSize Size of the dilation kernel.
+ * @param dilateConnectedness Type of connectivity for dilation (4 or 8).
+ * @param erodeSize Size of the erosion kernel.
+ * @param erodeConnectedness Type of connectivity for erosion (4 or 8).
+ * @param buffers Working memory to reuse across calls, or nullptr to allocate it.
  * @return Returns 0 on success, -1 on failure.
  */
-int thresholding(cv::Mat & src, cv::Mat & dst, int kernelSize);
+int preprocessFrame(cv::Mat &src, cv::Mat &dst, int threshold, int dilateSize, int dilateConnectedness, int erodeSize, int erodeConnectedness, FilterBuffers *buffers = nullptr);
+
+/**
+ * @brief Preprocessing into a packed mask: thresholding, dilation and erosion one bit per pixel.
+ * @details Same mask as preprocessFrame(); the morphology works on 64 pixels per word operation.
+ * @param src Input BGR image.
+ * @param dst Output cleaned packed mask.
+ * @param threshold Threshold passed to thresholding().
+ * @param dilateSize Size of the dilation kernel.
+ * @param dilateConnectedness Type of connectivity for dilation (4 or 8).
+ * @param erodeSize Size of the erosion kernel.
+ * @param erodeConnectedness Type of connectivity for erosion (4 or 8).
+ * @param buffers Working memory to reuse across calls, or nullptr to allocate it.
+ * @return Returns 0 on success, -1 on failure.
+ */
+int preprocessFrame(cv::Mat &src, BitMask &dst, int threshold, int dilateSize, int dilateConnectedness, int erodeSize, int erodeConnectedness, FilterBuffers *buffers = nullptr);
 
 /**
  * @brief Segments objects in the input image and returns the segmented image.
  * @param src Input image.
  * @param dst Output segmented image.
  * @param minRegionSize Minimum size of a region to be considered an object.
- * @param prevRegions Map containing information about previously segmented regions.
- * @return Returns the segmented image.
+ * @param prevRegions Filled with the regions of this frame, keyed by label.
+ * @param tracker Tracker that carries region IDs and colors across frames.
+ * @return Returns the label image of the kept regions, CV_16U unless a label does not fit.
  */
-cv::Mat segmentObjects(cv::Mat &src, cv::Mat &dst, int minRegionSize, std::map<int, RegionInfo>& prevRegions);
+cv::Mat segmentObjects(cv::Mat &src, cv::Mat &dst, int minRegionSize, std::map<int, RegionInfo>& prevRegions, RegionTracker& tracker);
 
 /**
- * @brief Retrieves the color for a segmented region based on its centroid.
- * @param centroid Centroid of the region.
- * @param prevRegions Map containing information about previously segmented regions.
- * @return Returns the color for the region.
+ * @brief Segments objects like segmentObjects(), but leaves the labeling as row runs.
+ * @details No label image is written; RunLabeling::features() computes the
+ * features of the regions from the runs, and RunLabeling::labelImage() writes
+ * the label image for callers that need one.
+ * @param src Input binary image, 8-bit single-channel.
+ * @param dst Output segmented image.
+ * @param minRegionSize Minimum size of a region to be considered an object.
+ * @param prevRegions Filled with the regions of this frame, keyed by label.
+ * @param tracker Tracker that carries region IDs and colors across frames.
+ * @param labeling Filled with the runs and region statistics of src.
+ * @param buffers Working memory to reuse across calls, or nullptr to allocate it.
+ * @return Returns 0 on success, -1 if src is not 8-bit single-channel.
+ */
+int segmentObjects(const cv::Mat &src, cv::Mat &dst, int minRegionSize, std::map<int, RegionInfo>& prevRegions, RegionTracker& tracker, RunLabeling &labeling, FilterBuffers *buffers = nullptr);
+
+/**
+ * @brief Segments objects of a packed mask, leaving the labeling as row runs.
+ * @param src Input packed mask.
+ * @param dst Output segmented image.
+ * @param minRegionSize Minimum size of a region to be considered an object.
+ * @param prevRegions Filled with the regions of this frame, keyed by label.
+ * @param tracker Tracker that carries region IDs and colors across frames.
+ * @param labeling Filled with the runs and region statistics of src.
+ * @param buffers Working memory to reuse across calls, or nullptr to allocate it.
+ * @return Returns 0.
  */
-cv::Vec3b getColorForRegion(cv::Point2d centroid, std::map<int, RegionInfo>& prevRegions);
+int segmentObjects(const BitMask &src, cv::Mat &dst, int minRegionSize, std::map<int, RegionInfo>& prevRegions, RegionTracker& tracker, RunLabeling &labeling, FilterBuffers *buffers = nullptr);
 
 /**
  * @brief Computes features for a segmented region.
@@ -73,4 +271,22 @@ cv::Vec3b getColorForRegion(cv::Point2d centroid, std::map<int, RegionInfo>& pre
  * @param color Color of the region.
  * @return Returns the computed features for the region.
  */
-cv::Moments computeFeatures(cv::Mat &src, const cv::Mat &labels, int label, const cv::Point2d &centroid, const cv::Vec3b &color);
\ No newline at end of file
+cv::Moments computeFeatures(cv::Mat &src, const cv::Mat &labels, int label, const cv::Point2d &centroid, const cv::Vec3b &color);
+
+/**
+ * @brief Computes features for every region in a single pass over the label image.
+ * @param labels Image containing labeled regions, CV_16U or CV_32S.
+ * @param regions Regions to compute features for, keyed by label.
+ * @return Returns one entry per region, in the order of regions.
+ */
+std::vector<RegionFeatures> computeAllFeatures(const cv::Mat &labels, const std::map<int, RegionInfo> &regions);
+
+/**
+ * @brief Draws the oriented bounding box and orientation line of a region.
+ * @param src Image to draw on.
+ * @param features Features of the region.
+ * @param color Color to draw with.
+ */
+void drawFeatures(cv::Mat &src, const RegionFeatures &features, const cv::Vec3b &color);
+
+#endif
@@ -0,0 +1,110 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file frame_scheduler.hpp
+ * @brief Latency-budget controller that trades processing scale, frame skipping and classification for a frame deadline.
+ */
+
+#ifndef FRAME_SCHEDULER_HPP
+#define FRAME_SCHEDULER_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "filters.hpp"
+
+/**
+ * @brief Tuning parameters of a FrameScheduler.
+ */
+struct SchedulerParams {
+    double deadlineMs = 33.3;  ///< Processing time allowed per captured frame.
+    std::vector<double> scales = {1.0, 0.75, 0.5, 0.35}; ///< Processing scales to step through, largest first.
+    int maxClassifyInterval = 4; ///< Classification runs on at least every n-th processed frame.
+    int maxStride = 3;         ///< At least every n-th captured frame is processed.
+    double degradeAt = 1.0;    ///< Step down when the predicted cost is above this fraction of the deadline.
+    double upgradeAt = 0.6;    ///< Step up when the better level is predicted below this fraction of the deadline.
+    int holdFrames = 30;       ///< Processed frames a level is kept before stepping up again.
+    double smoothing = 0.1;    ///< Weight of the newest measurement in the running cost averages.
+};
+
+/**
+ * @brief What to do with one captured frame.
+ */
+struct FrameDecision {
+    bool process = true;  ///< Segment this frame; otherwise reuse the last results.
+    bool classify = true; ///< Classify this frame's regions; otherwise reuse the last labels.
+    double scale = 1.0;   ///< Factor to resize the frame by before processing.
+    int level = 0;        ///< Quality level, 0 being full quality.
+};
+
+/**
+ * @brief Chooses per frame how much work to do so processing keeps up with a deadline.
+ * @details Quality levels first lower the processing scale, then classify only
+ * every few processed frames, then skip whole frames. The cost of processing
+ * at scale 1 and of one classification are kept as running averages of the
+ * reported latencies, and predict the cost of every level: processing cost
+ * falls with the square of the scale and skipped work is spread over the
+ * frames that skip it. The scheduler drops straight to the first level
+ * predicted to fit when the current one does not, but climbs back only one
+ * level at a time, after holding a level for a while and only with clear
+ * headroom, so it does not oscillate. next() and report() may be called from
+ * different threads.
+ */
+class FrameScheduler {
+public:
+    explicit FrameScheduler(const SchedulerParams &params = SchedulerParams());
+
+    /**
+     * @brief Decides what to do with the next captured frame.
+     */
+    FrameDecision next();
+
+    /**
+     * @brief Reports what a processed frame cost; skipped frames need no report.
+     * @param decision Decision the frame was processed with.
+     * @param processMs Time spent resizing, segmenting and computing features.
+     * When those steps run as concurrent pipeline stages, pass the slowest
+     * stage's share instead of their sum: it is what limits the frame rate.
+     * @param classifyMs Time spent classifying, if decision.classify was set.
+     */
+    void report(const FrameDecision &decision, double processMs, double classifyMs = 0.0);
+
+    /**
+     * @brief Predicted processing time per captured frame at a level, or 0 before any report.
+     */
+    double predictedMs(int level) const;
+
+    int level() const; ///< Current quality level.
+    int levels() const { return (int)ladder.size(); } ///< Number of quality levels.
+    const SchedulerParams &params() const { return config; } ///< Current parameters.
+
+private:
+    struct Level {
+        double scale;
+        int classifyEvery;
+        int stride;
+    };
+
+    double predictLocked(int level) const;
+
+    SchedulerParams config;
+    std::vector<Level> ladder;
+    mutable std::mutex mutex;
+    int current = 0;
+    int held = 0;
+    uint64_t captured = 0;
+    uint64_t processed = 0;
+    double processCost = -1.0;  ///< Running average of processing ms at scale 1.
+    double classifyCost = -1.0; ///< Running average of ms per classification.
+};
+
+/**
+ * @brief Maps features computed on a resized frame back to the original frame.
+ * @details Centroids and boxes are scaled; moments and Hu invariants are left
+ * as computed.
+ * @param features Features to rescale in place.
+ * @param factor Original frame size divided by the processed frame size.
+ */
+void scaleFeatures(std::vector<RegionFeatures> &features, double factor);
+
+#endif
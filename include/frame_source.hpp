@@ -0,0 +1,57 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file frame_source.hpp
+ * @brief Frames from a camera, a video file or a directory of images behind one interface.
+ */
+
+#ifndef FRAME_SOURCE_HPP
+#define FRAME_SOURCE_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Image files of a directory in name order.
+ * @param dir Directory to list.
+ * @return Returns the paths of the .png, .jpg, .jpeg, .bmp, .tif, .tiff, .ppm and .pgm files.
+ */
+std::vector<std::string> listImages(const std::string &dir);
+
+/**
+ * @brief Reads frames from a camera index, a video file or URL, or an image directory.
+ */
+class FrameSource {
+public:
+    /**
+     * @brief Opens a source.
+     * @param spec A camera index such as "0", a directory of images, or anything cv::VideoCapture opens.
+     * @return Returns 0 on success, -1 if the source cannot be opened or the directory has no images.
+     */
+    int open(const std::string &spec);
+
+    /**
+     * @brief Reads the next frame; unreadable images in a directory are skipped.
+     * @param frame Output BGR frame.
+     * @return Returns false at the end of the source.
+     */
+    bool read(cv::Mat &frame);
+
+    /**
+     * @brief Closes the source.
+     */
+    void close();
+
+    const std::string &name() const { return spec; } ///< Spec the source was opened with.
+    bool live() const { return camera; } ///< True for cameras, whose frames arrive in real time.
+
+private:
+    std::string spec;
+    bool camera = false;
+    cv::VideoCapture cap;
+    std::vector<std::string> images;
+    size_t nextImage = 0;
+};
+
+#endif
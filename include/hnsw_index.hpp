@@ -0,0 +1,148 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file hnsw_index.hpp
+ * @brief Approximate nearest-neighbour index (HNSW) over a FeatureDatabase.
+ */
+
+#ifndef HNSW_INDEX_HPP
+#define HNSW_INDEX_HPP
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include "feature_db.hpp"
+#include "feature_match.hpp"
+
+/**
+ * @brief Tuning parameters of an HnswIndex.
+ */
+struct HnswParams {
+    int M = 16;                ///< Links per node on the upper layers; layer 0 keeps 2 * M.
+    int efConstruction = 200;  ///< Candidate list size while inserting; larger builds a better graph, slower.
+    int efSearch = 64;         ///< Candidate list size while searching; larger raises recall, slower.
+    DistanceMetric metric = DISTANCE_L2; ///< Distance the graph is built for.
+    unsigned seed = 42;        ///< Seed of the level generator, so builds are reproducible.
+};
+
+/**
+ * @brief Hierarchical navigable small-world graph over the rows of a FeatureDatabase.
+ * @details The index holds only the graph. Vectors are read from the database
+ * passed to each call, which must be the one the index was built from, with
+ * rows only ever appended. A search visits a number of nodes that grows with
+ * the logarithm of the database size, so its latency stays nearly flat as the
+ * catalog grows. Searches may run concurrently; insertion may not.
+ */
+class HnswIndex {
+public:
+    explicit HnswIndex(const HnswParams &params = HnswParams());
+    ~HnswIndex();
+
+    HnswIndex(const HnswIndex &) = delete;
+    HnswIndex &operator=(const HnswIndex &) = delete;
+
+    /**
+     * @brief Inserts every database row that is not in the index yet.
+     * @param db Database the index belongs to.
+     * @return Returns the number of rows inserted, or -1 if the database does not match the index.
+     */
+    int update(const FeatureDatabase &db);
+
+    /**
+     * @brief Finds approximately the k rows closest to the query.
+     * @param db Database the index belongs to.
+     * @param query Query vector of db.dimension() floats.
+     * @param k Number of matches to return.
+     * @param ef Candidate list size, at least k; 0 uses the efSearch parameter.
+     * @return Returns up to k matches, closest first.
+     */
+    std::vector<FeatureMatch> search(const FeatureDatabase &db, const float *query, int k, int ef = 0) const;
+
+    /**
+     * @brief Writes the graph to a file.
+     * @param filename Path of the index file, conventionally the feature file name plus ".hnsw".
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int save(const std::string &filename) const;
+
+    /**
+     * @brief Reads a graph written by save(), replacing the current one.
+     * @details The parameters stored in the file replace the current ones,
+     * except efSearch. The file records a hash of the rows it indexed; if
+     * those rows of db no longer hash the same, the file is rejected and the
+     * index left empty, so update() rebuilds it. Rows added to the database
+     * since the file was written can then be indexed with update().
+     * @param filename Path of the index file.
+     * @param db Database the index belongs to.
+     * @return Returns 0 on success, -1 if the file is missing, corrupt or does not match db.
+     */
+    int load(const std::string &filename, const FeatureDatabase &db);
+
+    /**
+     * @brief Removes every node.
+     */
+    void clear();
+
+    int size() const { return (int)levels.size(); } ///< Number of indexed rows.
+    const HnswParams &params() const { return config; } ///< Current parameters.
+    void setEfSearch(int ef) { config.efSearch = ef; } ///< Changes the search candidate list size.
+
+private:
+    struct VisitedSet;
+    typedef std::pair<float, int> Candidate;
+
+    int maxLinks(int level) const { return level == 0 ? 2 * config.M : config.M; }
+    int *links(int node, int level);
+    const int *links(int node, int level) const;
+    int randomLevel();
+    void insert(const FeatureDatabase &db, int node);
+    int greedyDescend(const FeatureDatabase &db, const float *query, int entry, int fromLevel, int toLevel) const;
+    std::vector<Candidate> searchLayer(const FeatureDatabase &db, const float *query, int entry, int ef, int level) const;
+    void selectNeighbors(const FeatureDatabase &db, std::vector<Candidate> &candidates, int m) const;
+    std::unique_ptr<VisitedSet> acquireVisited() const;
+    void releaseVisited(std::unique_ptr<VisitedSet> visited) const;
+
+    HnswParams config;
+    int dim = 0;
+    int entryPoint = -1;
+    int maxLevel = -1;
+    uint64_t rowsHash;                        ///< Hash of the features of the indexed rows.
+    std::mt19937 rng;
+    std::vector<int> levels;                  ///< Top layer of each node.
+    std::vector<int> baseLinks;               ///< Layer 0: per node a count followed by 2 * M neighbours.
+    std::vector<std::vector<int>> upperLinks; ///< Layers 1..level: per layer a count followed by M neighbours.
+
+    // Visited marks reused across searches, one set per concurrent search
+    mutable std::mutex visitedMutex;
+    mutable std::vector<std::unique_ptr<VisitedSet>> visitedPool;
+};
+
+/**
+ * @brief Recall and latency of an index against exact search.
+ */
+struct RecallReport {
+    int queries = 0;          ///< Number of queries run.
+    int k = 0;                ///< Matches requested per query.
+    double recall = 0.0;      ///< Fraction of the exact top-k rows that the index returned.
+    double exactMs = 0.0;     ///< Mean exact search time per query.
+    double indexMs = 0.0;     ///< Mean index search time per query.
+};
+
+/**
+ * @brief Measures recall@k of an index on perturbed database rows.
+ * @details Each query is a random row plus Gaussian noise of a tenth of each
+ * feature's spread, so it is near real data but never an indexed vector
+ * that would trivially find itself.
+ * @param index Index to evaluate.
+ * @param db Database the index belongs to.
+ * @param k Number of matches per query.
+ * @param numQueries Number of queries to run.
+ * @param seed Seed used to pick the rows.
+ * @return Returns the report.
+ */
+RecallReport measureRecall(const HnswIndex &index, const FeatureDatabase &db, int k, int numQueries, unsigned seed = 1);
+
+#endif
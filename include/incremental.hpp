@@ -0,0 +1,127 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file incremental.hpp
+ * @brief Change-driven segmentation that only recomputes the tiles of a frame that changed.
+ */
+
+#ifndef INCREMENTAL_HPP
+#define INCREMENTAL_HPP
+
+#include <opencv2/opencv.hpp>
+#include <map>
+#include <vector>
+#include "filters.hpp"
+#include "tracker.hpp"
+
+/**
+ * @brief Tuning parameters of an IncrementalSegmenter.
+ */
+struct IncrementalParams {
+    int tileSize = 32;           ///< Edge of the square tiles frames are compared on.
+    int pixelDelta = 24;         ///< Difference of one channel value that counts as a change.
+    int minChangedSamples = 4;   ///< Changed channel values that make a tile dirty.
+    double fullRecomputeRatio = 0.5; ///< Share of dirty tiles above which the whole frame is recomputed.
+    int refreshFrames = 300;     ///< Frames between forced full recomputes, which catch drift below pixelDelta; 0 never forces one.
+    int threshold = 100;         ///< Foreground threshold passed to preprocessFrame().
+    double thresholdHysteresis = 4; ///< Hysteresis of an AutoThreshold feeding setThreshold(), see AutoThreshold::setHysteresis().
+    int dilateSize = 5;          ///< Dilation kernel size.
+    int dilateConnectedness = 8; ///< Dilation connectedness.
+    int erodeSize = 5;           ///< Erosion kernel size.
+    int erodeConnectedness = 4;  ///< Erosion connectedness.
+    int minRegionSize = 500;     ///< Smallest region kept, as in segmentObjects().
+};
+
+/**
+ * @brief What the last call to IncrementalSegmenter::process() recomputed.
+ */
+struct IncrementalStats {
+    int tiles = 0;          ///< Tiles in the frame.
+    int dirtyTiles = 0;     ///< Tiles that differed from the last processed frame.
+    bool full = false;      ///< Whether the whole frame was recomputed.
+    cv::Rect relabeled;     ///< Bounding box of the areas whose components were relabeled; empty if none.
+    int reusedRegions = 0;  ///< Kept regions whose features came from the cache.
+};
+
+/**
+ * @brief Threshold, morphology, labeling and features that follow a mostly static scene incrementally.
+ * @details Each frame is compared with the last processed one tile by tile.
+ * Threshold and morphology rerun only on the dirty tiles plus the reach of
+ * the blur and both kernels, which gives those pixels exactly as a full
+ * preprocessFrame() of the frame would. Labeling reruns on the smallest rectangles that
+ * cover the changed foreground pixels and every old component touching one,
+ * and the area, colors and features of components outside them are reused.
+ * Too many dirty tiles, a new frame size, or refreshFrames frames since the
+ * last full pass fall back to a full recompute. Changes below pixelDelta are
+ * ignored until they add up past it, so between full passes the binary image
+ * can lag slow drift of a tile and differ from what preprocessFrame() gives
+ * on the whole frame.
+ */
+class IncrementalSegmenter {
+public:
+    explicit IncrementalSegmenter(const IncrementalParams &params = IncrementalParams());
+
+    /**
+     * @brief Processes one frame.
+     * @param frame 8-bit BGR, BGRA or gray frame.
+     * @param tracker Tracker that carries region IDs and colors across frames.
+     * @return Returns 0 on success, -1 if the frame is not 8-bit.
+     */
+    int process(const cv::Mat &frame, RegionTracker &tracker);
+
+    /**
+     * @brief Forgets the cached frame, so the next one is recomputed in full.
+     */
+    void reset();
+
+    /**
+     * @brief Changes the foreground threshold, as from an AutoThreshold; a new value recomputes the next frame in full.
+     * @details Every pixel was thresholded with the old value, so each change
+     * costs one full frame. An automatic threshold therefore gives up part of
+     * the incremental savings while the lighting drifts; give its
+     * AutoThreshold the params' thresholdHysteresis so sensor noise alone does
+     * not move it.
+     */
+    void setThreshold(int threshold);
+
+    const cv::Mat &binary() const { return binaryImage; } ///< Cleaned foreground; valid until the next process().
+    const cv::Mat &labels() const { return labelImage; } ///< CV_32S component labels; valid until the next process().
+    const cv::Mat &segmented() const { return colorImage; } ///< Regions colorized by track; valid until the next process().
+    const std::map<int, RegionInfo> &regions() const { return regionMap; } ///< Kept regions by label, as from segmentObjects().
+    const std::vector<RegionFeatures> &features() const { return featureList; } ///< Features of the kept regions, in label order.
+    const IncrementalStats &lastStats() const { return stats; } ///< What the last frame recomputed.
+    const IncrementalParams &params() const { return config; } ///< Current parameters.
+
+private:
+    struct Component {
+        bool alive = false;
+        bool fresh = false; ///< Relabeled by the current frame.
+        int area = 0;
+        cv::Rect box;
+        cv::Point2d centroid;
+        cv::Vec3b color;
+        bool hasFeatures = false;
+        RegionFeatures features;
+    };
+
+    int halo() const;
+    void findDirtyTiles(const cv::Mat &frame, std::vector<uchar> &dirty);
+    void updateBinary(const cv::Mat &frame, const std::vector<uchar> &dirty, std::vector<cv::Rect> &changed);
+    cv::Rect growToComponents(cv::Rect area, std::vector<int> &oldLabels) const;
+    void mergeAreas(std::vector<cv::Rect> &areas) const;
+    void relabel(const cv::Rect &area, const std::vector<int> &oldLabels);
+    int newLabel();
+    void track(RegionTracker &tracker, const std::vector<cv::Rect> &areas);
+
+    IncrementalParams config;
+    cv::Mat reference; ///< Frame content each tile was last processed with.
+    cv::Mat binaryImage, labelImage, colorImage;
+    std::vector<Component> components; ///< Indexed by label; 0 is the background.
+    std::vector<int> freeLabels;
+    std::map<int, RegionInfo> regionMap;
+    std::vector<RegionFeatures> featureList;
+    IncrementalStats stats;
+    int framesSinceFull = 0;
+};
+
+#endif
@@ -0,0 +1,203 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file metrics.hpp
+ * @brief Lock-free latency histograms and counters for the pipeline, exported as Prometheus text and Chrome traces.
+ */
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Log-linear latency histogram in the style of HdrHistogram.
+ * @details Every power of two is split into 16 linear buckets, so a recorded
+ * value is known to within about 6% from 1 ns to the full 64-bit range, in a
+ * fixed array of counters. record() is a few relaxed atomic increments and is
+ * safe from any number of threads; readers see a consistent-enough snapshot
+ * without stopping the writers.
+ */
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKETS = 16;                     ///< Linear buckets per power of two.
+    static const int BUCKETS = (64 - 4 + 1) * SUB_BUCKETS; ///< Total number of buckets.
+
+    LatencyHistogram();
+
+    /**
+     * @brief Adds one value.
+     * @param ns Latency in nanoseconds.
+     */
+    void record(uint64_t ns);
+
+    /**
+     * @brief Value at a percentile, as the upper bound of the bucket that holds it.
+     * @param p Percentile from 0 to 100.
+     * @return Returns the latency in nanoseconds, or 0 if nothing was recorded.
+     */
+    uint64_t percentile(double p) const;
+
+    /**
+     * @brief Number of recorded values not larger than a bound, rounded to whole buckets.
+     * @param ns Upper bound in nanoseconds.
+     */
+    uint64_t countAtOrBelow(uint64_t ns) const;
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); } ///< Number of recorded values.
+    uint64_t sum() const { return sumNs.load(std::memory_order_relaxed); } ///< Sum of recorded values in ns.
+    uint64_t max() const { return maxNs.load(std::memory_order_relaxed); } ///< Largest recorded value in ns.
+
+    static int bucketIndex(uint64_t ns); ///< Bucket a value falls in.
+    static uint64_t bucketLow(int index); ///< Smallest value of a bucket.
+    static uint64_t bucketHigh(int index); ///< Largest value of a bucket.
+
+private:
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sumNs{0};
+    std::atomic<uint64_t> maxNs{0};
+};
+
+/**
+ * @brief Latencies, frame and drop counters and region counts of a running pipeline.
+ * @details Stages are registered before the run; recording after that takes
+ * no lock. Frames whose index is a multiple of the trace interval also keep
+ * their per-stage spans, which are written as Chrome trace-event JSON
+ * (chrome://tracing or Perfetto) to show where one frame's time went.
+ * startExport() rewrites the Prometheus text file and the trace file on a
+ * background thread, each through a rename so readers never see half a file.
+ */
+class PipelineMetrics {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * @brief Creates empty metrics.
+     * @param traceEvery Keep spans of every n-th frame; 0 keeps none.
+     * @param maxTraceEvents Spans kept; the oldest are discarded beyond this.
+     */
+    explicit PipelineMetrics(int traceEvery = 0, size_t maxTraceEvents = 100000);
+    ~PipelineMetrics();
+
+    PipelineMetrics(const PipelineMetrics &) = delete;
+    PipelineMetrics &operator=(const PipelineMetrics &) = delete;
+
+    /**
+     * @brief Registers a stage, or finds one registered under the same name.
+     * @details Must not race the record functions; may race the export thread.
+     * @param name Stage name, used as the Prometheus label.
+     * @return Returns the stage id passed to the record functions.
+     */
+    int addStage(const std::string &name);
+
+    /**
+     * @brief Records one call of a stage.
+     * @param stage Stage id.
+     * @param frame Index of the frame.
+     * @param start Time the call started.
+     * @param end Time the call returned.
+     */
+    void recordStage(int stage, uint64_t frame, Clock::time_point start, Clock::time_point end);
+
+    /**
+     * @brief Counts frames dropped from the queue feeding a stage.
+     * @param stage Stage id.
+     * @param n Number of frames dropped.
+     */
+    void recordDrops(int stage, uint64_t n);
+
+    /**
+     * @brief Records a frame leaving the pipeline.
+     * @param frame Index of the frame.
+     * @param captured Time the frame entered the pipeline.
+     * @param regions Number of regions found in the frame.
+     */
+    void recordFrame(uint64_t frame, Clock::time_point captured, size_t regions);
+
+    /**
+     * @brief Whether spans of a frame are kept for the trace.
+     */
+    bool traced(uint64_t frame) const { return traceEvery > 0 && frame % (uint64_t)traceEvery == 0; }
+
+    int stageCount() const { return (int)stages.size(); } ///< Number of registered stages.
+    const std::string &stageName(int stage) const { return stages[stage]->name; } ///< Name of a stage.
+    const LatencyHistogram &stageLatency(int stage) const { return stages[stage]->latency; } ///< Call latencies of a stage.
+    const LatencyHistogram &frameLatency() const { return endToEnd; } ///< Capture-to-last-stage latencies.
+
+    /**
+     * @brief Writes every metric in the Prometheus text exposition format.
+     * @param filename Output path, e.g. in the node_exporter textfile directory.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int writePrometheus(const std::string &filename) const;
+
+    /**
+     * @brief Writes the kept spans as Chrome trace-event JSON.
+     * @param filename Output path.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int writeChromeTrace(const std::string &filename) const;
+
+    /**
+     * @brief Rewrites the export files periodically until stopExport().
+     * @param promFile Prometheus output path; empty to skip.
+     * @param traceFile Chrome trace output path; empty to skip.
+     * @param intervalMs Time between rewrites.
+     */
+    void startExport(const std::string &promFile, const std::string &traceFile, int intervalMs = 5000);
+
+    /**
+     * @brief Stops the export thread after writing the files one last time.
+     */
+    void stopExport();
+
+private:
+    struct StageMetrics {
+        std::string name;
+        LatencyHistogram latency;
+        std::atomic<uint64_t> frames{0};
+        std::atomic<uint64_t> dropped{0};
+    };
+    struct TraceEvent {
+        int stage; // -1 for the whole frame
+        uint64_t frame;
+        int64_t startUs;
+        int64_t durationUs;
+    };
+
+    void addTraceEvent(int stage, uint64_t frame, Clock::time_point start, Clock::time_point end);
+    void exportFiles() const;
+
+    mutable std::mutex stageMutex; // Between addStage() and the exporters only
+    std::vector<std::unique_ptr<StageMetrics>> stages;
+    LatencyHistogram endToEnd;
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> regionsTotal{0};
+    std::atomic<uint64_t> lastRegions{0};
+    Clock::time_point origin;
+
+    // Spans of traced frames only, so this lock is taken a few times per traced frame
+    const int traceEvery;
+    const size_t maxEvents;
+    mutable std::mutex traceMutex;
+    std::vector<TraceEvent> events;
+    size_t nextEvent = 0;
+
+    std::string promPath, tracePath;
+    int exportIntervalMs = 5000;
+    bool exporting = false;
+    std::mutex exportMutex;
+    std::condition_variable exportWake;
+    std::thread exporter;
+};
+
+#endif
@@ -0,0 +1,179 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file pipeline.hpp
+ * @brief Multi-threaded frame pipeline: one thread per stage, bounded rings in between.
+ */
+
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "bitmask.hpp"
+#include "filters.hpp"
+#include "spsc_ring.hpp"
+#include "metrics.hpp"
+#include "frame_scheduler.hpp"
+#include "incremental.hpp"
+#include "run_labels.hpp"
+
+/**
+ * @brief Everything the stages know about one frame, handed from stage to stage.
+ */
+struct FrameData {
+    uint64_t index = 0; ///< Capture order, starting at 0.
+    std::chrono::steady_clock::time_point captured; ///< Time the source stage started on this frame.
+    cv::Mat frame; ///< Captured BGR frame; the render stage draws on it.
+    BitMask binary; ///< Thresholded and cleaned foreground, one bit per pixel.
+    cv::Mat labels; ///< Region labels, for stages that write a label image.
+    RunLabeling runs; ///< Foreground runs and region statistics of binary.
+    cv::Mat segmented; ///< Regions colorized by track.
+    std::map<int, RegionInfo> regions; ///< Regions of this frame, by label.
+    std::vector<RegionFeatures> features; ///< Features of every region.
+    std::vector<std::string> matchLabels; ///< Label matched to each entry of features, if classified.
+    std::vector<float> matchDistances; ///< Distance of each match.
+    FrameDecision decision; ///< How much work to do on this frame, full quality by default.
+    double processMs = 0.0; ///< Time the slowest processing stage spent on this frame.
+};
+
+/**
+ * @brief Processes one frame in place; returning false stops the pipeline.
+ */
+typedef std::function<bool(FrameData &)> StageFunction;
+
+/**
+ * @brief Counters of one stage, read after or during a run.
+ */
+struct StageStats {
+    std::string name; ///< Stage name.
+    uint64_t frames = 0; ///< Frames processed.
+    uint64_t dropped = 0; ///< Frames dropped from the queue feeding this stage.
+    double busyMs = 0.0; ///< Time spent inside the stage function.
+};
+
+/**
+ * @brief Chain of stages, each running on its own thread.
+ * @details The first stage is the source: it is called with an empty
+ * FrameData to fill, and returning false ends the stream. Every later stage
+ * takes frames from a bounded SpscRing fed by the stage before it, so the
+ * pipeline runs at the pace of its slowest stage instead of the sum of all of
+ * them. The last stage runs on the thread that calls run(), which keeps
+ * HighGUI calls on the main thread. Frames stay in capture order.
+ */
+class Pipeline {
+public:
+    Pipeline() = default;
+    ~Pipeline();
+
+    Pipeline(const Pipeline &) = delete;
+    Pipeline &operator=(const Pipeline &) = delete;
+
+    /**
+     * @brief Appends a stage.
+     * @param name Name used in stats().
+     * @param fn Stage body.
+     * @param capacity Size of the queue feeding this stage; ignored for the source.
+     * @param policy What the previous stage does when that queue is full.
+     */
+    void addStage(const std::string &name, StageFunction fn, size_t capacity = 2, QueuePolicy policy = QUEUE_BLOCK);
+
+    /**
+     * @brief Runs until the source ends or a stage returns false.
+     * @return Returns 0 on success, -1 if there are no stages.
+     */
+    int run();
+
+    /**
+     * @brief Asks every stage to finish; safe to call from any stage.
+     */
+    void stop();
+
+    /**
+     * @brief Counters of every stage.
+     */
+    std::vector<StageStats> stats() const;
+
+    /**
+     * @brief Records stage latencies, drops and frame latencies into metrics during run().
+     * @details Registers the stages with the metrics, so call it after the last addStage().
+     * @param metrics Metrics to fill, or nullptr to stop recording; must outlive the run.
+     */
+    void setMetrics(PipelineMetrics *metrics);
+
+private:
+    struct Stage {
+        std::string name;
+        StageFunction fn;
+        size_t capacity;
+        QueuePolicy policy;
+        std::unique_ptr<SpscRing<FrameData>> input;
+        std::atomic<uint64_t> frames{0};
+        std::atomic<uint64_t> busyUs{0};
+        int metricsId = -1;
+    };
+
+    void runStage(size_t i);
+    bool process(Stage &stage, FrameData &item);
+
+    std::vector<std::unique_ptr<Stage>> stages;
+    std::atomic<bool> stopping{false};
+    PipelineMetrics *recorder = nullptr;
+};
+
+/**
+ * @brief Adds the preprocess, segment/track and features stages.
+ * @details Frames are processed at the scale in their decision, with the
+ * smallest region scaled to match, and features are mapped back to frame
+ * coordinates. Frames the decision skips carry the regions, features and
+ * segmented image of the last processed frame, so overlays and tracks stay
+ * consistent.
+ * @param pipeline Pipeline to extend, after its source stage.
+ * @param threshold Foreground threshold passed to preprocessFrame(), or AUTO_THRESHOLD to follow the lighting with an AutoThreshold.
+ * @param minRegionSize Smallest region kept by segmentObjects() at full scale.
+ * @param sourcePolicy Policy of the queue between the source and preprocessing.
+ * @param scheduler Scheduler to report processing times to, or nullptr.
+ */
+void addSegmentationStages(Pipeline &pipeline, int threshold = 100, int minRegionSize = 500, QueuePolicy sourcePolicy = QUEUE_BLOCK,
+                           FrameScheduler *scheduler = nullptr);
+
+/**
+ * @brief Adds one stage that segments and computes features incrementally, for mostly static scenes.
+ * @details Only the tiles that changed since the last processed frame are
+ * recomputed; see IncrementalSegmenter. Frames get regions, features and the
+ * segmented image; binary and labels are left empty, since copying them out
+ * would cost more than the incremental work. Decisions are honored as by
+ * addSegmentationStages(); a change of scale recomputes the next frame in full.
+ * A params.threshold of AUTO_THRESHOLD follows the lighting with an
+ * AutoThreshold of params.thresholdHysteresis; each change of its value also
+ * recomputes in full, so auto mode costs part of the incremental savings.
+ * @param pipeline Pipeline to extend, after its source stage.
+ * @param params Threshold, morphology, region size and change detection settings, at full scale.
+ * @param sourcePolicy Policy of the queue between the source and this stage.
+ * @param scheduler Scheduler to report processing times to, or nullptr.
+ */
+void addIncrementalStages(Pipeline &pipeline, const IncrementalParams &params = IncrementalParams(), QueuePolicy sourcePolicy = QUEUE_BLOCK,
+                          FrameScheduler *scheduler = nullptr);
+
+/**
+ * @brief Adds the stages shared by the recognition tasks: capture, preprocess, segment/track and features.
+ * @details Capture hands frames to preprocessing through a drop-oldest queue,
+ * so it never waits and the camera buffer never backs up.
+ * @param pipeline Pipeline to extend.
+ * @param cap Open video source; must outlive the run.
+ * @param threshold Foreground threshold passed to preprocessFrame(), or AUTO_THRESHOLD.
+ * @param minRegionSize Smallest region kept by segmentObjects() at full scale.
+ * @param scheduler Scheduler that decides the work done on each frame, or nullptr for full quality; must outlive the run.
+ * @param incremental Recompute only what changed between frames, with addIncrementalStages().
+ */
+void addRecognitionStages(Pipeline &pipeline, cv::VideoCapture &cap, int threshold = 100, int minRegionSize = 500,
+                          FrameScheduler *scheduler = nullptr, bool incremental = false);
+
+#endif
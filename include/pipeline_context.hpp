@@ -0,0 +1,144 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file pipeline_context.hpp
+ * @brief Reusable buffers for the whole per-frame chain, so steady-state frames do not allocate.
+ */
+
+#ifndef PIPELINE_CONTEXT_HPP
+#define PIPELINE_CONTEXT_HPP
+
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include "filters.hpp"
+#include "bitmask.hpp"
+#include "run_labels.hpp"
+#include "tracker.hpp"
+
+/**
+ * @brief True when the build counts heap allocations (cmake -DCOUNT_ALLOCATIONS=ON).
+ */
+bool allocationCountingEnabled();
+
+/**
+ * @brief Heap allocations made so far by every thread, or 0 when counting is disabled.
+ * @details Counts calls to the global operator new, which is what std
+ * containers and FilterBuffers use. It does not see memory taken without
+ * operator new: cv::Mat and cv::AutoBuffer data, and the scratch of OpenCV
+ * functions, come from OpenCV's own allocator, and direct malloc() calls by
+ * OpenCV or the C library bypass it as well. A zero count is therefore only
+ * meaningful for code that calls no allocating OpenCV function per frame.
+ */
+uint64_t allocationCount();
+
+/**
+ * @brief Threshold, morphology, labeling, tracking and features of one stream of frames on preallocated buffers.
+ * @details Owns the FilterBuffers of the operators, the packed mask, the run
+ * labeling, the tracker, the segmented image, the region map and the feature
+ * table, and reuses all of them from frame to frame: once the frame size,
+ * the regions and the tracks settle, process() makes no heap allocation. Every
+ * Mat it owns is reused, and the only per-region geometry, the oriented box,
+ * comes from a hull kept in the labeling rather than from cv::minAreaRect, so
+ * OpenCV allocates nothing behind the counter either. allocation_check, built
+ * with -DCOUNT_ALLOCATIONS=ON, checks this on a replayed sequence. The
+ * operator methods are the functions of filters.hpp with the context's
+ * buffers passed in. A context is used by one thread at a time.
+ */
+class PipelineContext {
+public:
+    /**
+     * @param gateRadius Tracker gate, see RegionTracker.
+     * @param maxMissed Frames a track survives unmatched, see RegionTracker.
+     */
+    explicit PipelineContext(double gateRadius = 50, int maxMissed = 5);
+
+    PipelineContext(const PipelineContext &) = delete;
+    PipelineContext &operator=(const PipelineContext &) = delete;
+
+    /**
+     * @brief thresholding() into a caller's byte mask.
+     */
+    int thresholding(cv::Mat &src, cv::Mat &dst, int threshold);
+
+    /**
+     * @brief thresholding() into the context's packed mask.
+     */
+    int thresholding(cv::Mat &src, int threshold);
+
+    /**
+     * @brief erosion() of a byte mask.
+     */
+    int erosion(cv::Mat &src, cv::Mat &dst, int kernelSize, int connectedness);
+
+    /**
+     * @brief dilation() of a byte mask.
+     */
+    int dilation(cv::Mat &src, cv::Mat &dst, int kernelSize, int connectedness);
+
+    /**
+     * @brief Packed erosion() of the context's mask, in place.
+     */
+    int erosion(int kernelSize, int connectedness);
+
+    /**
+     * @brief Packed dilation() of the context's mask, in place.
+     */
+    int dilation(int kernelSize, int connectedness);
+
+    /**
+     * @brief preprocessFrame() into the context's packed mask.
+     * @return Returns 0 on success, -1 on failure.
+     */
+    int preprocessFrame(cv::Mat &src, int threshold, int dilateSize = 5, int dilateConnectedness = 8,
+                        int erodeSize = 5, int erodeConnectedness = 4);
+
+    /**
+     * @brief segmentObjects() of the context's mask into segmented() and regions(), tracked by tracker().
+     * @param minRegionSize Minimum size of a region to be considered an object.
+     * @return Returns 0.
+     */
+    int segmentObjects(int minRegionSize);
+
+    /**
+     * @brief Features of every region of regions(), from the labeling of the last segmentObjects().
+     * @return Returns features().
+     */
+    const std::vector<RegionFeatures> &computeAllFeatures();
+
+    /**
+     * @brief Runs the whole chain on a frame: preprocessFrame() with the default kernels, segmentObjects() and computeAllFeatures().
+     * @param frame Input BGR frame.
+     * @param threshold Foreground threshold.
+     * @param minRegionSize Minimum size of a region to be considered an object.
+     * @return Returns 0 on success, -1 if the frame cannot be thresholded.
+     */
+    int process(cv::Mat &frame, int threshold, int minRegionSize);
+
+    const BitMask &mask() const { return binary; } ///< Cleaned packed mask.
+    const RunLabeling &labeling() const { return runs; } ///< Runs and statistics of mask().
+    const cv::Mat &segmented() const { return colored; } ///< Regions colorized by track; overwritten by the next frame.
+    std::map<int, RegionInfo> &regions() { return regionMap; } ///< Regions of the last frame, by label.
+    std::vector<RegionFeatures> &features() { return featureTable; } ///< Features of regions(), in label order.
+    RegionTracker &tracker() { return regionTracker; } ///< Tracker carrying IDs across frames.
+    FilterBuffers &buffers() { return filterBuffers; } ///< Buffers passed to the operators.
+
+    /**
+     * @brief Heap allocations made during the last process(), by every thread; 0 unless counting is enabled.
+     */
+    uint64_t frameAllocations() const { return lastAllocations; }
+
+private:
+    FilterBuffers filterBuffers;
+    BitMaskScratch morphScratch;
+    BitMask binary;
+    RunLabeling runs;
+    RegionTracker regionTracker;
+    cv::Mat colored;
+    std::map<int, RegionInfo> regionMap;
+    std::vector<RegionFeatures> featureTable;
+    uint64_t lastAllocations = 0;
+};
+
+#endif
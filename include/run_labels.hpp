@@ -0,0 +1,151 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file run_labels.hpp
+ * @brief Connected component labeling on the row runs of a binary mask.
+ */
+
+#ifndef RUN_LABELS_HPP
+#define RUN_LABELS_HPP
+
+#include <opencv2/opencv.hpp>
+#include <climits>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include "bitmask.hpp"
+#include "filters.hpp"
+
+/**
+ * @brief Exact moment sums and bounding box of a set of pixel runs.
+ * @details Runs are added with closed-form power sums, so the sums are exact
+ * integers that do not depend on the order the runs come in (third-order sums
+ * stay within int64 for any region that fits in a 4K frame).
+ */
+struct RunMoments {
+    int64_t m00 = 0, m10 = 0, m01 = 0, m20 = 0, m11 = 0, m02 = 0; ///< Raw moments up to second order.
+    int64_t m30 = 0, m21 = 0, m12 = 0, m03 = 0; ///< Raw third-order moments.
+    int minX = INT_MAX, minY = INT_MAX, maxX = -1, maxY = -1; ///< Inclusive pixel bounds.
+
+    /**
+     * @brief Adds the pixels x0 <= x < x1 of row y.
+     */
+    void addRun(int y, int x0, int x1);
+
+    /**
+     * @brief Adds the sums of another set of runs.
+     */
+    void merge(const RunMoments &o);
+
+    int area() const { return (int)m00; } ///< Number of pixels.
+    cv::Rect box() const { return m00 ? cv::Rect(minX, minY, maxX - minX + 1, maxY - minY + 1) : cv::Rect(); } ///< Bounding box.
+    cv::Point2d centroid() const { return m00 ? cv::Point2d((double)m10 / m00, (double)m01 / m00) : cv::Point2d(); } ///< Mean pixel position.
+};
+
+/**
+ * @brief Fills the features of a region from its moment sums.
+ * @param sums Moment sums of the region.
+ * @param extents First and last pixel of every run of the region; their convex hull is the region's hull.
+ * @param f Features to fill; label is left as it is.
+ */
+void runFeatures(const RunMoments &sums, const std::vector<cv::Point> &extents, RegionFeatures &f);
+
+/**
+ * @brief runFeatures() with a caller's buffer for the hull.
+ * @details The oriented box is the minimum-area rectangle of the hull, found
+ * by rotating calipers, with its angle in [0, 90) degrees. Extents in raster
+ * order, as the labelings produce them, are used in place; with a hull
+ * buffer that has already grown to size, nothing is allocated.
+ * @param hull Scratch, overwritten with the convex hull of extents.
+ */
+void runFeatures(const RunMoments &sums, const std::vector<cv::Point> &extents, RegionFeatures &f,
+                 std::vector<cv::Point> &hull);
+
+/**
+ * @brief One horizontal run of foreground pixels.
+ */
+struct LabelRun {
+    int y;     ///< Row.
+    int x0;    ///< First pixel.
+    int x1;    ///< One past the last pixel.
+    int label; ///< Component the run belongs to.
+};
+
+/**
+ * @brief 8-connected component labeling that works on runs instead of pixels.
+ * @details compute() reads the mask once, cutting every row into runs of
+ * foreground pixels, and joins the runs that touch a run of the row above
+ * with union-find. Components are numbered in raster order of their first
+ * pixel, and their area, bounding box, centroid and moment sums come straight
+ * from the runs. Masks of large blobs have few runs per row, so this does far
+ * less work than labeling every pixel, and a label image is only written when
+ * labelImage() asks for one. Packed masks are scanned a word at a time.
+ * Buffers are kept between calls.
+ */
+class RunLabeling {
+public:
+    /**
+     * @brief Labels the foreground components of a mask.
+     * @param binary 8-bit single-channel mask; nonzero pixels are foreground.
+     * @return Returns the number of labels including the background, as
+     * cv::connectedComponents() does, or -1 if the mask is not 8-bit single-channel.
+     */
+    int compute(const cv::Mat &binary);
+
+    /**
+     * @brief Labels the foreground components of a packed mask.
+     * @param binary Mask; set pixels are foreground.
+     * @return Returns the number of labels including the background.
+     */
+    int compute(const BitMask &binary);
+
+    int count() const { return (int)regionStats.size(); } ///< Number of labels including the background.
+    cv::Size size() const { return imageSize; } ///< Size of the labeled mask.
+    const RunMoments &stats(int label) const { return regionStats[label]; } ///< Moment sums of a label; the background's are empty.
+    const std::vector<LabelRun> &runs() const { return runList; } ///< Foreground runs in raster order.
+
+    /**
+     * @brief Writes the label image.
+     * @param labels Output, CV_16U while every written label fits, CV_32S otherwise.
+     * @param remap Label to write for each label, 0 to leave it out; empty writes the labels as they are.
+     */
+    void labelImage(cv::Mat &labels, const std::vector<int> &remap = std::vector<int>()) const;
+
+    /**
+     * @brief Writes a BGR image with every label in its color.
+     * @param dst Output CV_8UC3 image.
+     * @param colors Color of each label; black labels are left out like the background.
+     */
+    void paint(cv::Mat &dst, const std::vector<cv::Vec3b> &colors) const;
+
+    /**
+     * @brief Computes the features of some regions from their runs.
+     * @param regions Regions to compute features for, keyed by label.
+     * @return Returns one entry per region, in the order of regions, as computeAllFeatures() does.
+     */
+    std::vector<RegionFeatures> features(const std::map<int, RegionInfo> &regions) const;
+
+    /**
+     * @brief Same as features(), filling a table the caller keeps.
+     * @details The table and the per-region point lists are reused, so this
+     * does not allocate once the region count and sizes settle.
+     * @param regions Regions to compute features for, keyed by label.
+     * @param table Output, one entry per region, in the order of regions.
+     */
+    void features(const std::map<int, RegionInfo> &regions, std::vector<RegionFeatures> &table);
+
+private:
+    int find(int run);
+    void joinRows(int prevBegin, int prevEnd, int begin, int end);
+    int numberComponents();
+
+    cv::Size imageSize;
+    std::vector<LabelRun> runList;
+    std::vector<int> parent; ///< Union-find forest over runList.
+    std::vector<RunMoments> regionStats; ///< Indexed by label.
+    std::vector<int> slotOf; ///< features() scratch: table entry of each label.
+    std::vector<std::vector<cv::Point>> extents; ///< features() scratch: run end points of each entry.
+    std::vector<cv::Point> hull; ///< features() scratch: convex hull of one entry.
+};
+
+#endif
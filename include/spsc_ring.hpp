@@ -0,0 +1,198 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file spsc_ring.hpp
+ * @brief Bounded single-producer/single-consumer ring buffer between pipeline stages.
+ */
+
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+/**
+ * @brief What a producer does when the ring is full.
+ */
+enum QueuePolicy {
+    QUEUE_BLOCK,      ///< Wait for the consumer to make room.
+    QUEUE_DROP_OLDEST ///< Discard the oldest queued item and never wait.
+};
+
+/**
+ * @brief Bounded ring buffer for exactly one producer thread and one consumer thread.
+ * @details Items are handed over through atomic head and tail counters
+ * without a lock. Each slot has a flag that is set while it holds an item, so
+ * the producer never overwrites a slot that is still being read. Under the
+ * drop-oldest policy the producer claims the oldest item by advancing the
+ * tail itself, and the consumer claims items the same way. A mutex and a
+ * condition variable are only used to sleep when the ring is empty, or full
+ * under the block policy, and only touched when a thread is actually waiting.
+ */
+template <typename T>
+class SpscRing {
+public:
+    /**
+     * @brief Creates an empty ring.
+     * @param capacity Maximum number of queued items, at least 1.
+     * @param policy What push() does when the ring is full.
+     */
+    explicit SpscRing(size_t capacity, QueuePolicy policy = QUEUE_BLOCK)
+        : cap(capacity > 0 ? capacity : 1), mode(policy), slots(new Slot[cap]) {}
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    /**
+     * @brief Queues an item. Called by the producer only.
+     * @param item Item to move into the ring.
+     * @return Returns false if the ring was closed, in which case the item is discarded.
+     */
+    bool push(T &&item)
+    {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        while (h - tail.load(std::memory_order_acquire) >= cap)
+        {
+            if (closed.load(std::memory_order_acquire))
+                return false;
+            if (mode == QUEUE_DROP_OLDEST)
+            {
+                T discarded;
+                if (claim(discarded))
+                    droppedCount.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                waitFor([&] { return h - tail.load(std::memory_order_acquire) < cap; });
+            }
+        }
+        if (closed.load(std::memory_order_acquire))
+            return false;
+
+        // The previous owner of this slot may still be moving its item out
+        Slot &s = slots[h % cap];
+        while (s.full.load(std::memory_order_acquire))
+            std::this_thread::yield();
+        s.value = std::move(item);
+        s.full.store(true, std::memory_order_release);
+        head.store(h + 1, std::memory_order_release);
+        notify();
+        return true;
+    }
+
+    /**
+     * @brief Takes the oldest item, waiting while the ring is empty. Called by the consumer only.
+     * @param item Output item.
+     * @return Returns false once the ring is closed and empty.
+     */
+    bool pop(T &item)
+    {
+        while (!tryPop(item))
+        {
+            if (closed.load(std::memory_order_acquire) && empty())
+                return false;
+            waitFor([&] { return !empty() || closed.load(std::memory_order_acquire); });
+        }
+        return true;
+    }
+
+    /**
+     * @brief Takes the oldest item if there is one, without waiting.
+     * @param item Output item.
+     * @return Returns true if an item was taken.
+     */
+    bool tryPop(T &item)
+    {
+        if (!claim(item))
+            return false;
+        notify();
+        return true;
+    }
+
+    /**
+     * @brief Wakes both sides; later pushes fail and pops fail once the ring is drained.
+     */
+    void close()
+    {
+        closed.store(true, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(mutex);
+        wake.notify_all();
+    }
+
+    bool isClosed() const { return closed.load(std::memory_order_acquire); } ///< True after close().
+    bool empty() const { return size() == 0; } ///< True when nothing is queued.
+    size_t capacity() const { return cap; } ///< Maximum number of queued items.
+    QueuePolicy policy() const { return mode; } ///< Policy when full.
+    uint64_t dropped() const { return droppedCount.load(std::memory_order_relaxed); } ///< Items discarded by drop-oldest.
+
+    /**
+     * @brief Number of queued items; exact only when both sides are idle.
+     */
+    size_t size() const
+    {
+        uint64_t t = tail.load(std::memory_order_acquire);
+        uint64_t h = head.load(std::memory_order_acquire);
+        return h > t ? (size_t)(h - t) : 0;
+    }
+
+private:
+    struct Slot {
+        T value;
+        std::atomic<bool> full{false};
+    };
+
+    // Moves the oldest item out, racing the other side for it by advancing the tail
+    bool claim(T &item)
+    {
+        uint64_t t = tail.load(std::memory_order_acquire);
+        while (t != head.load(std::memory_order_acquire))
+        {
+            if (tail.compare_exchange_weak(t, t + 1, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                Slot &s = slots[t % cap];
+                item = std::move(s.value);
+                s.value = T();
+                s.full.store(false, std::memory_order_release);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <typename Ready>
+    void waitFor(Ready ready)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        wake.wait(lock, [&] { return ready() || closed.load(std::memory_order_acquire); });
+        waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void notify()
+    {
+        // A read-modify-write orders the preceding head/tail store before the waiter count is read
+        if (waiters.fetch_add(0, std::memory_order_seq_cst) == 0)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        wake.notify_all();
+    }
+
+    const size_t cap;
+    const QueuePolicy mode;
+    std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> droppedCount{0};
+    std::atomic<bool> closed{false};
+    std::atomic<int> waiters{0};
+    std::mutex mutex;
+    std::condition_variable wake;
+};
+
+#endif
@@ -0,0 +1,134 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file stream_server.hpp
+ * @brief Recognition of many cameras and videos at once on one shared pool, database and model.
+ */
+
+#ifndef STREAM_SERVER_HPP
+#define STREAM_SERVER_HPP
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "pipeline.hpp"
+#include "metrics.hpp"
+#include "feature_db.hpp"
+#include "embedder.hpp"
+#include "work_stealing_pool.hpp"
+
+/**
+ * @brief Matches the regions of a frame against a feature database.
+ * @details Fills d.matchLabels and d.matchDistances with one entry per
+ * feature, empty and -1 where nothing matched. With a model, every region of
+ * the frame is embedded in one forward pass; otherwise the Hu moments are
+ * matched.
+ * @param d Frame with features to classify.
+ * @param db Database to match against; an empty one leaves every region unmatched.
+ * @param embedder Loaded model, or nullptr to match Hu moments.
+ * @param batch Batch the crops are resampled into.
+ * @param modelMutex Held around the forward pass when the model is shared, or nullptr.
+ * @return Returns 0 on success, -1 if the forward pass failed.
+ */
+int classifyRegions(FrameData &d, const FeatureDatabase &db, Embedder *embedder, EmbeddingBatch &batch, std::mutex *modelMutex = nullptr);
+
+/**
+ * @brief Settings shared by every stream of a StreamServer.
+ */
+struct StreamParams {
+    int threshold = 100;      ///< Foreground threshold passed to preprocessFrame(); AUTO_THRESHOLD follows each stream's lighting.
+    int minRegionSize = 500;  ///< Smallest region kept.
+    bool incremental = false; ///< Segment with an IncrementalSegmenter per stream.
+    int workers = 0;          ///< Pool threads; 0 uses all hardware threads.
+    bool pinThreads = false;  ///< Pin the pool threads to cores.
+    int queueFrames = 2;      ///< Frames read ahead per video or directory stream.
+    int traceEvery = 0;       ///< Frames between traced frames of each stream; 0 disables tracing.
+};
+
+/**
+ * @brief Called after each processed frame with the stream index and its results.
+ */
+typedef std::function<void(int, const FrameData &)> StreamCallback;
+
+/**
+ * @brief Runs recognition on many sources at once.
+ * @details Every source has a capture thread that only reads frames: cameras
+ * keep just the newest frame and count the rest as dropped, so a stream's
+ * latency stays one frame plus processing however loaded the box is, while
+ * videos and directories read a few frames ahead and are never dropped. The
+ * processing of a frame is one task on a shared WorkStealingPool, and each
+ * stream has at most one task queued or running, so its tracker needs no lock,
+ * its frames stay in order and no stream can crowd out the others. The
+ * feature database is shared read-only, and the model is shared with its
+ * forward pass serialized. The image operators run single-threaded inside each
+ * task, since the streams already keep every core busy. Each stream is a
+ * stage of metrics(), so its latency from capture to result and its drops are
+ * exported like a pipeline stage.
+ */
+class StreamServer {
+public:
+    /**
+     * @brief Creates a server without streams.
+     * @param params Settings for every stream.
+     * @param db Database to classify against, or nullptr to only segment and track.
+     * @param embedder Loaded model to classify with, or nullptr to match Hu moments.
+     */
+    explicit StreamServer(const StreamParams &params, const FeatureDatabase *db = nullptr, Embedder *embedder = nullptr);
+    ~StreamServer();
+
+    StreamServer(const StreamServer &) = delete;
+    StreamServer &operator=(const StreamServer &) = delete;
+
+    /**
+     * @brief Opens a source; see FrameSource::open(). Call before run().
+     * @return Returns the index of the new stream, or -1 if the source cannot be opened.
+     */
+    int addStream(const std::string &spec);
+
+    /**
+     * @brief Sets the function called after each frame. Calls for one stream never overlap.
+     */
+    void setCallback(StreamCallback callback) { onFrame = std::move(callback); }
+
+    /**
+     * @brief Processes every stream until all of them end or stop() is called.
+     */
+    void run();
+
+    /**
+     * @brief Makes run() return once the frames already read are processed. Safe from a signal handler.
+     */
+    void stop() { stopping.store(true); }
+
+    int streamCount() const { return (int)streams.size(); } ///< Number of streams.
+    const std::string &streamName(int stream) const; ///< Source spec of a stream.
+    uint64_t frames(int stream) const; ///< Frames processed by a stream.
+    uint64_t dropped(int stream) const; ///< Camera frames replaced by a newer one before processing.
+    int metricsStage(int stream) const; ///< Stage of metrics() that records a stream, named "<index>:<source>".
+    PipelineMetrics &metrics() { return recorder; } ///< Per-stream latency and drop metrics.
+    uint64_t steals() const { return pool ? pool->steals() : 0; } ///< Tasks the pool moved between workers.
+
+private:
+    struct Stream;
+
+    void capture(Stream &s);
+    void schedule(Stream &s);
+    void runFrame(Stream &s);
+    void process(Stream &s, FrameData &d);
+
+    StreamParams config;
+    const FeatureDatabase *db;
+    Embedder *embedder;
+    std::mutex modelMutex;
+    std::vector<std::unique_ptr<Stream>> streams;
+    std::unique_ptr<WorkStealingPool> pool;
+    PipelineMetrics recorder;
+    StreamCallback onFrame;
+    std::atomic<bool> stopping{false};
+};
+
+#endif
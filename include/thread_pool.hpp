@@ -0,0 +1,67 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file thread_pool.hpp
+ * @brief Reusable worker pool used to run image operators over row bands.
+ */
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Fixed set of worker threads that runs indexed tasks.
+ * @details The threads are started once and then reused for every call, so
+ * a frame costs no thread creation. The calling thread also takes tasks.
+ */
+class ThreadPool {
+public:
+    /**
+     * @brief Starts the workers.
+     * @param numThreads Total number of threads including the caller; 0 uses all hardware threads.
+     */
+    explicit ThreadPool(int numThreads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /**
+     * @brief Number of threads that run tasks, including the caller.
+     */
+    int size() const { return (int)workers.size() + 1; }
+
+    /**
+     * @brief Runs fn(i) for every i in [0, n) and returns when all of them have finished.
+     * @details Calls made from inside a task run serially on that thread. The first
+     * exception thrown by a task is rethrown here.
+     * @param n Number of tasks.
+     * @param fn Task body.
+     */
+    void parallelFor(int n, const std::function<void(int)> &fn);
+
+private:
+    void workerLoop();
+    void runTasks();
+
+    std::vector<std::thread> workers;
+    std::mutex callMutex;   ///< One parallelFor() at a time.
+    std::mutex mutex;       ///< Guards the job fields below.
+    std::condition_variable wake, done;
+    const std::function<void(int)> *job = nullptr;
+    int jobSize = 0;
+    std::atomic<int> nextIndex{0};
+    int active = 0;
+    unsigned long generation = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+};
+
+#endif
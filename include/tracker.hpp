@@ -0,0 +1,131 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file tracker.hpp
+ * @brief Region tracker that keeps persistent IDs for segmented objects across frames.
+ */
+
+#ifndef TRACKER_HPP
+#define TRACKER_HPP
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+/**
+ * @brief One tracked object.
+ */
+struct Track {
+    int id; ///< Persistent ID, never reused.
+    cv::Point2d centroid; ///< Centroid at the last frame it was seen.
+    cv::Vec3b color; ///< Display color, derived from the ID.
+    int missed; ///< Consecutive frames without a matching region.
+};
+
+/**
+ * @brief Uniform grid over points for fixed-radius neighbour queries.
+ * @details Points are bucketed by counting sort into one contiguous array, so a
+ * query only visits the cells that overlap its search radius.
+ */
+class UniformGrid {
+public:
+    /**
+     * @brief Buckets the points.
+     * @param points Points to index.
+     * @param cellSize Cell edge length, normally the query radius.
+     * @param bounds Area the points lie in; points outside it go to the edge cells.
+     */
+    void build(const std::vector<cv::Point2d> &points, double cellSize, cv::Size bounds);
+
+    /**
+     * @brief Appends the indices of all points closer than radius to p.
+     */
+    void query(const cv::Point2d &p, double radius, std::vector<int> &out) const;
+
+private:
+    int cellOf(double v, int n) const;
+
+    std::vector<cv::Point2d> pts;
+    std::vector<int> cellStart; ///< Offset of each cell in entries, plus an end marker.
+    std::vector<int> entries; ///< Point indices grouped by cell.
+    std::vector<int> cellIdx, fill; ///< Counting sort scratch, kept between builds.
+    double cell = 1;
+    int gridW = 0, gridH = 0;
+};
+
+/**
+ * @brief Matches regions to the tracks of previous frames and keeps stable IDs.
+ * @details Candidate pairs come from a uniform grid over track centroids within the
+ * gate radius. Each connected group of candidates is solved as a globally optimal
+ * one-to-one assignment that minimizes total centroid distance. Leaving a region
+ * unmatched costs the gate radius. Tracks live in one contiguous array.
+ */
+class RegionTracker {
+public:
+    /**
+     * @param gateRadius Maximum centroid distance for a region to continue a track.
+     * @param maxMissed Frames a track survives without a match before it is dropped.
+     */
+    explicit RegionTracker(double gateRadius = 50, int maxMissed = 5);
+
+    /**
+     * @brief Assigns this frame's regions to tracks, starting new tracks as needed.
+     * @param centroids Centroids of this frame's regions.
+     * @param frameSize Size of the frame the centroids come from.
+     * @return Returns, for each centroid, the index of its track in tracks().
+     */
+    std::vector<int> update(const std::vector<cv::Point2d> &centroids, cv::Size frameSize);
+
+    /**
+     * @brief Same as update(), writing into a vector the caller keeps.
+     * @details Working memory is kept in the tracker, so once frames stop
+     * growing in regions and tracks, an update does not allocate.
+     * @param centroids Centroids of this frame's regions.
+     * @param frameSize Size of the frame the centroids come from.
+     * @param trackIndex Output index of each centroid's track in tracks().
+     */
+    void update(const std::vector<cv::Point2d> &centroids, cv::Size frameSize, std::vector<int> &trackIndex);
+
+    /**
+     * @brief All live tracks. Indices are valid until the next update().
+     */
+    const std::vector<Track> &tracks() const { return trackList; }
+
+    /**
+     * @brief Forgets every track.
+     */
+    void reset();
+
+    /**
+     * @brief Moves every track and scales the gate to a frame resized by a factor, so tracks survive a change of processing scale.
+     * @param factor New frame size divided by the old one.
+     */
+    void rescale(double factor);
+
+    /**
+     * @brief Deterministic display color for a track ID.
+     */
+    static cv::Vec3b colorForId(int id);
+
+private:
+    void solveAssignment(int n, int m);
+
+    double gate;
+    int maxMissed;
+    int nextId = 0;
+    std::vector<Track> trackList;
+    UniformGrid grid;
+
+    // Working memory of update(); cleared, never freed
+    std::vector<Track> nextList;
+    std::vector<cv::Point2d> trackPts;
+    std::vector<int> candidateStart, candidates; ///< Candidate tracks of each detection, by offset.
+    std::vector<int> groupDetStart, groupDets, groupTrackStart, groupTracks; ///< Members of each group, by root.
+    std::vector<int> groupKeys, groupFill; ///< Counting sort scratch.
+    std::vector<int> parent, assigned, newIndex;
+    std::vector<char> matched;
+    std::vector<double> cost, u, v, minv;
+    std::vector<int> p, way, rowToCol;
+    std::vector<char> used;
+};
+
+#endif
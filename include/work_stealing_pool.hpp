@@ -0,0 +1,83 @@
+/**
+ * Ronak Bhanushali and Ruohe Zhou
+ * Spring 2024
+ * @file work_stealing_pool.hpp
+ * @brief Task pool with one queue per worker and stealing between them.
+ */
+
+#ifndef WORK_STEALING_POOL_HPP
+#define WORK_STEALING_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Runs independent tasks on a fixed set of workers, each with its own queue.
+ * @details A task submitted from a worker goes to that worker's queue, so
+ * work that resubmits itself stays on the core whose caches hold its state;
+ * tasks from other threads are dealt round-robin. Workers take the oldest
+ * task of their own queue, so the tasks sharing a worker take turns, and a
+ * worker whose queue is empty steals the newest task of the first busy queue
+ * it finds, which evens out the load without a shared queue to contend on.
+ * Unlike ThreadPool, the caller does not wait for a batch of tasks.
+ */
+class WorkStealingPool {
+public:
+    /**
+     * @brief Starts the workers.
+     * @param numThreads Number of workers; 0 uses all hardware threads.
+     * @param pinThreads Pin worker i to core i modulo the number of cores (Linux only).
+     */
+    explicit WorkStealingPool(int numThreads = 0, bool pinThreads = false);
+
+    /**
+     * @brief Runs the queued tasks to completion and stops the workers.
+     */
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    /**
+     * @brief Queues a task. Exceptions thrown by tasks are printed and dropped.
+     */
+    void submit(std::function<void()> task);
+
+    /**
+     * @brief Waits until every submitted task, and every task they submitted, has finished.
+     */
+    void wait();
+
+    int size() const { return (int)workers.size(); } ///< Number of workers.
+    bool pinned() const { return pinnedThreads; } ///< True if every worker was pinned to a core.
+    uint64_t steals() const { return stealCount.load(std::memory_order_relaxed); } ///< Tasks taken from another worker's queue.
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        std::thread thread;
+    };
+
+    void workerLoop(int index);
+    bool take(int index, std::function<void()> &task);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<unsigned> nextWorker{0};
+    std::atomic<int> queued{0};   ///< Tasks sitting in a queue.
+    std::atomic<int> unfinished{0}; ///< Tasks submitted and not yet finished.
+    std::atomic<uint64_t> stealCount{0};
+    bool pinnedThreads = false;
+    bool stopping = false;
+    std::mutex sleepMutex;
+    std::condition_variable wake, idle;
+};
+
+#endif
@@ -0,0 +1,449 @@
+/**
+ * @file incremental.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Change-driven segmentation over a tile grid
+ * @date 2024-02-26
+ *
+ */
+
+#include "incremental.hpp"
+#include "run_labels.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Number of the n bytes of a and b that differ by more than delta
+static int countChanged(const uchar *a, const uchar *b, int n, int delta)
+{
+    int count = 0;
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i limit = _mm_set1_epi8((char)delta);
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= n; x += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        // Zero wherever the difference is within the limit
+        int within = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(diff, limit), zero));
+        count += 16 - __builtin_popcount(within);
+    }
+#endif
+    for (; x < n; x++)
+        count += std::abs(a[x] - b[x]) > delta;
+    return count;
+}
+
+// Raw moments of a region moved by (dx, dy); the central and normalized ones do not change
+static void translateFeatures(RegionFeatures &f, cv::Point offset)
+{
+    const cv::Moments &m = f.moments;
+    double dx = offset.x, dy = offset.y;
+    cv::Moments t(m.m00,
+                  m.m10 + dx * m.m00,
+                  m.m01 + dy * m.m00,
+                  m.m20 + 2 * dx * m.m10 + dx * dx * m.m00,
+                  m.m11 + dx * m.m01 + dy * m.m10 + dx * dy * m.m00,
+                  m.m02 + 2 * dy * m.m01 + dy * dy * m.m00,
+                  m.m30 + 3 * dx * m.m20 + 3 * dx * dx * m.m10 + dx * dx * dx * m.m00,
+                  m.m21 + dy * m.m20 + 2 * dx * m.m11 + 2 * dx * dy * m.m10 + dx * dx * m.m01 + dx * dx * dy * m.m00,
+                  m.m12 + dx * m.m02 + 2 * dy * m.m11 + 2 * dx * dy * m.m01 + dy * dy * m.m10 + dx * dy * dy * m.m00,
+                  m.m03 + 3 * dy * m.m02 + 3 * dy * dy * m.m01 + dy * dy * dy * m.m00);
+
+    // Keep the central moments computed near the origin, which lose less to cancellation
+    t.mu20 = m.mu20; t.mu11 = m.mu11; t.mu02 = m.mu02;
+    t.mu30 = m.mu30; t.mu21 = m.mu21; t.mu12 = m.mu12; t.mu03 = m.mu03;
+    t.nu20 = m.nu20; t.nu11 = m.nu11; t.nu02 = m.nu02;
+    t.nu30 = m.nu30; t.nu21 = m.nu21; t.nu12 = m.nu12; t.nu03 = m.nu03;
+    f.moments = t;
+
+    f.centroid = cv::Point2d(f.centroid.x + dx, f.centroid.y + dy);
+    f.boundingBox = cv::Rect(f.boundingBox.x + offset.x, f.boundingBox.y + offset.y, f.boundingBox.width, f.boundingBox.height);
+    f.orientedBox = cv::RotatedRect(cv::Point2f(f.orientedBox.center.x + (float)dx, f.orientedBox.center.y + (float)dy),
+                                    cv::Size2f(f.orientedBox.size.width, f.orientedBox.size.height), f.orientedBox.angle);
+}
+
+// Grows r by m pixels on every side and clips it to bounds
+static cv::Rect expand(const cv::Rect &r, int m, const cv::Rect &bounds)
+{
+    return cv::Rect(r.x - m, r.y - m, r.width + 2 * m, r.height + 2 * m) & bounds;
+}
+
+IncrementalSegmenter::IncrementalSegmenter(const IncrementalParams &params)
+    : config(params)
+{
+    config.tileSize = std::max(config.tileSize, 8);
+    config.pixelDelta = std::min(std::max(config.pixelDelta, 0), 255);
+    config.minChangedSamples = std::max(config.minChangedSamples, 1);
+}
+
+void IncrementalSegmenter::reset()
+{
+    reference.release();
+}
+
+void IncrementalSegmenter::setThreshold(int threshold)
+{
+    // Every tile thresholded with the old value is stale
+    if (threshold != config.threshold)
+    {
+        config.threshold = threshold;
+        reset();
+    }
+}
+
+// Rows and columns a change can reach through the blur and both kernels
+int IncrementalSegmenter::halo() const
+{
+    return 2 + std::max(config.dilateSize / 2, 0) + std::max(config.erodeSize / 2, 0);
+}
+
+int IncrementalSegmenter::process(const cv::Mat &frame, RegionTracker &tracker)
+{
+    int channels = frame.channels();
+    if (frame.depth() != CV_8U || (channels != 1 && channels != 3 && channels != 4))
+    {
+        std::cout << "Incremental segmentation expects an 8-bit BGR image" << std::endl;
+        return -1;
+    }
+
+    int ts = config.tileSize;
+    int tilesX = (frame.cols + ts - 1) / ts, tilesY = (frame.rows + ts - 1) / ts;
+    stats = IncrementalStats();
+    stats.tiles = tilesX * tilesY;
+
+    std::vector<uchar> dirty(stats.tiles, 1);
+    bool full = reference.empty() || reference.size() != frame.size() || reference.type() != frame.type();
+    if (!full)
+    {
+        findDirtyTiles(frame, dirty);
+        stats.dirtyTiles = (int)std::count(dirty.begin(), dirty.end(), 1);
+        full = stats.dirtyTiles > config.fullRecomputeRatio * stats.tiles ||
+               (config.refreshFrames > 0 && framesSinceFull + 1 >= config.refreshFrames);
+    }
+    framesSinceFull = full ? 0 : framesSinceFull + 1;
+
+    std::vector<cv::Rect> areas;
+    if (full)
+    {
+        stats.full = true;
+        stats.dirtyTiles = stats.tiles;
+        frame.copyTo(reference);
+        cv::Mat in = frame;
+        if (preprocessFrame(in, binaryImage, config.threshold, config.dilateSize, config.dilateConnectedness,
+                            config.erodeSize, config.erodeConnectedness) != 0)
+            return -1;
+        labelImage = cv::Mat::zeros(frame.size(), CV_32S);
+        colorImage = cv::Mat::zeros(frame.size(), CV_8UC3);
+        components.assign(1, Component());
+        freeLabels.clear();
+        areas.push_back(cv::Rect(0, 0, frame.cols, frame.rows));
+    }
+    else if (stats.dirtyTiles > 0)
+    {
+        // One pixel more, so components 8-connected to a changed pixel are found too
+        std::vector<cv::Rect> changed;
+        updateBinary(frame, dirty, changed);
+        for (const cv::Rect &r : changed)
+            areas.push_back(expand(r, 1, cv::Rect(0, 0, frame.cols, frame.rows)));
+        mergeAreas(areas);
+    }
+
+    std::vector<int> oldLabels;
+    for (const cv::Rect &area : areas)
+    {
+        growToComponents(area, oldLabels);
+        relabel(area, oldLabels);
+        stats.relabeled |= area;
+    }
+    track(tracker, areas);
+    return 0;
+}
+
+void IncrementalSegmenter::mergeAreas(std::vector<cv::Rect> &areas) const
+{
+    // Areas that overlap after growing may share a component, so they are labeled as one.
+    // Disjoint areas cannot: a foreground pixel next to a changed one lies in the same area.
+    std::vector<int> ignored;
+    bool merged = true;
+    while (merged)
+    {
+        merged = false;
+        for (cv::Rect &area : areas)
+            area = growToComponents(area, ignored);
+        for (size_t i = 0; i < areas.size() && !merged; i++)
+        {
+            for (size_t j = i + 1; j < areas.size(); j++)
+            {
+                if (!(areas[i] & areas[j]).empty())
+                {
+                    areas[i] |= areas[j];
+                    areas.erase(areas.begin() + j);
+                    merged = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void IncrementalSegmenter::findDirtyTiles(const cv::Mat &frame, std::vector<uchar> &dirty)
+{
+    int ts = config.tileSize;
+    int channels = frame.channels();
+    int tilesX = (frame.cols + ts - 1) / ts;
+    std::vector<int> changed(tilesX);
+    for (int ty = 0; ty * ts < frame.rows; ty++)
+    {
+        std::fill(changed.begin(), changed.end(), 0);
+        int y1 = std::min((ty + 1) * ts, frame.rows);
+        for (int y = ty * ts; y < y1; y++)
+        {
+            const uchar *a = frame.ptr<uchar>(y);
+            const uchar *b = reference.ptr<uchar>(y);
+            for (int tx = 0; tx < tilesX; tx++)
+            {
+                // A tile is settled as soon as it has enough changes
+                if (changed[tx] >= config.minChangedSamples)
+                    continue;
+                int x0 = tx * ts * channels, x1 = std::min((tx + 1) * ts, frame.cols) * channels;
+                changed[tx] += countChanged(a + x0, b + x0, x1 - x0, config.pixelDelta);
+            }
+        }
+        for (int tx = 0; tx < tilesX; tx++)
+            dirty[ty * tilesX + tx] = changed[tx] >= config.minChangedSamples;
+    }
+}
+
+void IncrementalSegmenter::updateBinary(const cv::Mat &frame, const std::vector<uchar> &dirty, std::vector<cv::Rect> &changed)
+{
+    int ts = config.tileSize;
+    int tilesX = (frame.cols + ts - 1) / ts, tilesY = (frame.rows + ts - 1) / ts;
+    cv::Rect bounds(0, 0, frame.cols, frame.rows);
+    int h = halo();
+
+    // Horizontal runs of dirty tiles, extended downwards while the next tile row has the same run
+    struct Run { int tx0, tx1, ty0, ty1; };
+    std::vector<Run> runs, open, next;
+    for (int ty = 0; ty <= tilesY; ty++)
+    {
+        next.clear();
+        for (int tx = 0; ty < tilesY && tx < tilesX; tx++)
+        {
+            if (!dirty[ty * tilesX + tx])
+                continue;
+            int tx0 = tx;
+            while (tx < tilesX && dirty[ty * tilesX + tx])
+                tx++;
+            next.push_back({tx0, tx, ty, ty + 1});
+        }
+        for (Run &o : open)
+        {
+            auto same = std::find_if(next.begin(), next.end(), [&](const Run &r) { return r.tx0 == o.tx0 && r.tx1 == o.tx1; });
+            if (same != next.end())
+                same->ty0 = o.ty0;
+            else
+                runs.push_back(o);
+        }
+        open.swap(next);
+    }
+
+    cv::Mat out;
+    for (const Run &r : runs)
+    {
+        // Thresholding and morphology over the tiles plus twice the reach: the inner
+        // reach is every output pixel the tiles affect, the outer one what they read
+        cv::Rect tiles = cv::Rect(r.tx0 * ts, r.ty0 * ts, (r.tx1 - r.tx0) * ts, (r.ty1 - r.ty0) * ts) & bounds;
+        cv::Rect affected = expand(tiles, h, bounds);
+        cv::Rect read = expand(affected, h, bounds);
+        cv::Mat in = frame(read);
+        preprocessFrame(in, out, config.threshold, config.dilateSize, config.dilateConnectedness,
+                        config.erodeSize, config.erodeConnectedness);
+
+        int minX = INT_MAX, minY = INT_MAX, maxX = -1, maxY = -1;
+        int ox = affected.x - read.x, oy = affected.y - read.y;
+        for (int y = 0; y < affected.height; y++)
+        {
+            const uchar *src = out.ptr<uchar>(oy + y) + ox;
+            uchar *dst = binaryImage.ptr<uchar>(affected.y + y) + affected.x;
+            int first = -1, last = -1;
+            for (int x = 0; x < affected.width; x++)
+            {
+                if (src[x] != dst[x])
+                {
+                    if (first < 0)
+                        first = x;
+                    last = x;
+                }
+            }
+            if (first < 0)
+                continue;
+            std::copy(src + first, src + last + 1, dst + first);
+            minX = std::min(minX, affected.x + first);
+            maxX = std::max(maxX, affected.x + last);
+            minY = std::min(minY, affected.y + y);
+            maxY = std::max(maxY, affected.y + y);
+        }
+        cv::Mat settled = reference(tiles);
+        frame(tiles).copyTo(settled);
+        if (maxX >= 0)
+            changed.push_back(cv::Rect(minX, minY, maxX - minX + 1, maxY - minY + 1));
+    }
+}
+
+cv::Rect IncrementalSegmenter::growToComponents(cv::Rect area, std::vector<int> &oldLabels) const
+{
+    // Grow until every old component with a pixel inside lies entirely inside
+    std::vector<uchar> seen(components.size(), 0);
+    oldLabels.clear();
+    while (true)
+    {
+        cv::Rect grown = area;
+        for (int y = area.y; y < area.y + area.height; y++)
+        {
+            const int *row = labelImage.ptr<int>(y);
+            for (int x = area.x; x < area.x + area.width; x++)
+            {
+                int l = row[x];
+                if (l <= 0 || seen[l])
+                    continue;
+                seen[l] = 1;
+                oldLabels.push_back(l);
+                grown |= components[l].box;
+            }
+        }
+        if (grown == area)
+            return area;
+        area = grown;
+    }
+}
+
+int IncrementalSegmenter::newLabel()
+{
+    if (!freeLabels.empty())
+    {
+        int l = freeLabels.back();
+        freeLabels.pop_back();
+        return l;
+    }
+    components.push_back(Component());
+    return (int)components.size() - 1;
+}
+
+void IncrementalSegmenter::relabel(const cv::Rect &area, const std::vector<int> &oldLabels)
+{
+    for (int l : oldLabels)
+    {
+        components[l].alive = false;
+        freeLabels.push_back(l);
+    }
+
+    RunLabeling local;
+    int n = local.compute(binaryImage(area));
+
+    // Local component -> global label, and the regions large enough to keep
+    std::vector<int> global(n, 0);
+    std::map<int, RegionInfo> fresh;
+    for (int i = 1; i < n; i++)
+    {
+        int l = newLabel();
+        global[i] = l;
+        const RunMoments &region = local.stats(i);
+        Component &c = components[l];
+        c = Component();
+        c.alive = true;
+        c.fresh = true;
+        c.area = region.area();
+        cv::Rect box = region.box();
+        cv::Point2d centroid = region.centroid();
+        c.box = cv::Rect(box.x + area.x, box.y + area.y, box.width, box.height);
+        c.centroid = cv::Point2d(centroid.x + area.x, centroid.y + area.y);
+        if (c.area > config.minRegionSize)
+            fresh[i] = {centroid, cv::Vec3b(), -1};
+    }
+
+    // The area holds no other labels, so clear it and write the runs back
+    labelImage(area).setTo(cv::Scalar(0));
+    for (const LabelRun &run : local.runs())
+    {
+        int *row = labelImage.ptr<int>(area.y + run.y) + area.x;
+        std::fill(row + run.x0, row + run.x1, global[run.label]);
+    }
+
+    // Only the new regions need their features computed, straight from the runs
+    std::vector<RegionFeatures> computed = local.features(fresh);
+    for (RegionFeatures &f : computed)
+    {
+        translateFeatures(f, area.tl());
+        f.label = global[f.label];
+        components[f.label].features = f;
+        components[f.label].hasFeatures = true;
+    }
+}
+
+void IncrementalSegmenter::track(RegionTracker &tracker, const std::vector<cv::Rect> &areas)
+{
+    std::vector<int> keptLabels;
+    std::vector<cv::Point2d> keptCentroids;
+    for (size_t l = 1; l < components.size(); l++)
+    {
+        if (components[l].alive && components[l].area > config.minRegionSize)
+        {
+            keptLabels.push_back((int)l);
+            keptCentroids.push_back(components[l].centroid);
+        }
+    }
+    std::vector<int> trackIndex = tracker.update(keptCentroids, labelImage.size());
+
+    regionMap.clear();
+    featureList.clear();
+    for (size_t k = 0; k < keptLabels.size(); k++)
+    {
+        int l = keptLabels[k];
+        Component &c = components[l];
+        const Track &t = tracker.tracks()[trackIndex[k]];
+        regionMap[l] = {c.centroid, t.color, t.id};
+        featureList.push_back(c.features);
+
+        bool reused = !c.fresh;
+        c.fresh = false;
+        if (reused)
+            stats.reusedRegions++;
+
+        // Regions outside the relabeled area are only repainted if their track color changed
+        if (reused && c.color != t.color)
+        {
+            for (int y = c.box.y; y < c.box.y + c.box.height; y++)
+            {
+                const int *row = labelImage.ptr<int>(y);
+                cv::Vec3b *px = colorImage.ptr<cv::Vec3b>(y);
+                for (int x = c.box.x; x < c.box.x + c.box.width; x++)
+                    if (row[x] == l)
+                        px[x] = t.color;
+            }
+        }
+        c.color = t.color;
+    }
+
+    // Everything inside the areas was relabeled, so repaint them from the new labels
+    if (areas.empty())
+        return;
+    std::vector<cv::Vec3b> lut(components.size(), cv::Vec3b(0, 0, 0));
+    for (const auto &reg : regionMap)
+        lut[reg.first] = reg.second.color;
+    for (const cv::Rect &area : areas)
+    {
+        for (int y = area.y; y < area.y + area.height; y++)
+        {
+            const int *row = labelImage.ptr<int>(y);
+            cv::Vec3b *px = colorImage.ptr<cv::Vec3b>(y);
+            for (int x = area.x; x < area.x + area.width; x++)
+                px[x] = lut[row[x]];
+        }
+    }
+}
@@ -0,0 +1,305 @@
+/**
+ * @file metrics.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Pipeline latency histograms and their Prometheus and Chrome trace export
+ * @date 2024-02-26
+ *
+ */
+
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+
+LatencyHistogram::LatencyHistogram()
+{
+    for (int i = 0; i < BUCKETS; i++)
+        counts[i].store(0, std::memory_order_relaxed);
+}
+
+// Values below 2 * SUB_BUCKETS get a bucket each; above that every power of two 2^m
+// is split into SUB_BUCKETS buckets of width 2^(m - 4)
+int LatencyHistogram::bucketIndex(uint64_t ns)
+{
+    if (ns < 2 * SUB_BUCKETS)
+        return (int)ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int e = msb - 4;
+    return (e + 1) * SUB_BUCKETS + (int)((ns >> e) - SUB_BUCKETS);
+}
+
+uint64_t LatencyHistogram::bucketLow(int index)
+{
+    if (index < 2 * SUB_BUCKETS)
+        return (uint64_t)index;
+    int e = index / SUB_BUCKETS - 1;
+    return (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << e;
+}
+
+uint64_t LatencyHistogram::bucketHigh(int index)
+{
+    if (index < 2 * SUB_BUCKETS)
+        return (uint64_t)index;
+    int e = index / SUB_BUCKETS - 1;
+    return bucketLow(index) + ((uint64_t)1 << e) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns)
+{
+    counts[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sumNs.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t seen = maxNs.load(std::memory_order_relaxed);
+    while (ns > seen && !maxNs.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+    {
+    }
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+    uint64_t n = count();
+    if (n == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * n + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return std::min(bucketHigh(i), max());
+    }
+    return max();
+}
+
+uint64_t LatencyHistogram::countAtOrBelow(uint64_t ns) const
+{
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS && bucketHigh(i) <= ns; i++)
+        seen += counts[i].load(std::memory_order_relaxed);
+    return seen;
+}
+
+PipelineMetrics::PipelineMetrics(int traceEvery, size_t maxTraceEvents)
+    : origin(Clock::now()), traceEvery(traceEvery), maxEvents(maxTraceEvents > 0 ? maxTraceEvents : 1)
+{
+}
+
+PipelineMetrics::~PipelineMetrics()
+{
+    stopExport();
+}
+
+int PipelineMetrics::addStage(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(stageMutex);
+    for (size_t i = 0; i < stages.size(); i++)
+        if (stages[i]->name == name)
+            return (int)i;
+    std::unique_ptr<StageMetrics> stage(new StageMetrics());
+    stage->name = name;
+    stages.push_back(std::move(stage));
+    return (int)stages.size() - 1;
+}
+
+void PipelineMetrics::recordStage(int stage, uint64_t frame, Clock::time_point start, Clock::time_point end)
+{
+    StageMetrics &s = *stages[stage];
+    s.latency.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    s.frames.fetch_add(1, std::memory_order_relaxed);
+    if (traced(frame))
+        addTraceEvent(stage, frame, start, end);
+}
+
+void PipelineMetrics::addTraceEvent(int stage, uint64_t frame, Clock::time_point start, Clock::time_point end)
+{
+    TraceEvent event;
+    event.stage = stage;
+    event.frame = frame;
+    event.startUs = std::chrono::duration_cast<std::chrono::microseconds>(start - origin).count();
+    event.durationUs = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    std::lock_guard<std::mutex> lock(traceMutex);
+    if (events.size() < maxEvents)
+        events.push_back(event);
+    else
+        events[nextEvent % maxEvents] = event;
+    nextEvent++;
+}
+
+void PipelineMetrics::recordDrops(int stage, uint64_t n)
+{
+    stages[stage]->dropped.fetch_add(n, std::memory_order_relaxed);
+}
+
+void PipelineMetrics::recordFrame(uint64_t frame, Clock::time_point captured, size_t regions)
+{
+    Clock::time_point now = Clock::now();
+    endToEnd.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now - captured).count());
+    if (traced(frame))
+        addTraceEvent(-1, frame, captured, now);
+    frames.fetch_add(1, std::memory_order_relaxed);
+    regionsTotal.fetch_add(regions, std::memory_order_relaxed);
+    lastRegions.store(regions, std::memory_order_relaxed);
+}
+
+// Writes to a temporary file and renames it over the target, so readers never see a partial file
+static FILE *openTemp(const std::string &filename)
+{
+    FILE *fp = fopen((filename + ".tmp").c_str(), "w");
+    if (!fp)
+        std::cerr << "Unable to open " << filename << ".tmp" << std::endl;
+    return fp;
+}
+
+static int commitTemp(FILE *fp, const std::string &filename)
+{
+    bool ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || std::rename((filename + ".tmp").c_str(), filename.c_str()) != 0)
+    {
+        std::cerr << "Unable to write " << filename << std::endl;
+        return (-1);
+    }
+    return (0);
+}
+
+// Bucket bounds of the exported histograms, in seconds
+static const double PROMETHEUS_BOUNDS[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                           0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5};
+
+static void writeHistogram(FILE *fp, const char *name, const std::string &labels, const LatencyHistogram &h)
+{
+    std::string sep = labels.empty() ? "" : ",";
+    for (double bound : PROMETHEUS_BOUNDS)
+        fprintf(fp, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels.c_str(), sep.c_str(), bound,
+                (unsigned long long)h.countAtOrBelow((uint64_t)(bound * 1e9)));
+    fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels.c_str(), sep.c_str(), (unsigned long long)h.count());
+    fprintf(fp, "%s_sum{%s} %.9f\n", name, labels.c_str(), h.sum() * 1e-9);
+    fprintf(fp, "%s_count{%s} %llu\n", name, labels.c_str(), (unsigned long long)h.count());
+}
+
+static void writeQuantiles(FILE *fp, const char *name, const std::string &labels, const LatencyHistogram &h)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    std::string sep = labels.empty() ? "" : ",";
+    for (double q : quantiles)
+        fprintf(fp, "%s{%s%squantile=\"%g\"} %.9f\n", name, labels.c_str(), sep.c_str(), q, h.percentile(q * 100) * 1e-9);
+    fprintf(fp, "%s{%s%squantile=\"1\"} %.9f\n", name, labels.c_str(), sep.c_str(), h.max() * 1e-9);
+}
+
+int PipelineMetrics::writePrometheus(const std::string &filename) const
+{
+    std::lock_guard<std::mutex> lock(stageMutex);
+    FILE *fp = openTemp(filename);
+    if (!fp)
+        return (-1);
+
+    fprintf(fp, "# HELP pipeline_frames_total Frames that left the last stage.\n");
+    fprintf(fp, "# TYPE pipeline_frames_total counter\n");
+    fprintf(fp, "pipeline_frames_total %llu\n", (unsigned long long)frames.load());
+    fprintf(fp, "# HELP pipeline_regions_total Regions found over all frames.\n");
+    fprintf(fp, "# TYPE pipeline_regions_total counter\n");
+    fprintf(fp, "pipeline_regions_total %llu\n", (unsigned long long)regionsTotal.load());
+    fprintf(fp, "# HELP pipeline_regions Regions found in the latest frame.\n");
+    fprintf(fp, "# TYPE pipeline_regions gauge\n");
+    fprintf(fp, "pipeline_regions %llu\n", (unsigned long long)lastRegions.load());
+
+    fprintf(fp, "# HELP pipeline_frame_latency_seconds Time from capture until a frame leaves the last stage.\n");
+    fprintf(fp, "# TYPE pipeline_frame_latency_seconds histogram\n");
+    writeHistogram(fp, "pipeline_frame_latency_seconds", "", endToEnd);
+    fprintf(fp, "# HELP pipeline_frame_latency_quantile_seconds Frame latency percentiles, within 6%%.\n");
+    fprintf(fp, "# TYPE pipeline_frame_latency_quantile_seconds gauge\n");
+    writeQuantiles(fp, "pipeline_frame_latency_quantile_seconds", "", endToEnd);
+
+    fprintf(fp, "# HELP pipeline_stage_frames_total Frames processed by each stage.\n");
+    fprintf(fp, "# TYPE pipeline_stage_frames_total counter\n");
+    for (const auto &s : stages)
+        fprintf(fp, "pipeline_stage_frames_total{stage=\"%s\"} %llu\n", s->name.c_str(), (unsigned long long)s->frames.load());
+    fprintf(fp, "# HELP pipeline_stage_dropped_frames_total Frames dropped from the queue feeding each stage.\n");
+    fprintf(fp, "# TYPE pipeline_stage_dropped_frames_total counter\n");
+    for (const auto &s : stages)
+        fprintf(fp, "pipeline_stage_dropped_frames_total{stage=\"%s\"} %llu\n", s->name.c_str(), (unsigned long long)s->dropped.load());
+
+    fprintf(fp, "# HELP pipeline_stage_latency_seconds Time spent in each stage call.\n");
+    fprintf(fp, "# TYPE pipeline_stage_latency_seconds histogram\n");
+    for (const auto &s : stages)
+        writeHistogram(fp, "pipeline_stage_latency_seconds", "stage=\"" + s->name + "\"", s->latency);
+    fprintf(fp, "# HELP pipeline_stage_latency_quantile_seconds Stage latency percentiles, within 6%%.\n");
+    fprintf(fp, "# TYPE pipeline_stage_latency_quantile_seconds gauge\n");
+    for (const auto &s : stages)
+        writeQuantiles(fp, "pipeline_stage_latency_quantile_seconds", "stage=\"" + s->name + "\"", s->latency);
+
+    return commitTemp(fp, filename);
+}
+
+int PipelineMetrics::writeChromeTrace(const std::string &filename) const
+{
+    std::vector<TraceEvent> snapshot;
+    {
+        // Oldest first once the buffer has wrapped
+        std::lock_guard<std::mutex> lock(traceMutex);
+        size_t start = events.size() < maxEvents ? 0 : nextEvent % maxEvents;
+        for (size_t i = 0; i < events.size(); i++)
+            snapshot.push_back(events[(start + i) % events.size()]);
+    }
+
+    std::lock_guard<std::mutex> lock(stageMutex);
+    FILE *fp = openTemp(filename);
+    if (!fp)
+        return (-1);
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"pipeline\"}}");
+    for (size_t i = 0; i < stages.size(); i++)
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}", i, stages[i]->name.c_str());
+    fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"frames\"}}", stages.size());
+
+    // Whole-frame spans go on a row of their own below the stages
+    for (const TraceEvent &e : snapshot)
+    {
+        bool whole = e.stage < 0;
+        fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%lld,\"dur\":%lld,\"args\":{\"frame\":%llu}}",
+                whole ? "frame" : stages[e.stage]->name.c_str(), whole ? "frame" : "stage", whole ? stages.size() : (size_t)e.stage,
+                (long long)e.startUs, (long long)e.durationUs, (unsigned long long)e.frame);
+    }
+    fprintf(fp, "\n]}\n");
+    return commitTemp(fp, filename);
+}
+
+void PipelineMetrics::exportFiles() const
+{
+    if (!promPath.empty())
+        writePrometheus(promPath);
+    if (!tracePath.empty() && traceEvery > 0)
+        writeChromeTrace(tracePath);
+}
+
+void PipelineMetrics::startExport(const std::string &promFile, const std::string &traceFile, int intervalMs)
+{
+    stopExport();
+    promPath = promFile;
+    tracePath = traceFile;
+    exportIntervalMs = intervalMs > 0 ? intervalMs : 1;
+    exporting = true;
+    exporter = std::thread([this] {
+        std::unique_lock<std::mutex> lock(exportMutex);
+        while (exporting)
+        {
+            exportWake.wait_for(lock, std::chrono::milliseconds(exportIntervalMs), [this] { return !exporting; });
+            exportFiles();
+        }
+    });
+}
+
+void PipelineMetrics::stopExport()
+{
+    {
+        std::lock_guard<std::mutex> lock(exportMutex);
+        if (!exporting)
+            return;
+        exporting = false;
+    }
+    exportWake.notify_all();
+    exporter.join();
+}
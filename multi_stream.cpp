@@ -0,0 +1,170 @@
+/**
+ * @file multi_stream.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Headless recognition of many cameras, videos and image directories in one process
+ * @date 2024-02-26
+ *
+ */
+#include <opencv2/opencv.hpp>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "stream_server.hpp"
+#include "feature_db.hpp"
+#include "embedder.hpp"
+
+static void usage(const char *name)
+{
+    std::cerr << "Usage: " << name << " <source> [<source> ...] [options]" << std::endl;
+    std::cerr << "  A source is a camera index, a video file or URL, or an image directory." << std::endl;
+    std::cerr << "  --out <file>        detections CSV (default detections.csv)" << std::endl;
+    std::cerr << "  --db <features>     feature database (.csv or .fdb) shared by every stream" << std::endl;
+    std::cerr << "  --model <onnx>      classify by DNN embedding instead of Hu moments" << std::endl;
+    std::cerr << "  --batch <n>         batch size the model was exported with (default 20)" << std::endl;
+    std::cerr << "  --threshold <t>     foreground threshold, or auto to follow each stream's lighting (default 100)" << std::endl;
+    std::cerr << "  --min-region <n>    smallest region in pixels (default 500)" << std::endl;
+    std::cerr << "  --workers <n>       pool threads (default all)" << std::endl;
+    std::cerr << "  --pin               pin the pool threads to cores" << std::endl;
+    std::cerr << "  --queue <n>         frames read ahead per video or directory (default 2)" << std::endl;
+    std::cerr << "  --incremental       only recompute the tiles that changed since the last frame" << std::endl;
+    std::cerr << "  --metrics <prefix>  write <prefix>.prom and <prefix>_trace.json every 5 s" << std::endl;
+    std::cerr << "  --trace-every <n>   frames between traced frames of each stream (default 100)" << std::endl;
+}
+
+static StreamServer *activeServer = nullptr;
+
+static void onSignal(int)
+{
+    if (activeServer)
+        activeServer->stop();
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> sources;
+    std::string out_file = "detections.csv", db_file, model_file, metrics_prefix;
+    int exported_batch = 20, trace_every = 100;
+    StreamParams params;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) {
+            sources.push_back(arg);
+            continue;
+        }
+        if (arg == "--pin") {
+            params.pinThreads = true;
+            continue;
+        }
+        if (arg == "--incremental") {
+            params.incremental = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return -1;
+        }
+        if (arg == "--out") out_file = argv[++i];
+        else if (arg == "--db") db_file = argv[++i];
+        else if (arg == "--model") model_file = argv[++i];
+        else if (arg == "--batch") exported_batch = atoi(argv[++i]);
+        else if (arg == "--threshold") {
+            std::string t = argv[++i];
+            params.threshold = t == "auto" ? AUTO_THRESHOLD : atoi(t.c_str());
+        }
+        else if (arg == "--min-region") params.minRegionSize = atoi(argv[++i]);
+        else if (arg == "--workers") params.workers = atoi(argv[++i]);
+        else if (arg == "--queue") params.queueFrames = atoi(argv[++i]);
+        else if (arg == "--metrics") metrics_prefix = argv[++i];
+        else if (arg == "--trace-every") trace_every = atoi(argv[++i]);
+        else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (sources.empty()) {
+        usage(argv[0]);
+        return -1;
+    }
+    params.traceEvery = metrics_prefix.empty() ? 0 : trace_every;
+
+    // One copy of the database and the model for every stream
+    FeatureDatabase db;
+    if (!db_file.empty() && db.open(db_file) != 0) {
+        return -1;
+    }
+    Embedder embedder;
+    if (!model_file.empty()) {
+        if (embedder.load(model_file, exported_batch) != 0) {
+            return -1;
+        }
+        if (!db.empty() && db.dimension() != embedder.dimension()) {
+            std::cerr << "Error: Feature database does not match the model" << std::endl;
+            return -1;
+        }
+    }
+    else if (!db.empty() && db.dimension() != 7) {
+        std::cerr << "Error: Feature database does not hold Hu moments; pass --model" << std::endl;
+        return -1;
+    }
+
+    StreamServer server(params, db.empty() ? nullptr : &db, model_file.empty() ? nullptr : &embedder);
+    for (const std::string &source : sources) {
+        if (server.addStream(source) < 0) {
+            return -1;
+        }
+    }
+
+    FILE *out = fopen(out_file.c_str(), "w");
+    if (!out) {
+        std::cerr << "Error: Unable to open " << out_file << std::endl;
+        return -1;
+    }
+    fprintf(out, "stream,frame,track,label,distance,x,y,w,h\n");
+    std::mutex out_mutex;
+    server.setCallback([&](int stream, const FrameData &d) {
+        std::lock_guard<std::mutex> lock(out_mutex);
+        for (size_t i = 0; i < d.features.size(); i++) {
+            const RegionFeatures &f = d.features[i];
+            auto region = d.regions.find(f.label);
+            fprintf(out, "%d,%llu,%d,%s,%.6g,%d,%d,%d,%d\n", stream, (unsigned long long)d.index,
+                    region != d.regions.end() ? region->second.trackId : -1,
+                    d.matchLabels[i].c_str(), d.matchDistances[i],
+                    f.boundingBox.x, f.boundingBox.y, f.boundingBox.width, f.boundingBox.height);
+        }
+    });
+
+    if (!metrics_prefix.empty()) {
+        server.metrics().startExport(metrics_prefix + ".prom", metrics_prefix + "_trace.json");
+    }
+
+    // Ctrl+C finishes the frames already read and prints the summary
+    activeServer = &server;
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+
+    auto start = std::chrono::steady_clock::now();
+    server.run();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    activeServer = nullptr;
+    server.metrics().stopExport();
+    fclose(out);
+
+    // Throughput and latency of every stream
+    uint64_t total = 0;
+    for (int i = 0; i < server.streamCount(); i++) {
+        const LatencyHistogram &h = server.metrics().stageLatency(server.metricsStage(i));
+        total += server.frames(i);
+        printf("%3d %-24s %7llu frames %7.1f fps  p50 %7.2f ms  p99 %7.2f ms  dropped %llu\n", i,
+               server.streamName(i).c_str(), (unsigned long long)server.frames(i),
+               seconds > 0 ? server.frames(i) / seconds : 0.0, h.percentile(50) * 1e-6, h.percentile(99) * 1e-6,
+               (unsigned long long)server.dropped(i));
+    }
+    printf("%llu frames from %d streams in %.2f s: %.1f fps, %llu tasks stolen\n", (unsigned long long)total,
+           server.streamCount(), seconds, seconds > 0 ? total / seconds : 0.0, (unsigned long long)server.steals());
+    printf("Detections written to %s\n", out_file.c_str());
+    return 0;
+}
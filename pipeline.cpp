@@ -0,0 +1,294 @@
+/**
+ * @file pipeline.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Multi-threaded frame pipeline
+ * @date 2024-02-26
+ * 
+ */
+
+#include "pipeline.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+Pipeline::~Pipeline()
+{
+    stop();
+}
+
+void Pipeline::addStage(const std::string &name, StageFunction fn, size_t capacity, QueuePolicy policy)
+{
+    std::unique_ptr<Stage> stage(new Stage());
+    stage->name = name;
+    stage->fn = fn;
+    stage->capacity = capacity;
+    stage->policy = policy;
+    stages.push_back(std::move(stage));
+}
+
+void Pipeline::stop()
+{
+    stopping.store(true);
+    for (auto &stage : stages)
+        if (stage->input)
+            stage->input->close();
+}
+
+void Pipeline::setMetrics(PipelineMetrics *metrics)
+{
+    recorder = metrics;
+    if (recorder)
+        for (auto &stage : stages)
+            stage->metricsId = recorder->addStage(stage->name);
+}
+
+bool Pipeline::process(Stage &stage, FrameData &item)
+{
+    auto start = std::chrono::steady_clock::now();
+    bool ok = stage.fn(item);
+    auto end = std::chrono::steady_clock::now();
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    stage.busyUs.fetch_add((uint64_t)us, std::memory_order_relaxed);
+    stage.frames.fetch_add(1, std::memory_order_relaxed);
+    if (recorder)
+        recorder->recordStage(stage.metricsId, item.index, start, end);
+    return ok;
+}
+
+void Pipeline::runStage(size_t i)
+{
+    Stage &stage = *stages[i];
+    SpscRing<FrameData> *output = i + 1 < stages.size() ? stages[i + 1]->input.get() : nullptr;
+    uint64_t next = 0;
+    while (!stopping.load())
+    {
+        FrameData item;
+        if (i == 0)
+        {
+            item.index = next++;
+            item.captured = std::chrono::steady_clock::now();
+        }
+        else if (!stage.input->pop(item))
+            break;
+
+        // The source ending lets the queued frames drain; any other stage aborts the run
+        if (!process(stage, item))
+        {
+            if (i != 0)
+                stop();
+            break;
+        }
+        if (!output)
+        {
+            if (recorder)
+                recorder->recordFrame(item.index, item.captured, item.regions.size());
+            continue;
+        }
+
+        // Drops happen inside push(), on this thread, so the difference is exact
+        uint64_t dropped = output->dropped();
+        bool pushed = output->push(std::move(item));
+        if (recorder && output->dropped() != dropped)
+            recorder->recordDrops(stages[i + 1]->metricsId, output->dropped() - dropped);
+        if (!pushed)
+            break;
+    }
+
+    // Let the next stage drain what is queued and then finish
+    if (output)
+        output->close();
+}
+
+int Pipeline::run()
+{
+    if (stages.empty())
+        return (-1);
+    stopping.store(false);
+    for (size_t i = 1; i < stages.size(); i++)
+        stages[i]->input.reset(new SpscRing<FrameData>(stages[i]->capacity, stages[i]->policy));
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i + 1 < stages.size(); i++)
+        threads.emplace_back(&Pipeline::runStage, this, i);
+    runStage(stages.size() - 1);
+
+    stop();
+    for (std::thread &t : threads)
+        t.join();
+    return (0);
+}
+
+std::vector<StageStats> Pipeline::stats() const
+{
+    std::vector<StageStats> result;
+    for (const auto &stage : stages)
+    {
+        StageStats s;
+        s.name = stage->name;
+        s.frames = stage->frames.load();
+        s.dropped = stage->input ? stage->input->dropped() : 0;
+        s.busyMs = stage->busyUs.load() / 1000.0;
+        result.push_back(s);
+    }
+    return result;
+}
+
+// Milliseconds since a start time
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void addSegmentationStages(Pipeline &pipeline, int threshold, int minRegionSize, QueuePolicy sourcePolicy, FrameScheduler *scheduler)
+{
+    // Each stage keeps its own operator buffers and, for the preprocess stage,
+    // the lighting average; both are touched only by that stage's thread
+    std::shared_ptr<FilterBuffers> preprocessBuffers = std::make_shared<FilterBuffers>();
+    std::shared_ptr<AutoThreshold> lighting = threshold == AUTO_THRESHOLD ? std::make_shared<AutoThreshold>() : nullptr;
+    pipeline.addStage("preprocess", [threshold, preprocessBuffers, lighting](FrameData &d) {
+        if (!d.decision.process)
+            return true;
+        auto start = std::chrono::steady_clock::now();
+        int level = threshold;
+        if (lighting)
+            level = lighting->update(d.frame);
+        cv::Mat src = d.frame;
+        if (d.decision.scale != 1.0)
+            cv::resize(d.frame, src, cv::Size(), d.decision.scale, d.decision.scale, cv::INTER_AREA);
+
+        // Threshold, dilate (5, 8-connected) and erode (5, 4-connected) into a packed mask
+        preprocessFrame(src, d.binary, level, 5, 8, 5, 4, preprocessBuffers.get());
+        d.processMs = std::max(d.processMs, elapsedMs(start));
+        return true;
+    }, 2, sourcePolicy);
+
+    // The tracker and the previous regions are only touched by this stage's thread
+    std::shared_ptr<RegionTracker> tracker = std::make_shared<RegionTracker>();
+    std::shared_ptr<std::map<int, RegionInfo>> prevRegions = std::make_shared<std::map<int, RegionInfo>>();
+    std::shared_ptr<double> lastScale = std::make_shared<double>(1.0);
+    std::shared_ptr<FilterBuffers> segmentBuffers = std::make_shared<FilterBuffers>();
+    pipeline.addStage("segment", [tracker, prevRegions, lastScale, segmentBuffers, minRegionSize](FrameData &d) {
+        if (!d.decision.process)
+            return true;
+        auto start = std::chrono::steady_clock::now();
+        double scale = d.decision.scale;
+        if (scale != *lastScale)
+        {
+            tracker->rescale(scale / *lastScale);
+            *lastScale = scale;
+        }
+        segmentObjects(d.binary, d.segmented, (int)(minRegionSize * scale * scale), *prevRegions, *tracker, d.runs,
+                       segmentBuffers.get());
+        d.regions = *prevRegions;
+        d.processMs = std::max(d.processMs, elapsedMs(start));
+        return true;
+    });
+
+    // Skipped frames are drawn with the results of the last processed one
+    std::shared_ptr<FrameData> last = std::make_shared<FrameData>();
+    pipeline.addStage("features", [last, scheduler](FrameData &d) {
+        if (!d.decision.process)
+        {
+            d.regions = last->regions;
+            d.features = last->features;
+            d.segmented = last->segmented;
+            return true;
+        }
+        auto start = std::chrono::steady_clock::now();
+        d.features = d.runs.features(d.regions);
+        scaleFeatures(d.features, 1.0 / d.decision.scale);
+        d.processMs = std::max(d.processMs, elapsedMs(start));
+        if (scheduler)
+            scheduler->report(d.decision, d.processMs);
+        last->regions = d.regions;
+        last->features = d.features;
+        last->segmented = d.segmented;
+        return true;
+    });
+}
+
+void addIncrementalStages(Pipeline &pipeline, const IncrementalParams &params, QueuePolicy sourcePolicy, FrameScheduler *scheduler)
+{
+    // The segmenter, tracker and last results are only touched by this stage's thread
+    struct State {
+        IncrementalParams base;
+        IncrementalSegmenter segmenter;
+        RegionTracker tracker;
+        double scale = 1.0;
+        FrameData last;
+        std::unique_ptr<AutoThreshold> lighting;
+        explicit State(const IncrementalParams &p) : base(p), segmenter(p)
+        {
+            if (p.threshold == AUTO_THRESHOLD)
+            {
+                // Each new value recomputes a full frame, so noise must not move it
+                lighting.reset(new AutoThreshold());
+                lighting->setHysteresis(p.thresholdHysteresis);
+            }
+        }
+    };
+    std::shared_ptr<State> state = std::make_shared<State>(params);
+    pipeline.addStage("segment", [state, scheduler](FrameData &d) {
+        if (!d.decision.process)
+        {
+            d.regions = state->last.regions;
+            d.features = state->last.features;
+            d.segmented = state->last.segmented;
+            return true;
+        }
+        auto start = std::chrono::steady_clock::now();
+        double scale = d.decision.scale;
+        cv::Mat src = d.frame;
+        if (scale != state->scale)
+        {
+            // The segmenter sees a new frame size and starts over; tracks carry across
+            state->tracker.rescale(scale / state->scale);
+            state->scale = scale;
+            IncrementalParams scaled = state->base;
+            scaled.minRegionSize = (int)(state->base.minRegionSize * scale * scale);
+            state->segmenter = IncrementalSegmenter(scaled);
+        }
+        if (state->lighting)
+            state->segmenter.setThreshold(state->lighting->update(d.frame));
+        if (scale != 1.0)
+            cv::resize(d.frame, src, cv::Size(), scale, scale, cv::INTER_AREA);
+
+        state->segmenter.process(src, state->tracker);
+        d.regions = state->segmenter.regions();
+        d.features = state->segmenter.features();
+        d.segmented = state->segmenter.segmented().clone();
+        scaleFeatures(d.features, 1.0 / scale);
+        d.processMs += elapsedMs(start);
+        if (scheduler)
+            scheduler->report(d.decision, d.processMs);
+        state->last.regions = d.regions;
+        state->last.features = d.features;
+        state->last.segmented = d.segmented;
+        return true;
+    }, 2, sourcePolicy);
+}
+
+void addRecognitionStages(Pipeline &pipeline, cv::VideoCapture &cap, int threshold, int minRegionSize, FrameScheduler *scheduler,
+                          bool incremental)
+{
+    pipeline.addStage("capture", [&cap, scheduler](FrameData &d) {
+        cap >> d.frame;
+        if (scheduler)
+            d.decision = scheduler->next();
+        return !d.frame.empty();
+    });
+
+    // Capture must never wait on compute, so stale frames are dropped instead
+    if (incremental)
+    {
+        IncrementalParams params;
+        params.threshold = threshold;
+        params.minRegionSize = minRegionSize;
+        addIncrementalStages(pipeline, params, QUEUE_DROP_OLDEST, scheduler);
+    }
+    else
+    {
+        addSegmentationStages(pipeline, threshold, minRegionSize, QUEUE_DROP_OLDEST, scheduler);
+    }
+}
@@ -0,0 +1,118 @@
+/**
+ * @file pipeline_context.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Reusable buffers for the whole per-frame chain, and the allocation counter that checks them
+ * @date 2024-02-26
+ *
+ */
+
+#include "pipeline_context.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef COUNT_ALLOCATIONS
+// Every operator new of the program is counted; libstdc++'s array, nothrow
+// and sized forms all end up in these two
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+bool allocationCountingEnabled()
+{
+    return true;
+}
+
+uint64_t allocationCount()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+#else
+bool allocationCountingEnabled()
+{
+    return false;
+}
+
+uint64_t allocationCount()
+{
+    return 0;
+}
+#endif
+
+PipelineContext::PipelineContext(double gateRadius, int maxMissed)
+    : regionTracker(gateRadius, maxMissed)
+{
+}
+
+int PipelineContext::thresholding(cv::Mat &src, cv::Mat &dst, int threshold)
+{
+    return ::thresholding(src, dst, threshold, &filterBuffers);
+}
+
+int PipelineContext::thresholding(cv::Mat &src, int threshold)
+{
+    return ::thresholding(src, binary, threshold, &filterBuffers);
+}
+
+int PipelineContext::erosion(cv::Mat &src, cv::Mat &dst, int kernelSize, int connectedness)
+{
+    return ::erosion(src, dst, kernelSize, connectedness, &filterBuffers);
+}
+
+int PipelineContext::dilation(cv::Mat &src, cv::Mat &dst, int kernelSize, int connectedness)
+{
+    return ::dilation(src, dst, kernelSize, connectedness, &filterBuffers);
+}
+
+int PipelineContext::erosion(int kernelSize, int connectedness)
+{
+    return ::erosion(binary, binary, kernelSize, connectedness, &morphScratch);
+}
+
+int PipelineContext::dilation(int kernelSize, int connectedness)
+{
+    return ::dilation(binary, binary, kernelSize, connectedness, &morphScratch);
+}
+
+int PipelineContext::preprocessFrame(cv::Mat &src, int threshold, int dilateSize, int dilateConnectedness,
+                                     int erodeSize, int erodeConnectedness)
+{
+    return ::preprocessFrame(src, binary, threshold, dilateSize, dilateConnectedness, erodeSize, erodeConnectedness,
+                             &filterBuffers);
+}
+
+int PipelineContext::segmentObjects(int minRegionSize)
+{
+    return ::segmentObjects(binary, colored, minRegionSize, regionMap, regionTracker, runs, &filterBuffers);
+}
+
+const std::vector<RegionFeatures> &PipelineContext::computeAllFeatures()
+{
+    runs.features(regionMap, featureTable);
+    return featureTable;
+}
+
+int PipelineContext::process(cv::Mat &frame, int threshold, int minRegionSize)
+{
+    uint64_t before = allocationCount();
+    int status = preprocessFrame(frame, threshold);
+    if (status == 0)
+    {
+        segmentObjects(minRegionSize);
+        computeAllFeatures();
+    }
+    lastAllocations = allocationCount() - before;
+    return status;
+}
@@ -0,0 +1,454 @@
+/**
+ * @file run_labels.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Run-based connected component labeling
+ * @date 2024-02-26
+ *
+ */
+
+#include "run_labels.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+void RunMoments::addRun(int y, int x0, int x1)
+{
+    // Sums of x^k for 0 <= x < n
+    auto p1 = [](int64_t n) { return n * (n - 1) / 2; };
+    auto p2 = [](int64_t n) { return (n - 1) * n * (2 * n - 1) / 6; };
+    auto p3 = [](int64_t n) { int64_t s = n * (n - 1) / 2; return s * s; };
+
+    int64_t n = x1 - x0, yl = y;
+    int64_t s1 = p1(x1) - p1(x0), s2 = p2(x1) - p2(x0), s3 = p3(x1) - p3(x0);
+    m00 += n;
+    m10 += s1;
+    m01 += n * yl;
+    m20 += s2;
+    m11 += s1 * yl;
+    m02 += n * yl * yl;
+    m30 += s3;
+    m21 += s2 * yl;
+    m12 += s1 * yl * yl;
+    m03 += n * yl * yl * yl;
+
+    minX = std::min(minX, x0);
+    maxX = std::max(maxX, x1 - 1);
+    minY = std::min(minY, y);
+    maxY = std::max(maxY, y);
+}
+
+void RunMoments::merge(const RunMoments &o)
+{
+    m00 += o.m00; m10 += o.m10; m01 += o.m01;
+    m20 += o.m20; m11 += o.m11; m02 += o.m02;
+    m30 += o.m30; m21 += o.m21; m12 += o.m12; m03 += o.m03;
+    minX = std::min(minX, o.minX); minY = std::min(minY, o.minY);
+    maxX = std::max(maxX, o.maxX); maxY = std::max(maxY, o.maxY);
+}
+
+// Orientation of o->a->b: positive for a left turn
+static int64_t turn(cv::Point o, cv::Point a, cv::Point b)
+{
+    return (int64_t)(a.x - o.x) * (b.y - o.y) - (int64_t)(a.y - o.y) * (b.x - o.x);
+}
+
+// Convex hull of points sorted by (y, x), collinear points dropped (monotone chain)
+static void sortedHull(const std::vector<cv::Point> &points, std::vector<cv::Point> &hull)
+{
+    size_t n = points.size(), k = 0;
+    hull.resize(2 * n);
+    for (size_t i = 0; i < n; i++)
+    {
+        while (k >= 2 && turn(hull[k - 2], hull[k - 1], points[i]) <= 0)
+            k--;
+        hull[k++] = points[i];
+    }
+    for (size_t i = n - 1, lower = k + 1; i-- > 0;)
+    {
+        while (k >= lower && turn(hull[k - 2], hull[k - 1], points[i]) <= 0)
+            k--;
+        hull[k++] = points[i];
+    }
+    hull.resize(n > 1 ? k - 1 : k);
+}
+
+// Minimum-area rectangle around a convex polygon by rotating calipers: one
+// side of the best rectangle lies on a hull edge, and the three other
+// extreme vertices only move forward as the edge goes round the hull
+static cv::RotatedRect hullBox(const std::vector<cv::Point> &hull)
+{
+    size_t h = hull.size();
+    if (h == 0)
+        return cv::RotatedRect();
+    if (h == 1)
+        return cv::RotatedRect(cv::Point2f((float)hull[0].x, (float)hull[0].y), cv::Size2f(0, 0), 0);
+
+    // The normal of each edge points into the hull whichever way it winds
+    double side = h > 2 && turn(hull[0], hull[1], hull[2]) < 0 ? -1 : 1;
+    double bestArea = -1, bestX = 0, bestY = 0, bestWidth = 0, bestHeight = 0, bestAngle = 0;
+    size_t far = 1, right = 1, left = 1;
+    for (size_t i = 0; i < h; i++)
+    {
+        const cv::Point &a = hull[i], &b = hull[(i + 1) % h];
+        double length = std::sqrt((double)(b.x - a.x) * (b.x - a.x) + (double)(b.y - a.y) * (b.y - a.y));
+        double ex = (b.x - a.x) / length, ey = (b.y - a.y) / length;
+        double nx = -ey * side, ny = ex * side;
+        auto along = [&](size_t j) { const cv::Point &p = hull[j % h]; return (p.x - a.x) * ex + (p.y - a.y) * ey; };
+        auto across = [&](size_t j) { const cv::Point &p = hull[j % h]; return (p.x - a.x) * nx + (p.y - a.y) * ny; };
+
+        // The first edge searches the whole hull; later ones resume where it stopped
+        if (i == 0)
+        {
+            for (size_t j = 0; j < h; j++)
+            {
+                if (across(j) > across(far))
+                    far = j;
+                if (along(j) > along(right))
+                    right = j;
+                if (along(j) < along(left))
+                    left = j;
+            }
+        }
+        for (size_t step = 0; step < h && across(far + 1) >= across(far); step++)
+            far = (far + 1) % h;
+        for (size_t step = 0; step < h && along(right + 1) >= along(right); step++)
+            right = (right + 1) % h;
+        for (size_t step = 0; step < h && along(left + 1) <= along(left); step++)
+            left = (left + 1) % h;
+
+        double lo = along(left), hi = along(right), height = across(far);
+        double area = (hi - lo) * height;
+        if (bestArea < 0 || area < bestArea)
+        {
+            bestArea = area;
+            bestX = a.x + ex * (lo + hi) / 2 + nx * height / 2;
+            bestY = a.y + ey * (lo + hi) / 2 + ny * height / 2;
+            bestWidth = hi - lo;
+            bestHeight = height;
+            bestAngle = std::atan2(ey, ex) * 180 / CV_PI;
+        }
+    }
+
+    // A quarter turn swaps the sides, so every box has an angle in [0, 90)
+    while (bestAngle < 0)
+    {
+        bestAngle += 90;
+        std::swap(bestWidth, bestHeight);
+    }
+    while (bestAngle >= 90)
+    {
+        bestAngle -= 90;
+        std::swap(bestWidth, bestHeight);
+    }
+    return cv::RotatedRect(cv::Point2f((float)bestX, (float)bestY), cv::Size2f((float)bestWidth, (float)bestHeight),
+                           (float)bestAngle);
+}
+
+void runFeatures(const RunMoments &a, const std::vector<cv::Point> &extents, RegionFeatures &f)
+{
+    std::vector<cv::Point> hull;
+    runFeatures(a, extents, f, hull);
+}
+
+void runFeatures(const RunMoments &a, const std::vector<cv::Point> &extents, RegionFeatures &f,
+                 std::vector<cv::Point> &hull)
+{
+    if (a.m00 == 0)
+        return;
+
+    // Raw moments; cv::Moments derives the central and normalized ones
+    f.moments = cv::Moments((double)a.m00, (double)a.m10, (double)a.m01,
+                            (double)a.m20, (double)a.m11, (double)a.m02,
+                            (double)a.m30, (double)a.m21, (double)a.m12, (double)a.m03);
+    cv::HuMoments(f.moments, f.huMoments);
+
+    // Orientation of the axis of least central moment
+    f.orientation = 0.5 * std::atan2(2 * f.moments.mu11, f.moments.mu20 - f.moments.mu02);
+    f.centroid = cv::Point2d(f.moments.m10 / f.moments.m00, f.moments.m01 / f.moments.m00);
+    f.boundingBox = a.box();
+
+    // Runs are found in raster order, so the extents normally arrive sorted
+    auto raster = [](const cv::Point &p, const cv::Point &q) { return p.y < q.y || (p.y == q.y && p.x < q.x); };
+    if (std::is_sorted(extents.begin(), extents.end(), raster))
+        sortedHull(extents, hull);
+    else
+    {
+        std::vector<cv::Point> sorted(extents);
+        std::sort(sorted.begin(), sorted.end(), raster);
+        sortedHull(sorted, hull);
+    }
+    f.orientedBox = hullBox(hull);
+}
+
+// First x in [x, n) with row[x] != 0, or n
+static int skipBackground(const uchar *row, int x, int n)
+{
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= n; x += 16)
+    {
+        int background = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(row + x)), zero));
+        if (background != 0xFFFF)
+            return x + __builtin_ctz(~background);
+    }
+#endif
+    while (x < n && row[x] == 0)
+        x++;
+    return x;
+}
+
+// First x in [x, n) with row[x] == 0, or n
+static int skipForeground(const uchar *row, int x, int n)
+{
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= n; x += 16)
+    {
+        int background = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(row + x)), zero));
+        if (background != 0)
+            return x + __builtin_ctz(background);
+    }
+#endif
+    while (x < n && row[x] != 0)
+        x++;
+    return x;
+}
+
+int RunLabeling::find(int run)
+{
+    // Path halving keeps the trees flat without recursion
+    while (parent[run] != run)
+    {
+        parent[run] = parent[parent[run]];
+        run = parent[run];
+    }
+    return run;
+}
+
+void RunLabeling::joinRows(int prevBegin, int prevEnd, int begin, int end)
+{
+    // Join runs that touch a run of the row above, diagonals included. The
+    // earlier run stays the root, so every root is the first run of its component.
+    int i = prevBegin, j = begin;
+    while (i < prevEnd && j < end)
+    {
+        const LabelRun &above = runList[i], &run = runList[j];
+        if (above.x0 <= run.x1 && run.x0 <= above.x1)
+        {
+            int a = find(i), b = find(j);
+            if (a != b)
+                parent[std::max(a, b)] = std::min(a, b);
+        }
+        if (above.x1 < run.x1)
+            i++;
+        else
+            j++;
+    }
+}
+
+int RunLabeling::numberComponents()
+{
+    // Number the components in raster order and add up their runs
+    regionStats.assign(1, RunMoments());
+    for (size_t r = 0; r < runList.size(); r++)
+    {
+        int root = find((int)r);
+        LabelRun &run = runList[r];
+        if (root == (int)r)
+        {
+            run.label = (int)regionStats.size();
+            regionStats.push_back(RunMoments());
+        }
+        else
+            run.label = runList[root].label;
+        regionStats[run.label].addRun(run.y, run.x0, run.x1);
+    }
+    return count();
+}
+
+int RunLabeling::compute(const cv::Mat &binary)
+{
+    if (binary.type() != CV_8UC1)
+        return -1;
+    imageSize = binary.size();
+    runList.clear();
+    parent.clear();
+
+    int prevBegin = 0, prevEnd = 0;
+    for (int y = 0; y < binary.rows; y++)
+    {
+        const uchar *row = binary.ptr<uchar>(y);
+        int begin = (int)runList.size();
+        int x = skipBackground(row, 0, binary.cols);
+        while (x < binary.cols)
+        {
+            int end = skipForeground(row, x, binary.cols);
+            runList.push_back({y, x, end, 0});
+            parent.push_back((int)parent.size());
+            x = skipBackground(row, end, binary.cols);
+        }
+        int end = (int)runList.size();
+        joinRows(prevBegin, prevEnd, begin, end);
+        prevBegin = begin;
+        prevEnd = end;
+    }
+    return numberComponents();
+}
+
+// First set bit at or after x in a packed row of n words, or cols
+static int nextSet(const uint64_t *words, int n, int x, int cols)
+{
+    int i = x >> 6;
+    if (i >= n)
+        return cols;
+    uint64_t w = words[i] & (~0ULL << (x & 63));
+    while (!w)
+    {
+        if (++i == n)
+            return cols;
+        w = words[i];
+    }
+    return std::min(cols, i * 64 + __builtin_ctzll(w));
+}
+
+// First clear bit at or after x in a packed row of n words, or cols
+static int nextClear(const uint64_t *words, int n, int x, int cols)
+{
+    int i = x >> 6;
+    if (i >= n)
+        return cols;
+    uint64_t w = ~words[i] & (~0ULL << (x & 63));
+    while (!w)
+    {
+        if (++i == n)
+            return cols;
+        w = ~words[i];
+    }
+    return std::min(cols, i * 64 + __builtin_ctzll(w));
+}
+
+int RunLabeling::compute(const BitMask &binary)
+{
+    imageSize = binary.size();
+    runList.clear();
+    parent.clear();
+
+    // Runs are found a word at a time, so empty stretches cost one test per 64 pixels
+    int n = binary.wordsPerRow(), cols = binary.cols();
+    int prevBegin = 0, prevEnd = 0;
+    for (int y = 0; y < binary.rows(); y++)
+    {
+        const uint64_t *words = binary.row(y);
+        int begin = (int)runList.size();
+        int x = nextSet(words, n, 0, cols);
+        while (x < cols)
+        {
+            int end = nextClear(words, n, x, cols);
+            runList.push_back({y, x, end, 0});
+            parent.push_back((int)parent.size());
+            x = nextSet(words, n, end, cols);
+        }
+        int end = (int)runList.size();
+        joinRows(prevBegin, prevEnd, begin, end);
+        prevBegin = begin;
+        prevEnd = end;
+    }
+    return numberComponents();
+}
+
+template <typename T>
+static void fillRuns(cv::Mat &labels, const std::vector<LabelRun> &runs, const std::vector<int> &remap)
+{
+    for (const LabelRun &run : runs)
+    {
+        int l = remap.empty() ? run.label : remap[run.label];
+        if (l != 0)
+            std::fill(labels.ptr<T>(run.y) + run.x0, labels.ptr<T>(run.y) + run.x1, (T)l);
+    }
+}
+
+void RunLabeling::labelImage(cv::Mat &labels, const std::vector<int> &remap) const
+{
+    int maxLabel = remap.empty() ? count() - 1 : 0;
+    for (int l : remap)
+        maxLabel = std::max(maxLabel, l);
+    bool compact = maxLabel <= USHRT_MAX;
+    labels.create(imageSize, compact ? CV_16U : CV_32S);
+    labels.setTo(cv::Scalar(0));
+    if (compact)
+        fillRuns<ushort>(labels, runList, remap);
+    else
+        fillRuns<int>(labels, runList, remap);
+}
+
+void RunLabeling::paint(cv::Mat &dst, const std::vector<cv::Vec3b> &colors) const
+{
+    dst.create(imageSize, CV_8UC3);
+    dst.setTo(cv::Scalar(0, 0, 0));
+    for (const LabelRun &run : runList)
+    {
+        const cv::Vec3b &c = colors[run.label];
+        if (c == cv::Vec3b(0, 0, 0))
+            continue;
+        std::fill(dst.ptr<cv::Vec3b>(run.y) + run.x0, dst.ptr<cv::Vec3b>(run.y) + run.x1, c);
+    }
+}
+
+// Shared body of both features() overloads
+static void regionFeatures(const RunLabeling &labeling, const std::map<int, RegionInfo> &regions, std::vector<RegionFeatures> &table,
+                           std::vector<int> &slotOf, std::vector<std::vector<cv::Point>> &extents,
+                           std::vector<cv::Point> &hull)
+{
+    int count = labeling.count();
+    slotOf.assign(count, -1);
+    table.resize(regions.size());
+    size_t k = 0;
+    for (const auto &reg : regions)
+    {
+        if (reg.first > 0 && reg.first < count)
+            slotOf[reg.first] = (int)k;
+        table[k] = RegionFeatures();
+        table[k].label = reg.first;
+        k++;
+    }
+
+    // Only the hull needs the runs themselves; the sums are already per label
+    if (extents.size() < table.size())
+        extents.resize(table.size());
+    for (size_t i = 0; i < table.size(); i++)
+        extents[i].clear();
+    for (const LabelRun &run : labeling.runs())
+    {
+        int slot = slotOf[run.label];
+        if (slot < 0)
+            continue;
+        extents[slot].push_back(cv::Point(run.x0, run.y));
+        if (run.x1 - 1 != run.x0)
+            extents[slot].push_back(cv::Point(run.x1 - 1, run.y));
+    }
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        int l = table[i].label;
+        if (l > 0 && l < count)
+            runFeatures(labeling.stats(l), extents[i], table[i], hull);
+    }
+}
+
+std::vector<RegionFeatures> RunLabeling::features(const std::map<int, RegionInfo> &regions) const
+{
+    std::vector<RegionFeatures> table;
+    std::vector<int> slots;
+    std::vector<std::vector<cv::Point>> points;
+    std::vector<cv::Point> hull;
+    regionFeatures(*this, regions, table, slots, points, hull);
+    return table;
+}
+
+void RunLabeling::features(const std::map<int, RegionInfo> &regions, std::vector<RegionFeatures> &table)
+{
+    regionFeatures(*this, regions, table, slotOf, extents, hull);
+}
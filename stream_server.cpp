@@ -0,0 +1,254 @@
+/**
+ * @file stream_server.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Recognition of many cameras and videos at once on one shared pool, database and model
+ * @date 2024-02-26
+ *
+ */
+
+#include "stream_server.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include "feature_match.hpp"
+#include "frame_source.hpp"
+#include "incremental.hpp"
+#include "pipeline_context.hpp"
+
+int classifyRegions(FrameData &d, const FeatureDatabase &db, Embedder *embedder, EmbeddingBatch &batch, std::mutex *modelMutex)
+{
+    d.matchLabels.assign(d.features.size(), std::string());
+    d.matchDistances.assign(d.features.size(), -1.0f);
+    if (db.empty())
+        return 0;
+
+    if (embedder && !embedder->empty())
+    {
+        // Every region of the frame in one forward pass; only the pass itself touches the model
+        for (size_t i = 0; i < d.features.size(); i++)
+            batch.add((int)i, d.frame, d.features[i].boundingBox);
+        if (batch.empty())
+            return 0;
+        cv::Mat embeddings;
+        std::vector<int> keys;
+        int status;
+        if (modelMutex)
+        {
+            std::lock_guard<std::mutex> lock(*modelMutex);
+            status = batch.run(*embedder, embeddings, keys);
+        }
+        else
+            status = batch.run(*embedder, embeddings, keys);
+        if (status != 0)
+            return -1;
+        for (size_t r = 0; r < keys.size(); r++)
+        {
+            std::vector<FeatureMatch> m = findNearest(db, embeddings.ptr<float>((int)r), 1);
+            if (!m.empty())
+            {
+                d.matchLabels[keys[r]] = db.labels()[m[0].label];
+                d.matchDistances[keys[r]] = m[0].distance;
+            }
+        }
+        return 0;
+    }
+
+    for (size_t i = 0; i < d.features.size(); i++)
+    {
+        float hu[7];
+        std::copy(d.features[i].huMoments, d.features[i].huMoments + 7, hu);
+        std::vector<FeatureMatch> m = findNearest(db, hu, 1);
+        if (!m.empty())
+        {
+            d.matchLabels[i] = db.labels()[m[0].label];
+            d.matchDistances[i] = m[0].distance;
+        }
+    }
+    return 0;
+}
+
+// Everything one source needs; only its capture thread and its one task touch it
+struct StreamServer::Stream {
+    int index = 0;
+    int stage = 0; ///< Metrics stage of the stream.
+    FrameSource source;
+    std::unique_ptr<SpscRing<FrameData>> ring;
+    std::thread captureThread;
+    std::atomic<bool> scheduled{false};
+    std::atomic<uint64_t> processed{0};
+    uint64_t reportedDrops = 0;
+
+    // Segmentation state and buffers, reused from frame to frame
+    PipelineContext context;
+    AutoThreshold autoThreshold;
+    std::unique_ptr<IncrementalSegmenter> segmenter;
+    EmbeddingBatch batch;
+};
+
+StreamServer::StreamServer(const StreamParams &params, const FeatureDatabase *database, Embedder *model)
+    : config(params), db(database), embedder(model), recorder(params.traceEvery)
+{
+}
+
+StreamServer::~StreamServer()
+{
+    stop();
+    for (std::unique_ptr<Stream> &s : streams)
+    {
+        if (s->ring)
+            s->ring->close();
+        if (s->captureThread.joinable())
+            s->captureThread.join();
+    }
+    pool.reset();
+}
+
+int StreamServer::addStream(const std::string &spec)
+{
+    std::unique_ptr<Stream> s(new Stream());
+    if (s->source.open(spec) != 0)
+        return -1;
+    s->index = (int)streams.size();
+
+    // Cameras hand over only their newest frame; files are read a little ahead and never dropped
+    if (s->source.live())
+        s->ring.reset(new SpscRing<FrameData>(1, QUEUE_DROP_OLDEST));
+    else
+        s->ring.reset(new SpscRing<FrameData>(std::max(config.queueFrames, 1), QUEUE_BLOCK));
+    if (config.incremental)
+    {
+        IncrementalParams p;
+        p.threshold = config.threshold == AUTO_THRESHOLD ? s->autoThreshold.value() : config.threshold;
+        p.minRegionSize = config.minRegionSize;
+        s->autoThreshold.setHysteresis(p.thresholdHysteresis);
+        s->segmenter.reset(new IncrementalSegmenter(p));
+    }
+    // The same source may be opened twice, so the stage name carries the index
+    s->stage = recorder.addStage(std::to_string(s->index) + ":" + spec);
+    streams.push_back(std::move(s));
+    return (int)streams.size() - 1;
+}
+
+const std::string &StreamServer::streamName(int stream) const
+{
+    return streams[stream]->source.name();
+}
+
+uint64_t StreamServer::frames(int stream) const
+{
+    return streams[stream]->processed.load();
+}
+
+int StreamServer::metricsStage(int stream) const
+{
+    return streams[stream]->stage;
+}
+
+uint64_t StreamServer::dropped(int stream) const
+{
+    return streams[stream]->ring->dropped();
+}
+
+void StreamServer::run()
+{
+    // The streams are the parallelism; banding each frame as well would only contend
+    setFilterThreads(1);
+    setMatchThreads(1);
+    pool.reset(new WorkStealingPool(config.workers, config.pinThreads));
+
+    for (std::unique_ptr<Stream> &s : streams)
+        s->captureThread = std::thread(&StreamServer::capture, this, std::ref(*s));
+    for (std::unique_ptr<Stream> &s : streams)
+        s->captureThread.join();
+
+    // Capture is over; finish what is queued
+    pool->wait();
+}
+
+void StreamServer::capture(Stream &s)
+{
+    for (uint64_t index = 0; !stopping.load(); index++)
+    {
+        FrameData d;
+        d.index = index;
+        if (!s.source.read(d.frame))
+            break;
+        d.captured = std::chrono::steady_clock::now();
+        if (!s.ring->push(std::move(d)))
+            break;
+        schedule(s);
+    }
+    s.ring->close();
+}
+
+void StreamServer::schedule(Stream &s)
+{
+    // At most one task per stream, so its frames are processed in order
+    if (!s.scheduled.exchange(true))
+        pool->submit([this, &s] { runFrame(s); });
+}
+
+void StreamServer::runFrame(Stream &s)
+{
+    // One frame per task, so the streams sharing a worker take turns
+    FrameData d;
+    if (s.ring->tryPop(d))
+    {
+        process(s, d);
+        auto end = std::chrono::steady_clock::now();
+
+        uint64_t drops = s.ring->dropped();
+        if (drops > s.reportedDrops)
+        {
+            recorder.recordDrops(s.stage, drops - s.reportedDrops);
+            s.reportedDrops = drops;
+        }
+        recorder.recordStage(s.stage, d.index, d.captured, end);
+        recorder.recordFrame(d.index, d.captured, d.regions.size());
+        s.processed.fetch_add(1);
+        if (onFrame)
+            onFrame(s.index, d);
+
+        // Hand the tables the frame borrowed back to the context
+        if (!s.segmenter)
+        {
+            d.regions.swap(s.context.regions());
+            d.features.swap(s.context.features());
+        }
+    }
+
+    // A frame pushed before the flag was cleared found it set, so look again
+    s.scheduled.store(false);
+    if (!s.ring->empty())
+        schedule(s);
+}
+
+void StreamServer::process(Stream &s, FrameData &d)
+{
+    int threshold = config.threshold == AUTO_THRESHOLD ? s.autoThreshold.update(d.frame) : config.threshold;
+    if (s.segmenter)
+    {
+        s.segmenter->setThreshold(threshold);
+        s.segmenter->process(d.frame, s.context.tracker());
+        d.regions = s.segmenter->regions();
+        d.features = s.segmenter->features();
+        d.segmented = s.segmenter->segmented();
+    }
+    else
+    {
+        // The frame borrows the context's tables until its callback has run
+        s.context.process(d.frame, threshold, config.minRegionSize);
+        d.regions.swap(s.context.regions());
+        d.features.swap(s.context.features());
+        d.segmented = s.context.segmented();
+    }
+
+    if (db)
+        classifyRegions(d, *db, embedder, s.batch, &modelMutex);
+    else
+    {
+        d.matchLabels.assign(d.features.size(), std::string());
+        d.matchDistances.assign(d.features.size(), -1.0f);
+    }
+}
@@ -22,6 +22,7 @@ int main(int argc, char *argv[]) {
     cv::namedWindow("Thresholded Video", 1); // Window for thresholded video
 
     cv::Mat frame,thresholded_frame,dilated_img,eroded_img;
+    AutoThreshold lighting(120); // Follows the room's lighting, starting from the old fixed 120
 
     for (;;) {
         *capdev >> frame; // Get a new frame from the camera
@@ -33,7 +34,7 @@ int main(int argc, char *argv[]) {
         // Preprocess the frame (optional)
 
         // Thresholding
-        thresholding(frame,thresholded_frame,120);
+        thresholding(frame,thresholded_frame,lighting.update(frame));
         dilation(thresholded_frame,dilated_img,5,8);
         erosion(dilated_img,eroded_img,5,4);
         
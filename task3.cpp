@@ -11,6 +11,7 @@
 #include <vector>
 #include <map>
 #include "filters.hpp"
+#include "pipeline.hpp"
 
 
 
@@ -24,27 +25,17 @@ int main() {
     cv::namedWindow("Original Video", cv::WINDOW_NORMAL);
     cv::namedWindow("Segmented", cv::WINDOW_NORMAL);
 
-    cv::Mat frame, thresholded, segmented, dilated, eroded;
-    std::map<int, RegionInfo> prevRegions;
-
-    while (true) {
-        cap >> frame; // Capture frame
-        if (frame.empty()) break;
-
-        // Thresholding to separate object from background
-        thresholding(frame, thresholded, 100);
-        dilation(thresholded,dilated,5,8);
-        erosion(dilated,eroded,5,4);
-
-        // Clean up the image and segment into regions, ignoring small regions
-        segmentObjects(eroded, segmented, 500, prevRegions); // Adjust minRegionSize as needed
-
-        // Display the original and segmented video
-        cv::imshow("Original Video", frame);
-        cv::imshow("Segmented", segmented);
-
-        if (cv::waitKey(10) == 'q') break;
-    }
-
+    // Capture, thresholding with clean-up, and segmentation into regions
+    // (ignoring small ones) each run on their own thread
+    Pipeline pipeline;
+    addRecognitionStages(pipeline, cap, AUTO_THRESHOLD, 500); // Adjust minRegionSize as needed
+
+    // Display the original and segmented video
+    pipeline.addStage("render", [](FrameData &d) {
+        cv::imshow("Original Video", d.frame);
+        cv::imshow("Segmented", d.segmented);
+        return cv::waitKey(10) != 'q';
+    });
+    pipeline.run();
     return 0;
 }
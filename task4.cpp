@@ -11,8 +11,12 @@
 #include <map>
 #include <fstream>
 #include "filters.hpp"
+#include "pipeline.hpp"
+
+int main(int argc, char *argv[]) {
+    // --incremental recomputes only the tiles that changed, for a fixed camera on a mostly static scene
+    bool incremental = argc > 1 && std::string(argv[1]) == "--incremental";
 
-int main() {
     cv::VideoCapture cap(0);
     if (!cap.isOpened()) {
         std::cerr << "Error: Unable to open video device" << std::endl;
@@ -21,29 +25,36 @@ int main() {
 
     cv::namedWindow("Segmented", cv::WINDOW_AUTOSIZE);
 
-    cv::Mat frame, thresholded, segmented, eroded, dilated;
-    std::map<int, RegionInfo> prevRegions;
-
-    while (true) {
-        cap >> frame;
-        if (frame.empty()) break;
-
-        thresholding(frame, thresholded, 100);
-        dilation(thresholded, dilated, 5, 8);
-        erosion(dilated, eroded, 5, 4);
+    // Scale and frame skipping adapt so processing keeps up with the camera
+    SchedulerParams schedule;
+    double fps = cap.get(cv::CAP_PROP_FPS);
+    if (fps > 0) schedule.deadlineMs = 1000.0 / fps;
+    FrameScheduler scheduler(schedule);
 
-        cv::Mat labels = segmentObjects(eroded, segmented, 500, prevRegions);
+    // Capture and segmentation run on their own threads
+    Pipeline pipeline;
+    addRecognitionStages(pipeline, cap, AUTO_THRESHOLD, 500, &scheduler, incremental);
 
-            for (const auto& reg : prevRegions) {
-                computeFeatures(frame, labels, reg.first, reg.second.centroid, reg.second.color);
-            }
+    // Display stays on the main thread
+    pipeline.addStage("render", [](FrameData &d) {
+        for (const auto& f : d.features) {
+            drawFeatures(d.frame, f, d.regions[f.label].color);
+        }
         int key = cv::waitKey(10);
         if (key == 'q' || key == 27) { // 'q' or ESC to quit
-            break;
+            return false;
         }
 
-        cv::imshow("Original Video", frame);
-    }
+        cv::imshow("Original Video", d.frame);
+        return true;
+    });
+
+    // Stage latencies go to pipeline.prom, spans of every 100th frame to pipeline_trace.json
+    PipelineMetrics metrics(100);
+    pipeline.setMetrics(&metrics);
+    metrics.startExport("pipeline.prom", "pipeline_trace.json");
+    pipeline.run();
+    metrics.stopExport();
 
     cv::destroyAllWindows();
     return 0;
@@ -12,6 +12,8 @@
 #include <map>
 #include <string>
 #include "filters.hpp"
+#include "run_labels.hpp"
+#include "metrics.hpp"
 
 int append_image_data_csv(char *csv_file_name, std::string object_name, std::vector<float> &image_data, int reset_file)
 {
@@ -61,18 +63,41 @@ int main() {
         return -1;
     }
 
-    cv::Mat frame, thresholded, segmented, eroded, dilated;
+    cv::Mat frame, segmented, eroded;
     std::map<int, RegionInfo> prevRegions;
+    RegionTracker tracker;
+    RunLabeling labeling;
+    AutoThreshold lighting;
+
+    // Stage latencies go to pipeline.prom, spans of every 100th frame to pipeline_trace.json
+    typedef PipelineMetrics::Clock Clock;
+    PipelineMetrics metrics(100);
+    int captureStage = metrics.addStage("capture"), preprocessStage = metrics.addStage("preprocess");
+    int segmentStage = metrics.addStage("segment"), classifyStage = metrics.addStage("classify");
+    int renderStage = metrics.addStage("render");
+    metrics.startExport("pipeline.prom", "pipeline_trace.json");
+    uint64_t frameIndex = 0;
 
         while (true) {
+            Clock::time_point captured = Clock::now();
             cap >> frame;
             if (frame.empty()) break;
-
-            thresholding(frame, thresholded, 100);
-            dilation(thresholded, dilated, 5, 8);
-            erosion(dilated, eroded, 5, 4);
-
-            cv::Mat labels = segmentObjects(eroded, segmented, 500, prevRegions);
+            Clock::time_point t0 = Clock::now();
+            metrics.recordStage(captureStage, frameIndex, captured, t0);
+
+            // Threshold, dilate (5, 8-connected) and erode (5, 4-connected) in one sweep
+            preprocessFrame(frame, eroded, lighting.update(frame), 5, 8, 5, 4);
+            Clock::time_point t1 = Clock::now();
+            metrics.recordStage(preprocessStage, frameIndex, t0, t1);
+
+            segmentObjects(eroded, segmented, 500, prevRegions, tracker, labeling);
+            Clock::time_point t2 = Clock::now();
+            metrics.recordStage(segmentStage, frameIndex, t1, t2);
+
+            // Features of every region from the runs of the labeling
+            std::vector<RegionFeatures> features = labeling.features(prevRegions);
+            Clock::time_point t3 = Clock::now();
+            metrics.recordStage(classifyStage, frameIndex, t2, t3);
             int key = cv::waitKey(30);
             if (key == 'N' || key == 'n')
             {
@@ -80,14 +105,11 @@ int main() {
                 std::cout << "Enter a name/label for the moments data: ";
                 std::cin >> obj_name;
 
-                for (const auto &reg : prevRegions)
+                for (const auto &f : features)
                 {
-                  cv::Moments m = computeFeatures(frame, labels, reg.first, reg.second.centroid, reg.second.color);
-
-                  double huMoments[7];
-                  cv::HuMoments(m, huMoments);
+                  drawFeatures(frame, f, prevRegions[f.label].color);
 
-                  std::vector<float> input_data(huMoments, huMoments + 7);
+                  std::vector<float> input_data(f.huMoments, f.huMoments + 7);
                   append_image_data_csv("../data/features.csv", obj_name, input_data, 0);
                 }
                 std::cout << "DATA SAVED" << std::endl;
@@ -95,16 +117,19 @@ int main() {
             else if(key == 'q')
             {
               cv::destroyAllWindows();
+              metrics.stopExport();
               exit(0);
             }
             else
             {
-              for (const auto &reg : prevRegions)
+              for (const auto &f : features)
               {
-                computeFeatures(frame, labels, reg.first, reg.second.centroid, reg.second.color);
+                drawFeatures(frame, f, prevRegions[f.label].color);
               }
             }
             cv::imshow("Output", frame);
+            metrics.recordStage(renderStage, frameIndex, t3, Clock::now());
+            metrics.recordFrame(frameIndex++, captured, prevRegions.size());
         }
         return 0;
     }
@@ -12,302 +12,186 @@
 #include <fstream>
 #include <sstream> 
 #include "filters.hpp"
+#include "run_labels.hpp"
+#include "feature_db.hpp"
+#include "feature_match.hpp"
+#include "hnsw_index.hpp"
+#include "embedder.hpp"
+#include "frame_scheduler.hpp"
+#include <chrono>
 #include <cstdlib>
 
-std::vector<std::pair<float, std::string>> calculate_euclidean_distances(const std::vector<char *> &labels, const std::vector<std::vector<float>> &known_data, const std::vector<float> &new_value)
+// Function to compare the feature vector of the target image with the feature vectors in the database
+int compareFeatures(const std::vector<float> &targetVector, const FeatureDatabase &db, const HnswIndex &index)
 {
-    std::vector<std::pair<float, std::string>> distances;
-
-    for (size_t i = 0; i < labels.size(); ++i)
-    {
-        const std::vector<float> &data_for_label = known_data[i];
-        size_t num_features = data_for_label.size();
-        float temp = 0;
-
-        for (int j = 0; j < num_features; j++)
-        {
-            // calculating SSD
-            float diff = data_for_label[j] - new_value[j];
-            temp += diff * diff;
-        }
-        // taking square root
-        float distance = std::sqrt(temp);
-
-        distances.push_back(std::make_pair(distance, labels[i]));
-    }
-
-    return distances;
-}
-
-int getstring(FILE *fp, char os[])
-{
-  int p = 0;
-  int eol = 0;
-
-  for (;;)
+  if (db.empty() || (int)targetVector.size() != db.dimension())
   {
-    char ch = fgetc(fp);
-    if (ch == ',')
-    {
-      break;
-    }
-    else if (ch == '\n' || ch == EOF)
-    {
-      eol = 1;
-      break;
-    }
-    // printf("%c", ch ); // uncomment for debugging
-    os[p] = ch;
-    p++;
-  }
-  // printf("\n"); // uncomment for debugging
-  os[p] = '\0';
-
-  return (eol); // return true if eol
-}
-
-int getint(FILE *fp, int *v)
-{
-  char s[256];
-  int p = 0;
-  int eol = 0;
-
-  for (;;)
-  {
-    char ch = fgetc(fp);
-    if (ch == ',')
-    {
-      break;
-    }
-    else if (ch == '\n' || ch == EOF)
-    {
-      eol = 1;
-      break;
-    }
-
-    s[p] = ch;
-    p++;
-  }
-  s[p] = '\0'; // terminator
-  *v = atoi(s);
-
-  return (eol); // return true if eol
-}
-
-/*
-  Utility function for reading one float value from a CSV file
-
-  The value is stored in the v parameter
-
-  The function returns true if it reaches the end of a line or the file
- */
-int getfloat(FILE *fp, float *v)
-{
-  char s[256];
-  int p = 0;
-  int eol = 0;
-
-  for (;;)
-  {
-    char ch = fgetc(fp);
-    if (ch == ',')
-    {
-      break;
-    }
-    else if (ch == '\n' || ch == EOF)
-    {
-      eol = 1;
-      break;
-    }
-
-    s[p] = ch;
-    p++;
-  }
-  s[p] = '\0'; // terminator
-  *v = atof(s);
-
-  return (eol); // return true if eol
-}
-
-int read_image_data_csv(char *filename, std::vector<char *> &labels, std::vector<std::vector<float>> &data, int echo_file)
-{
-  FILE *fp;
-  float fval;
-  char img_file[256];
-
-  fp = fopen(filename, "r");
-  if (!fp)
-  {
-    printf("Unable to open feature file\n");
+    std::cerr << "Feature database is empty or does not match the query.\n";
     return (-1);
   }
 
-  printf("Reading %s\n", filename);
-  for (;;)
+  // printing the three best matches
+  std::vector<FeatureMatch> matches = index.search(db, targetVector.data(), 3);
+  for (const FeatureMatch &m : matches)
   {
-    std::vector<float> dvec;
-
-    // read the filename
-    if (getstring(fp, img_file))
-    {
-      break;
-    }
-
-    // read the whole feature file into memory
-    for (;;)
-    {
-      // get next feature
-      float eol = getfloat(fp, &fval);
-      dvec.push_back(fval);
-      if (eol)
-        break;
-    }
-
-    data.push_back(dvec);
-
-    char *fname = new char[strlen(img_file) + 1];
-    strcpy(fname, img_file);
-    labels.push_back(fname);
+    std::cout<<db.labels()[m.label]<<","<<m.distance<<std::endl;
   }
-  fclose(fp);
-  printf("Finished reading CSV file\n");
-
-  if (echo_file)
-  {
-    for (int i = 0; i < data.size(); i++)
-    {
-      for (int j = 0; j < data[i].size(); j++)
-      {
-        printf("%.4f  ", data[i][j]);
-      }
-      printf("\n");
-    }
-    printf("\n");
-  }
-
   return (0);
 }
 
-int saveROIs(cv::Mat &labels, cv::Mat &src, std::string object_name)
+
+// Bounding box of the region with the largest area, clipped to the frame; empty if there is none
+cv::Rect largestRegionBox(const cv::Mat &frame, const std::vector<RegionFeatures> &regionFeatures)
 {
-    // Iterate through each label
-    // Create a mask for the current label
-    cv::Mat mask = cv::Mat::zeros(labels.size(), CV_8U);
-    for (int y = 0; y < labels.rows; ++y)
+    const RegionFeatures *largest = nullptr;
+    for (const auto &f : regionFeatures)
     {
-        for (int x = 0; x < labels.cols; ++x)
+        if (!largest || f.moments.m00 > largest->moments.m00)
         {
-            if (labels.at<int>(y, x) == 1)
-            {
-                mask.at<uchar>(y, x) = 255;
-            }
+            largest = &f;
         }
     }
-
-    // Find minimum area rectangle enclosing the region
-    std::vector<cv::Point> points;
-    cv::findNonZero(mask, points);
-    cv::RotatedRect rotRect = cv::minAreaRect(points);
-
-    // Get the bounding box of the rotated rectangle
-    cv::Rect boundingBox = rotRect.boundingRect();
-
-    // Extract the region within the bounding box from the original image
-    cv::Mat roi = src(boundingBox).clone();
-
-    // Generate a file name for the ROI
-    std::string file_name = "/home/ronak/cs5330/project_3/DNN/" + object_name + ".png";
-
-    // Save the ROI to a file
-    cv::imwrite(file_name, roi);
-    return 0;
-}
-
-// Function to compare the feature vector of the target image with the feature vectors in the CSV file
-int compareFeatures(std::vector<float> targetVector, char* csvFileName)
-{
-  std::vector<char *> labels;
-  std::vector<std::vector<float>> data;
-  int echo = 0;
-  std::vector<std::pair<float, std::string>> image_ranks; // defining a vector pair (float,string)
-
-  // read the csv file
-  int result = read_image_data_csv(csvFileName, labels, data, echo);
-
-  if (result == 0)
-  {
-    image_ranks = calculate_euclidean_distances(labels,data,targetVector);
-    // image_ranks = calculate_scaled_euclidean_distances(labels,data,targetVector);
-    // sorting the vector pair in ascending order of the float values
-    sort(image_ranks.begin(), image_ranks.end());
-
-    std::cout<<image_ranks[0].second<<","<<image_ranks[0].first<<std::endl;
-    std::cout<<image_ranks[1].second<<","<<image_ranks[1].first<<std::endl;
-    std::cout<<image_ranks[2].second<<","<<image_ranks[2].first<<std::endl;
-    // Free allocated memory in the filenames vector
-    for (char *fname : labels)
-    {
-      delete[] fname;
-    }
-  }
-
-  else
-  {
-    std::cerr << "Error reading CSV file.\n";
-  }
-  printf("Terminating second program\n");
-  return (0);
+    return largest ? largest->boundingBox & cv::Rect(0, 0, frame.cols, frame.rows) : cv::Rect();
 }
 
-int main() {
-    cv::VideoCapture cap("/home/ronak/Downloads/objects.mp4");
+int main(int argc, char *argv[]) {
+    // Video to run on, given on the command line or the recording used so far
+    cv::VideoCapture cap(argc > 1 ? argv[1] : "/home/ronak/Downloads/objects.mp4");
     if (!cap.isOpened()) {
         std::cerr << "Error: Unable to open video device" << std::endl;
         return -1;
     }
     cv::namedWindow("Segmented", cv::WINDOW_AUTOSIZE);
 
-    // Load the feature database from the specified CSV file
-    cv::Mat frame, thresholded, segmented, eroded, dilated;
+    // Load the feature database once (CSV, or a .fdb written by featuredb_convert); queries are served from memory
+    const std::string db_file = "/home/ronak/cs5330/project_3/rouhe/data/features_dnn.csv";
+    FeatureDatabase db;
+    db.open(db_file);
+
+    // The ANN index is saved next to the feature file and extended with any rows added since
+    const std::string index_file = db_file + ".hnsw";
+    HnswIndex index;
+    index.load(index_file, db);
+    if (index.update(db) > 0)
+        index.save(index_file);
+
+    // The network that embedded the database, loaded once; it was exported with a batch of 20
+    Embedder embedder;
+    if (embedder.load("/home/ronak/Downloads/siamese_net_market_20.onnx", 20) != 0) {
+        return -1;
+    }
+    if (!db.empty() && db.dimension() != embedder.dimension()) {
+        std::cerr << "Error: Feature database does not match the model" << std::endl;
+        return -1;
+    }
+
+    cv::Mat frame, small, segmented, eroded;
     std::map<int, RegionInfo> prevRegions;
+    RegionTracker tracker;
+    RunLabeling labeling;
+    AutoThreshold lighting;
+    std::vector<float> features;
+    bool identify = false;
+    EmbeddingBatch batch;
+    batch.reserve(16);
+    cv::Mat embeddings;
+    std::vector<int> embedding_labels;
+
+    // Scale, frame skipping and identification rate adapt to keep up with the camera
+    typedef std::chrono::steady_clock Clock;
+    SchedulerParams schedule;
+    double fps = cap.get(cv::CAP_PROP_FPS);
+    if (fps > 0)
+        schedule.deadlineMs = 1000.0 / fps;
+    FrameScheduler scheduler(schedule);
+    double lastScale = 1.0;
+
+    // Overlay of the last processed frame, redrawn on skipped frames; labels follow tracks
+    std::vector<RegionFeatures> regionFeatures;
+    std::map<int, std::string> match_labels;
 
     while (true) {
         cap >> frame;
-        cv::resize(frame,frame,cv::Size(480,480));
-
         if (frame.empty()) break;
-        thresholding(frame, thresholded, 100);
-        dilation(thresholded, dilated, 5, 8);
-        erosion(dilated, eroded, 5, 4);
-        cv::Mat labels = segmentObjects(eroded, segmented, 500, prevRegions);
+        FrameDecision decision = scheduler.next();
+
+        if (decision.process)
+        {
+            Clock::time_point start = Clock::now();
+            if (decision.scale != lastScale)
+            {
+                tracker.rescale(decision.scale / lastScale);
+                lastScale = decision.scale;
+            }
+            if (decision.scale != 1.0)
+                cv::resize(frame, small, cv::Size(), decision.scale, decision.scale, cv::INTER_AREA);
+            else
+                small = frame;
+
+            // Threshold, dilate (5, 8-connected) and erode (5, 4-connected) in one sweep.
+            // The smallest region keeps the share of the frame it had at 480x480.
+            preprocessFrame(small, eroded, lighting.update(small), 5, 8, 5, 4);
+            int minRegion = (int)(500.0 * small.total() / (480.0 * 480.0));
+            segmentObjects(eroded, segmented, minRegion, prevRegions, tracker, labeling);
+            regionFeatures = labeling.features(prevRegions);
+            scaleFeatures(regionFeatures, 1.0 / decision.scale);
+            double processMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+            // Embed every region in one forward pass, from the full-resolution frame
+            start = Clock::now();
+            if (identify && decision.classify)
+            {
+                match_labels.clear();
+                for (const auto &f : regionFeatures)
+                {
+                    batch.add(f.label, frame, f.boundingBox & cv::Rect(0, 0, frame.cols, frame.rows));
+                }
+                if (!batch.empty() && batch.run(embedder, embeddings, embedding_labels) == 0)
+                {
+                    for (size_t i = 0; i < embedding_labels.size(); i++)
+                    {
+                        std::vector<FeatureMatch> matches = index.search(db, embeddings.ptr<float>((int)i), 1);
+                        if (!matches.empty())
+                            match_labels[prevRegions[embedding_labels[i]].trackId] = db.labels()[matches[0].label];
+                    }
+                }
+            }
+            double classifyMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            scheduler.report(decision, processMs, classifyMs);
+        }
+        cv::Rect box = largestRegionBox(frame, regionFeatures);
 
         char key = static_cast<char>(cv::waitKey(1));
-        if (key == 'a')
+        if (key == 'a' && box.area() > 0)
         {   
             std::string obj_name;
             std::cout<<"Enter name of object to save (Enter <objectname>_idx): ";
             std::cin >> obj_name;
-            std::string file_name = "anchors/" + obj_name;
-            saveROIs(labels,frame,file_name);
+
+            // Embed the region and enroll it under the name before the index suffix
+            if (embedder.embed(frame, box, features) == 0 && db.add(obj_name.substr(0, obj_name.find('_')), features) == 0)
+            {
+                index.update(db);
+                db.saveCsv(db_file);
+                index.save(index_file);
+            }
         }
         else if (key == 'i')
         {
-            std::string file_name = "query/unkown";
-            saveROIs(labels,frame,file_name);
-            
-            //Run the python script to save feature vectors for query and anchor images
-            system("python3 /home/ronak/cs5330/project_3/rouhe/onnx_inference.py");
-            std::vector<char *> name;
-            std::vector<std::vector<float>> data;
-            read_image_data_csv("/home/ronak/cs5330/project_3/rouhe/data/features_query_dnn.csv",name,data,0);
-            compareFeatures(data[0],"/home/ronak/cs5330/project_3/rouhe/data/features_dnn.csv");
-
+            // Toggle identification of every region; print the three best matches for the largest one
+            identify = !identify;
+            match_labels.clear();
+            if (identify && box.area() > 0 && embedder.embed(frame, box, features) == 0)
+                compareFeatures(features, db, index);
         }
-        else
+
+        for (const auto &f : regionFeatures)
         {
-            for (const auto &reg : prevRegions)
+            drawFeatures(frame, f, prevRegions[f.label].color);
+            auto m = match_labels.find(prevRegions[f.label].trackId);
+            if (m != match_labels.end())
             {
-                computeFeatures(frame, labels, reg.first, reg.second.centroid, reg.second.color);
+                cv::putText(frame, m->second, cv::Point(f.boundingBox.x, std::max(f.boundingBox.y - 8, 16)), cv::FONT_HERSHEY_SIMPLEX, 0.7, cv::Scalar(0, 255, 255), 2);
             }
         }
 
@@ -0,0 +1,116 @@
+/**
+ * @file thread_pool.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Reusable worker pool used to run image operators over row bands
+ * @date 2024-02-26
+ * 
+ */
+
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+// Set on pool threads so nested parallelFor() calls run inline
+static thread_local bool insidePool = false;
+
+ThreadPool::ThreadPool(int numThreads)
+{
+    if (numThreads <= 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    // The calling thread is the last worker
+    for (int i = 1; i < numThreads; i++)
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &t : workers)
+        t.join();
+}
+
+void ThreadPool::parallelFor(int n, const std::function<void(int)> &fn)
+{
+    if (n <= 0)
+        return;
+
+    // Nothing to share the work with
+    if (workers.empty() || n == 1 || insidePool)
+    {
+        for (int i = 0; i < n; i++)
+            fn(i);
+        return;
+    }
+
+    std::lock_guard<std::mutex> call(callMutex);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &fn;
+        jobSize = n;
+        nextIndex = 0;
+        active = (int)workers.size();
+        error = nullptr;
+        generation++;
+    }
+    wake.notify_all();
+
+    // Help out, then wait for the workers to drain
+    insidePool = true;
+    runTasks();
+    insidePool = false;
+
+    std::exception_ptr failure;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return active == 0; });
+        job = nullptr;
+        failure = error;
+    }
+    if (failure)
+        std::rethrow_exception(failure);
+}
+
+void ThreadPool::workerLoop()
+{
+    insidePool = true;
+    unsigned long seen = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+        }
+
+        runTasks();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--active == 0)
+            done.notify_one();
+    }
+}
+
+void ThreadPool::runTasks()
+{
+    // Tasks are handed out one index at a time until none are left
+    for (int i = nextIndex.fetch_add(1); i < jobSize; i = nextIndex.fetch_add(1))
+    {
+        try
+        {
+            (*job)(i);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+}
@@ -0,0 +1,305 @@
+/**
+ * @file tracker.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Region tracker that keeps persistent IDs for segmented objects across frames
+ * @date 2024-02-26
+ * 
+ */
+
+#include "tracker.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+
+int UniformGrid::cellOf(double v, int n) const
+{
+    int c = (int)std::floor(v / cell);
+    return std::min(std::max(c, 0), n - 1);
+}
+
+void UniformGrid::build(const std::vector<cv::Point2d> &points, double cellSize, cv::Size bounds)
+{
+    pts = points;
+    cell = std::max(cellSize, 1.0);
+    gridW = std::max(1, (int)std::ceil(bounds.width / cell));
+    gridH = std::max(1, (int)std::ceil(bounds.height / cell));
+
+    // Counting sort of the points by cell
+    cellIdx.resize(pts.size());
+    cellStart.assign((size_t)gridW * gridH + 1, 0);
+    for (size_t i = 0; i < pts.size(); i++)
+    {
+        cellIdx[i] = cellOf(pts[i].y, gridH) * gridW + cellOf(pts[i].x, gridW);
+        cellStart[cellIdx[i] + 1]++;
+    }
+    std::partial_sum(cellStart.begin(), cellStart.end(), cellStart.begin());
+    entries.resize(pts.size());
+    fill.assign(cellStart.begin(), cellStart.end() - 1);
+    for (size_t i = 0; i < pts.size(); i++)
+        entries[fill[cellIdx[i]]++] = (int)i;
+}
+
+void UniformGrid::query(const cv::Point2d &p, double radius, std::vector<int> &out) const
+{
+    if (pts.empty())
+        return;
+    int x0 = cellOf(p.x - radius, gridW), x1 = cellOf(p.x + radius, gridW);
+    int y0 = cellOf(p.y - radius, gridH), y1 = cellOf(p.y + radius, gridH);
+    for (int cy = y0; cy <= y1; cy++)
+    {
+        for (int cx = x0; cx <= x1; cx++)
+        {
+            int c = cy * gridW + cx;
+            for (int k = cellStart[c]; k < cellStart[c + 1]; k++)
+            {
+                int i = entries[k];
+                if (cv::norm(pts[i] - p) < radius)
+                    out.push_back(i);
+            }
+        }
+    }
+}
+
+// Union-find root with path halving
+static int findRoot(std::vector<int> &parent, int i)
+{
+    while (parent[i] != i)
+        i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+RegionTracker::RegionTracker(double gateRadius, int maxMissed)
+    : gate(gateRadius), maxMissed(maxMissed)
+{
+}
+
+void RegionTracker::reset()
+{
+    trackList.clear();
+    nextId = 0;
+}
+
+void RegionTracker::rescale(double factor)
+{
+    // The gate is in the same pixels as the centroids, so it keeps covering the same distance in the scene
+    gate *= factor;
+    for (Track &tr : trackList)
+        tr.centroid = cv::Point2d(tr.centroid.x * factor, tr.centroid.y * factor);
+}
+
+cv::Vec3b RegionTracker::colorForId(int id)
+{
+    // splitmix64 of the ID, kept away from black so regions stand out
+    uint64_t z = (uint64_t)id + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return cv::Vec3b(64 + (z & 0xFF) % 192, 64 + ((z >> 8) & 0xFF) % 192, 64 + ((z >> 16) & 0xFF) % 192);
+}
+
+// Minimum-cost assignment of n rows to m >= n columns (Hungarian method with
+// potentials, O(n^2 m)). cost is row-major n x m; rowToCol receives the column of each row.
+void RegionTracker::solveAssignment(int n, int m)
+{
+    const double inf = std::numeric_limits<double>::infinity();
+    u.assign(n + 1, 0);
+    v.assign(m + 1, 0);
+    minv.resize(m + 1);
+    p.assign(m + 1, 0);
+    way.assign(m + 1, 0);
+    used.resize(m + 1);
+
+    for (int i = 1; i <= n; i++)
+    {
+        p[0] = i;
+        int j0 = 0;
+        std::fill(minv.begin(), minv.end(), inf);
+        std::fill(used.begin(), used.end(), 0);
+        do
+        {
+            used[j0] = 1;
+            int i0 = p[j0], j1 = 0;
+            double delta = inf;
+            for (int j = 1; j <= m; j++)
+            {
+                if (used[j])
+                    continue;
+                double cur = cost[(size_t)(i0 - 1) * m + (j - 1)] - u[i0] - v[j];
+                if (cur < minv[j])
+                {
+                    minv[j] = cur;
+                    way[j] = j0;
+                }
+                if (minv[j] < delta)
+                {
+                    delta = minv[j];
+                    j1 = j;
+                }
+            }
+            for (int j = 0; j <= m; j++)
+            {
+                if (used[j])
+                {
+                    u[p[j]] += delta;
+                    v[j] -= delta;
+                }
+                else
+                    minv[j] -= delta;
+            }
+            j0 = j1;
+        } while (p[j0] != 0);
+
+        // Flip the augmenting path
+        do
+        {
+            int j1 = way[j0];
+            p[j0] = p[j1];
+            j0 = j1;
+        } while (j0);
+    }
+
+    rowToCol.assign(n, -1);
+    for (int j = 1; j <= m; j++)
+        if (p[j] != 0)
+            rowToCol[p[j] - 1] = j - 1;
+}
+
+std::vector<int> RegionTracker::update(const std::vector<cv::Point2d> &centroids, cv::Size frameSize)
+{
+    std::vector<int> trackIndex;
+    update(centroids, frameSize, trackIndex);
+    return trackIndex;
+}
+
+// Stable counting sort of items by key: start gets the offset of each key in
+// items plus an end marker, and the items of a key keep their order
+static void bucketByKey(const std::vector<int> &keys, int numKeys, std::vector<int> &start, std::vector<int> &items,
+                        std::vector<int> &fill)
+{
+    start.assign(numKeys + 1, 0);
+    for (int k : keys)
+        start[k + 1]++;
+    std::partial_sum(start.begin(), start.end(), start.begin());
+    items.resize(keys.size());
+    fill.assign(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < keys.size(); i++)
+        items[fill[keys[i]]++] = (int)i;
+}
+
+void RegionTracker::update(const std::vector<cv::Point2d> &centroids, cv::Size frameSize, std::vector<int> &result)
+{
+    int numDet = (int)centroids.size();
+    int numTracks = (int)trackList.size();
+
+    // Candidate pairs within the gate, from the grid over track centroids,
+    // in one list with an offset per detection
+    trackPts.resize(numTracks);
+    for (int t = 0; t < numTracks; t++)
+        trackPts[t] = trackList[t].centroid;
+    grid.build(trackPts, gate, frameSize);
+
+    candidateStart.resize(numDet + 1);
+    candidates.clear();
+    for (int d = 0; d < numDet; d++)
+    {
+        candidateStart[d] = (int)candidates.size();
+        grid.query(centroids[d], gate, candidates);
+    }
+    candidateStart[numDet] = (int)candidates.size();
+
+    // Group detections and tracks that compete for each other; nodes are
+    // detections [0, numDet) followed by tracks
+    parent.resize(numDet + numTracks);
+    std::iota(parent.begin(), parent.end(), 0);
+    for (int d = 0; d < numDet; d++)
+        for (int k = candidateStart[d]; k < candidateStart[d + 1]; k++)
+            parent[findRoot(parent, d)] = findRoot(parent, numDet + candidates[k]);
+
+    // Bucket the members of each group by root; indices stay sorted so the
+    // result is deterministic. Detections without candidates go to no group.
+    int numNodes = numDet + numTracks;
+    groupKeys.resize(numDet);
+    for (int d = 0; d < numDet; d++)
+        groupKeys[d] = candidateStart[d] < candidateStart[d + 1] ? findRoot(parent, d) : numNodes;
+    bucketByKey(groupKeys, numNodes + 1, groupDetStart, groupDets, groupFill);
+    groupKeys.resize(numTracks);
+    for (int t = 0; t < numTracks; t++)
+        groupKeys[t] = findRoot(parent, numDet + t);
+    bucketByKey(groupKeys, numNodes, groupTrackStart, groupTracks, groupFill);
+
+    assigned.assign(numDet, -1);
+    matched.assign(numTracks, 0);
+    for (int root = 0; root < numNodes; root++)
+    {
+        const int *dets = groupDets.data() + groupDetStart[root];
+        const int *tracks = groupTracks.data() + groupTrackStart[root];
+        int n = groupDetStart[root + 1] - groupDetStart[root], nt = groupTrackStart[root + 1] - groupTrackStart[root];
+        if (n == 0)
+            continue;
+
+        // Columns are the tracks plus one "unmatched" slot per detection
+        int m = nt + n;
+        const double blocked = 1e9;
+        cost.assign((size_t)n * m, blocked);
+        for (int r = 0; r < n; r++)
+        {
+            for (int k = candidateStart[dets[r]]; k < candidateStart[dets[r] + 1]; k++)
+            {
+                int t = candidates[k];
+                int c = (int)(std::lower_bound(tracks, tracks + nt, t) - tracks);
+                cost[(size_t)r * m + c] = cv::norm(centroids[dets[r]] - trackList[t].centroid);
+            }
+            for (int c = nt; c < m; c++)
+                cost[(size_t)r * m + c] = gate;
+        }
+
+        solveAssignment(n, m);
+        for (int r = 0; r < n; r++)
+        {
+            int c = rowToCol[r];
+            if (c >= 0 && c < nt && cost[(size_t)r * m + c] < gate)
+            {
+                assigned[dets[r]] = tracks[c];
+                matched[tracks[c]] = 1;
+            }
+        }
+    }
+
+    // Carry matched tracks forward, age the others and drop the stale ones
+    newIndex.assign(numTracks, -1);
+    nextList.clear();
+    for (int t = 0; t < numTracks; t++)
+    {
+        Track tr = trackList[t];
+        tr.missed = matched[t] ? 0 : tr.missed + 1;
+        if (tr.missed > maxMissed)
+            continue;
+        newIndex[t] = (int)nextList.size();
+        nextList.push_back(tr);
+    }
+
+    // Update matched tracks and start new ones for the rest
+    result.resize(numDet);
+    for (int d = 0; d < numDet; d++)
+    {
+        if (assigned[d] >= 0)
+        {
+            result[d] = newIndex[assigned[d]];
+            nextList[result[d]].centroid = centroids[d];
+        }
+        else
+        {
+            Track tr;
+            tr.id = nextId++;
+            tr.centroid = centroids[d];
+            tr.color = colorForId(tr.id);
+            tr.missed = 0;
+            result[d] = (int)nextList.size();
+            nextList.push_back(tr);
+        }
+    }
+    trackList.swap(nextList);
+}
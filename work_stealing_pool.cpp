@@ -0,0 +1,162 @@
+/**
+ * @file work_stealing_pool.cpp
+ * @author Ronak Bhanushali and Ruohe Zhou
+ * @brief Task pool with one queue per worker and stealing between them
+ * @date 2024-02-26
+ *
+ */
+
+#include "work_stealing_pool.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <iostream>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Index of the pool worker running on this thread, or -1
+static thread_local const WorkStealingPool *currentPool = nullptr;
+static thread_local int currentWorker = -1;
+
+// Pins a thread to one core; returns false where that is not supported
+static bool pinToCore(std::thread &thread, int core)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+    (void)thread;
+    (void)core;
+    return false;
+#endif
+}
+
+WorkStealingPool::WorkStealingPool(int numThreads, bool pinThreads)
+{
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    if (numThreads <= 0)
+        numThreads = cores;
+
+    for (int i = 0; i < numThreads; i++)
+        workers.emplace_back(new Worker());
+
+    // Every queue exists before any worker starts looking for work to steal
+    pinnedThreads = pinThreads;
+    for (int i = 0; i < numThreads; i++)
+    {
+        workers[i]->thread = std::thread(&WorkStealingPool::workerLoop, this, i);
+        if (pinThreads && !pinToCore(workers[i]->thread, i % cores))
+            pinnedThreads = false;
+    }
+    if (pinThreads && !pinnedThreads)
+        std::cerr << "Warning: Unable to pin the pool threads to cores" << std::endl;
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::unique_ptr<Worker> &w : workers)
+        w->thread.join();
+}
+
+void WorkStealingPool::submit(std::function<void()> task)
+{
+    int target = (currentPool == this) ? currentWorker : (int)(nextWorker.fetch_add(1) % workers.size());
+    unfinished.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(workers[target]->mutex);
+        workers[target]->tasks.push_back(std::move(task));
+    }
+    queued.fetch_add(1);
+
+    // Taking the lock orders the count before a worker's check for work
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    wake.notify_one();
+}
+
+void WorkStealingPool::wait()
+{
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    idle.wait(lock, [this] { return unfinished.load() == 0; });
+}
+
+bool WorkStealingPool::take(int index, std::function<void()> &task)
+{
+    // Oldest task of the own queue first
+    {
+        Worker &own = *workers[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            queued.fetch_sub(1);
+            return true;
+        }
+    }
+
+    // Then the newest task of the next busy queue
+    int n = (int)workers.size();
+    for (int k = 1; k < n; k++)
+    {
+        Worker &victim = *workers[(index + k) % n];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            queued.fetch_sub(1);
+            stealCount.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::workerLoop(int index)
+{
+    currentPool = this;
+    currentWorker = index;
+    for (;;)
+    {
+        std::function<void()> task;
+        if (!take(index, task))
+        {
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this] { return stopping || queued.load() > 0; });
+            if (stopping && queued.load() == 0)
+                return;
+            continue;
+        }
+
+        try
+        {
+            task();
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: Pool task failed: " << e.what() << std::endl;
+        }
+        catch (...)
+        {
+            std::cerr << "Error: Pool task failed" << std::endl;
+        }
+        task = nullptr;
+
+        if (unfinished.fetch_sub(1) == 1)
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            idle.notify_all();
+        }
+    }
+}